@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+
+#include "BootWatcher.hh"
+
+#define BOOT_MANAGER_SERVICE "org.webosports.bootmgr"
+
+namespace mediascanner {
+
+BootWatcher::BootWatcher(MojService &service) :
+    service(service),
+    status_slot(this, &BootWatcher::handleStatus),
+    boot_timeout(0)
+{
+}
+
+BootWatcher::~BootWatcher()
+{
+    if (boot_timeout)
+        g_source_remove(boot_timeout);
+}
+
+MojErr BootWatcher::start(guint timeoutSeconds, const std::function<void()> &booted)
+{
+    this->booted = booted;
+    boot_timeout = g_timeout_add_seconds(timeoutSeconds, timeoutExpired, this);
+
+    MojErr err = service.createRequest(request);
+    MojErrCheck(err);
+
+    MojObject payload;
+    err = payload.putBool("subscribe", true);
+    MojErrCheck(err);
+
+    err = request->send(status_slot, BOOT_MANAGER_SERVICE, "getStatus", payload,
+                        MojServiceRequest::Unlimited);
+    MojErrCheck(err);
+
+    return MojErrNone;
+}
+
+MojErr BootWatcher::handleStatus(MojObject &response, MojErr responseErr)
+{
+    // Without a boot manager we wait for the timeout
+    if (responseErr != MojErrNone) {
+        MojString errorText;
+        bool found = false;
+        response.get("errorText", errorText, found);
+        g_warning("Could not get the boot status (error %d: %s), waiting for the timeout",
+                  (int) responseErr, found ? errorText.data() : "unknown");
+        return MojErrNone;
+    }
+
+    MojString state;
+    bool found = false;
+    MojErr err = response.get("state", state, found);
+    MojErrCheck(err);
+
+    if (found && (state == "normal" || state == "firstuse")) {
+        printf("System finished booting.\n");
+        finish();
+    }
+
+    return MojErrNone;
+}
+
+gboolean BootWatcher::timeoutExpired(gpointer user_data)
+{
+    BootWatcher *watcher = static_cast<BootWatcher*>(user_data);
+
+    watcher->boot_timeout = 0;
+    watcher->finish();
+
+    return FALSE;
+}
+
+void BootWatcher::finish()
+{
+    if (!booted)
+        return;
+
+    if (boot_timeout) {
+        g_source_remove(boot_timeout);
+        boot_timeout = 0;
+    }
+    status_slot.cancel();
+
+    std::function<void()> callback;
+    callback.swap(booted);
+    callback();
+}
+
+}
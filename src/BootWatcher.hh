@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOOTWATCHER_HH
+#define BOOTWATCHER_HH
+
+#include <functional>
+
+#include <glib.h>
+#include <core/MojService.h>
+#include <core/MojServiceMessage.h>
+
+namespace mediascanner {
+
+/*
+ * Tells once the system is done booting, or the timeout expired when
+ * nobody says so. The boot manager is asked for its state which is
+ * reported as "normal" or "firstuse" once the UI is up.
+ */
+class BootWatcher : public MojSignalHandler
+{
+public:
+    BootWatcher(MojService &service);
+    ~BootWatcher();
+
+    MojErr start(guint timeoutSeconds, const std::function<void()> &booted);
+
+private:
+    MojErr handleStatus(MojObject &response, MojErr responseErr);
+    static gboolean timeoutExpired(gpointer user_data);
+    void finish();
+
+    MojService &service;
+    MojRefCountedPtr<MojServiceRequest> request;
+    MojServiceRequest::ReplySignal::Slot<BootWatcher> status_slot;
+    guint boot_timeout;
+    std::function<void()> booted;
+};
+
+}
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "DatabaseClient.hh"
+
+namespace mediascanner {
+
+LunaDatabaseClient::LunaDatabaseClient(MojDbServiceClient& client) :
+    client(client)
+{
+}
+
+MojErr LunaDatabaseClient::find(SlotRef handler, const MojDbQuery& query, bool watch, bool returnCount)
+{
+    return client.find(handler, query, watch, returnCount);
+}
+
+MojErr LunaDatabaseClient::put(SlotRef handler, const MojObject* begin, const MojObject* end)
+{
+    return client.put(handler, begin, end);
+}
+
+MojErr LunaDatabaseClient::merge(SlotRef handler, const MojObject* begin, const MojObject* end)
+{
+    return client.merge(handler, begin, end);
+}
+
+MojErr LunaDatabaseClient::del(SlotRef handler, const MojObject* idsBegin, const MojObject* idsEnd,
+                               MojUInt32 flags)
+{
+    return client.del(handler, idsBegin, idsEnd, flags);
+}
+
+MojErr LunaDatabaseClient::del(SlotRef handler, const MojDbQuery& query, MojUInt32 flags)
+{
+    return client.del(handler, query, flags);
+}
+
+MojErr LunaDatabaseClient::putKind(SlotRef handler, const MojObject& kind)
+{
+    return client.putKind(handler, kind);
+}
+
+MojErr LunaDatabaseClient::delKind(SlotRef handler, const MojChar* kindId)
+{
+    return client.delKind(handler, kindId);
+}
+
+MojErr LunaDatabaseClient::putPermissions(SlotRef handler, const MojObject& permissions)
+{
+    MojObject perms;
+    MojErr err = perms.put("permissions", permissions);
+    MojErrCheck(err);
+
+    MojRefCountedPtr<MojServiceRequest> request;
+    err = client.service()->createRequest(request);
+    MojErrCheck(err);
+
+    return request->send(handler, "com.palm.db", "putPermissions", perms);
+}
+
+}
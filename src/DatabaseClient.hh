@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DATABASECLIENT_HH
+#define DATABASECLIENT_HH
+
+#include <db/MojDbClient.h>
+#include <db/MojDbServiceClient.h>
+
+namespace mediascanner {
+
+/*
+ * The calls the media database commands make against com.palm.db. Replies
+ * come back through the slot just like with a MojDbClient.
+ */
+class DatabaseClient
+{
+public:
+    typedef MojDbClient::Signal::SlotRef SlotRef;
+
+    virtual ~DatabaseClient() {}
+
+    virtual MojErr find(SlotRef handler, const MojDbQuery& query,
+                        bool watch = false, bool returnCount = false) = 0;
+    virtual MojErr put(SlotRef handler, const MojObject* begin, const MojObject* end) = 0;
+    virtual MojErr merge(SlotRef handler, const MojObject* begin, const MojObject* end) = 0;
+    virtual MojErr del(SlotRef handler, const MojObject* idsBegin, const MojObject* idsEnd,
+                       MojUInt32 flags = MojDbFlagNone) = 0;
+    virtual MojErr del(SlotRef handler, const MojDbQuery& query,
+                       MojUInt32 flags = MojDbFlagNone) = 0;
+    virtual MojErr putKind(SlotRef handler, const MojObject& kind) = 0;
+    virtual MojErr delKind(SlotRef handler, const MojChar* kindId) = 0;
+    // Takes the permissions array as found in our permission files
+    virtual MojErr putPermissions(SlotRef handler, const MojObject& permissions) = 0;
+};
+
+/*
+ * Talks to the real database over the bus.
+ */
+class LunaDatabaseClient : public DatabaseClient
+{
+public:
+    LunaDatabaseClient(MojDbServiceClient& client);
+
+    MojErr find(SlotRef handler, const MojDbQuery& query,
+                bool watch = false, bool returnCount = false) override;
+    MojErr put(SlotRef handler, const MojObject* begin, const MojObject* end) override;
+    MojErr merge(SlotRef handler, const MojObject* begin, const MojObject* end) override;
+    MojErr del(SlotRef handler, const MojObject* idsBegin, const MojObject* idsEnd,
+               MojUInt32 flags = MojDbFlagNone) override;
+    MojErr del(SlotRef handler, const MojDbQuery& query,
+               MojUInt32 flags = MojDbFlagNone) override;
+    MojErr putKind(SlotRef handler, const MojObject& kind) override;
+    MojErr delKind(SlotRef handler, const MojChar* kindId) override;
+    MojErr putPermissions(SlotRef handler, const MojObject& permissions) override;
+
+private:
+    MojDbServiceClient& client;
+};
+
+}
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "DirectoryWalker.hh"
+
+using namespace std;
+
+namespace mediascanner {
+
+struct DirectoryFrame {
+    DIR *dir;
+    // Length of the directory's path in the shared buffer
+    size_t pathLength;
+};
+
+static DIR* openDirectory(int parentFd, const char *name, int flags)
+{
+    int fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | flags);
+    if (fd == -1)
+        return nullptr;
+
+    DIR *dir = fdopendir(fd);
+    if (!dir)
+        close(fd);
+    return dir;
+}
+
+void DirectoryWalker::walk(const string &root)
+{
+    string path;
+    path.reserve(PATH_MAX);
+    path.assign(root);
+    while (path.size() > 1 && path[path.size() - 1] == '/')
+        path.resize(path.size() - 1);
+
+    vector<DirectoryFrame> stack;
+
+    // The root may well be a symlink, only the entries below are skipped
+    DIR *rootDir = openDirectory(AT_FDCWD, path.c_str(), 0);
+    if (!rootDir)
+        return;
+    if (enterDirectory && !enterDirectory(path)) {
+        closedir(rootDir);
+        return;
+    }
+    DirectoryFrame rootFrame = { rootDir, path.size() };
+    stack.push_back(rootFrame);
+
+    while (!stack.empty()) {
+        DirectoryFrame &frame = stack.back();
+        struct dirent *entry = readdir(frame.dir);
+
+        if (!entry) {
+            path.resize(frame.pathLength);
+            closedir(frame.dir);
+            stack.pop_back();
+            if (leaveDirectory)
+                leaveDirectory(path);
+            continue;
+        }
+
+        if (entry->d_name[0] == '.') // Ignore hidden entries and also "." and "..".
+            continue;
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            // Not every filesystem fills in the type
+            struct stat statbuf;
+            if (fstatat(dirfd(frame.dir), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            if (S_ISDIR(statbuf.st_mode))
+                type = DT_DIR;
+            else if (S_ISREG(statbuf.st_mode))
+                type = DT_REG;
+        }
+
+        if (type != DT_DIR && type != DT_REG)
+            continue;
+
+        path.resize(frame.pathLength);
+        if (frame.pathLength > 1)
+            path += '/';
+        path += entry->d_name;
+
+        if (type == DT_REG) {
+            if (foundFile)
+                foundFile(path);
+            continue;
+        }
+
+        DIR *dir = openDirectory(dirfd(frame.dir), entry->d_name, O_NOFOLLOW);
+        if (!dir) {
+            if (errno == EMFILE)
+                fprintf(stderr, "Too many open directories, skipping %s\n", path.c_str());
+            continue;
+        }
+        if (enterDirectory && !enterDirectory(path)) {
+            closedir(dir);
+            continue;
+        }
+        // The reference to the current frame is invalid from here on
+        DirectoryFrame child = { dir, path.size() };
+        stack.push_back(child);
+    }
+}
+
+void removeTree(const string &root)
+{
+    DirectoryWalker walker;
+    walker.foundFile = [](const string &path) {
+        unlink(path.c_str());
+    };
+    walker.leaveDirectory = [](const string &path) {
+        rmdir(path.c_str());
+    };
+    walker.walk(root);
+}
+
+}
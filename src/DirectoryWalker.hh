@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DIRECTORYWALKER_HH
+#define DIRECTORYWALKER_HH
+
+#include <functional>
+#include <string>
+
+namespace mediascanner {
+
+/*
+ * Walks a directory tree depth first without recursion. Directories are
+ * opened relative to their parent and all paths are built in a single
+ * buffer, so the string handed to the callbacks is only valid during the
+ * call. Hidden entries and symlinks below the root are skipped, the root
+ * itself may be a symlink.
+ */
+class DirectoryWalker final {
+public:
+    // Called once the directory is opened, returning false skips it and
+    // everything below it
+    std::function<bool(const std::string &path)> enterDirectory;
+    // Called for every directory which was entered after all its entries
+    std::function<void(const std::string &path)> leaveDirectory;
+    std::function<void(const std::string &path)> foundFile;
+
+    void walk(const std::string &root);
+};
+
+// Deletes the files and directories below root and root itself. Whatever
+// the walker skips, like hidden entries, is left and keeps its directory.
+void removeTree(const std::string &root);
+
+}
+
+#endif
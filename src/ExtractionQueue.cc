@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+#include "ExtractionQueue.hh"
+#include "MediaFile.hh"
+#include "MediaStore.hh"
+#include "Statistics.hh"
+
+// Files extracted per main loop iteration
+#define EXTRACTION_BATCH_SIZE 16
+// unless extracting them takes longer than this
+#define EXTRACTION_BATCH_TIME_US (50 * 1000)
+// In the background a single file is extracted this often
+#define EXTRACTION_BACKGROUND_INTERVAL_MS 200
+// With high priority batches are this much larger
+#define EXTRACTION_HIGH_PRIORITY_FACTOR 4
+
+using namespace std;
+
+namespace mediascanner {
+
+ExtractionQueue::ExtractionQueue(MediaStore &store, MetadataExtractor &extractor) :
+    store(store),
+    extractor(extractor),
+    nextSequence(0),
+    process_idle(0),
+    paused(false),
+    indexingPriority(NormalIndexing)
+{
+}
+
+ExtractionQueue::~ExtractionQueue()
+{
+    unschedule();
+}
+
+void ExtractionQueue::setPaused(bool paused)
+{
+    if (paused == this->paused)
+        return;
+
+    this->paused = paused;
+    unschedule();
+    if (!queued.empty())
+        schedule();
+}
+
+void ExtractionQueue::setIndexingPriority(IndexingPriority priority)
+{
+    if (priority == indexingPriority)
+        return;
+
+    indexingPriority = priority;
+    unschedule();
+    if (!queued.empty())
+        schedule();
+}
+
+// Urgent files are never held back
+bool ExtractionQueue::throttled() const
+{
+    return lanes[UrgentPriority].empty() && (paused || indexingPriority == BackgroundIndexing);
+}
+
+void ExtractionQueue::schedule()
+{
+    if (process_idle || (paused && lanes[UrgentPriority].empty()))
+        return;
+
+    if (throttled())
+        process_idle = g_timeout_add_full(G_PRIORITY_DEFAULT_IDLE, EXTRACTION_BACKGROUND_INTERVAL_MS,
+                                          processCallback, this, NULL);
+    else
+        process_idle = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, processCallback, this, NULL);
+}
+
+void ExtractionQueue::unschedule()
+{
+    if (process_idle) {
+        g_source_remove(process_idle);
+        process_idle = 0;
+    }
+}
+
+void ExtractionQueue::enqueue(const string &path, ExtractionPriority priority)
+{
+    Item item = { path, false, DetectedFile(path, "", "", UnknownMedia), 0 };
+    push(item, priority);
+}
+
+void ExtractionQueue::enqueue(const DetectedFile &file, ExtractionPriority priority)
+{
+    Item item = { file.path, true, file, 0 };
+    push(item, priority);
+}
+
+void ExtractionQueue::push(Item &item, ExtractionPriority priority)
+{
+    // A file queued again replaces what we knew about it before but never
+    // loses the priority it already had
+    auto existing = queued.find(item.path);
+    if (existing != queued.end() && existing->second.priority < priority)
+        priority = existing->second.priority;
+
+    if (existing == queued.end())
+        statistics().filesQueued.add();
+
+    item.sequence = nextSequence++;
+    Entry entry = { priority, item.sequence };
+    queued[item.path] = entry;
+    lanes[priority].push_back(item);
+
+    if (priority == UrgentPriority)
+        unschedule();
+    schedule();
+}
+
+void ExtractionQueue::cancel(const string &path)
+{
+    queued.erase(path);
+}
+
+static string directoryPrefix(const string &path)
+{
+    if (!path.empty() && path[path.size() - 1] == '/')
+        return path;
+    return path + "/";
+}
+
+size_t ExtractionQueue::cancelBelowPath(const string &path)
+{
+    string prefix = directoryPrefix(path);
+    size_t cancelled = 0;
+    auto entry = queued.lower_bound(prefix);
+    while (entry != queued.end() && entry->first.compare(0, prefix.size(), prefix) == 0) {
+        entry = queued.erase(entry);
+        cancelled++;
+    }
+    return cancelled;
+}
+
+void ExtractionQueue::rename(const string &from, const string &to)
+{
+    auto entry = queued.find(from);
+    if (entry == queued.end())
+        return;
+
+    ExtractionPriority priority = entry->second.priority;
+    queued.erase(entry);
+    // What was detected before belongs to the old path
+    enqueue(to, priority);
+}
+
+void ExtractionQueue::renameBelowPath(const string &from, const string &to)
+{
+    string fromPrefix = directoryPrefix(from);
+    string toPrefix = directoryPrefix(to);
+
+    vector<string> moved;
+    for (auto entry = queued.lower_bound(fromPrefix);
+         entry != queued.end() && entry->first.compare(0, fromPrefix.size(), fromPrefix) == 0;
+         ++entry)
+        moved.push_back(entry->first);
+
+    for (auto &path : moved)
+        rename(path, toPrefix + path.substr(fromPrefix.size()));
+}
+
+gboolean ExtractionQueue::processCallback(gpointer user_data)
+{
+    ExtractionQueue *queue = static_cast<ExtractionQueue*>(user_data);
+    return queue->processBatch() ? TRUE : FALSE;
+}
+
+bool ExtractionQueue::processBatch()
+{
+    gint64 start = g_get_monotonic_time();
+    int processed = 0;
+
+    int batchSize = EXTRACTION_BATCH_SIZE;
+    gint64 batchTime = EXTRACTION_BATCH_TIME_US;
+    if (indexingPriority == BackgroundIndexing) {
+        batchSize = 1;
+    } else if (indexingPriority == HighIndexing) {
+        batchSize *= EXTRACTION_HIGH_PRIORITY_FACTOR;
+        batchTime *= EXTRACTION_HIGH_PRIORITY_FACTOR;
+    }
+
+    int lastLane = paused ? UrgentPriority : ExtractionPriorityCount - 1;
+    for (int lane = 0; lane <= lastLane; ) {
+        if (lanes[lane].empty()) {
+            lane++;
+            continue;
+        }
+
+        Item item = lanes[lane].front();
+        lanes[lane].pop_front();
+
+        auto entry = queued.find(item.path);
+        if (entry == queued.end() || entry->second.sequence != item.sequence)
+            continue;
+        queued.erase(entry);
+
+        process(item);
+
+        // Urgent files are only limited by time
+        processed++;
+        if ((lane != UrgentPriority && processed >= batchSize) ||
+            g_get_monotonic_time() - start >= batchTime)
+            break;
+    }
+
+    if (!queued.empty()) {
+        if (!throttled())
+            return true;
+        // Back to the timeout or nothing at all once the urgent files
+        // are done
+        process_idle = 0;
+        schedule();
+        return false;
+    }
+
+    // Only stale items can be left
+    for (auto &lane : lanes)
+        lane.clear();
+    process_idle = 0;
+    return false;
+}
+
+void ExtractionQueue::process(Item &item)
+{
+    Statistics &stats = statistics();
+    try {
+        if (!item.detected)
+            item.file = extractor.detect(item.path);
+        // Only extract and insert the file if the ETag has changed.
+        if (item.file.etag == store.getETag(item.file.path)) {
+            stats.filesUnchanged.add();
+            return;
+        }
+        MediaFile file = extractor.extract(item.file);
+        stats.filesExtracted.add();
+        store.insert(file);
+    } catch (const exception &e) {
+        stats.filesFailed.add();
+        fprintf(stderr, "Error when indexing %s: %s\n", item.path.c_str(), e.what());
+    }
+}
+
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EXTRACTIONQUEUE_HH
+#define EXTRACTIONQUEUE_HH
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+
+#include <glib.h>
+
+#include "MetadataExtractor.hh"
+#include "ScannerCore.hh"
+
+namespace mediascanner {
+
+class MediaStore;
+
+enum ExtractionPriority {
+    // Asked for by an app which waits for them, even while paused
+    UrgentPriority,
+    // Files which just changed, the user probably wants to see them
+    LivePriority,
+    // Everything found by the initial scan
+    BackgroundPriority,
+    ExtractionPriorityCount,
+};
+
+/*
+ * Files waiting for their metadata to be extracted and handed over to the
+ * store. They are processed in small batches from the main loop so events
+ * are still handled in between, higher priorities first.
+ */
+class ExtractionQueue final {
+public:
+    ExtractionQueue(MediaStore &store, MetadataExtractor &extractor);
+    ~ExtractionQueue();
+    ExtractionQueue(const ExtractionQueue&) = delete;
+    ExtractionQueue& operator=(const ExtractionQueue&) = delete;
+
+    // The file is detected once it's its turn
+    void enqueue(const std::string &path, ExtractionPriority priority);
+    void enqueue(const DetectedFile &file, ExtractionPriority priority);
+
+    void cancel(const std::string &path);
+    // Returns how many files were still waiting
+    size_t cancelBelowPath(const std::string &path);
+    void rename(const std::string &from, const std::string &to);
+    void renameBelowPath(const std::string &from, const std::string &to);
+
+    size_t size() const { return queued.size(); }
+    bool isQueued(const std::string &path) const { return queued.find(path) != queued.end(); }
+
+    // Queued files are kept while paused
+    void setPaused(bool paused);
+    void setIndexingPriority(IndexingPriority priority);
+
+private:
+    struct Item {
+        std::string path;
+        bool detected;
+        DetectedFile file;
+        uint64_t sequence;
+    };
+
+    struct Entry {
+        ExtractionPriority priority;
+        uint64_t sequence;
+    };
+
+    void push(Item &item, ExtractionPriority priority);
+    bool throttled() const;
+    void schedule();
+    void unschedule();
+    bool processBatch();
+    void process(Item &item);
+    static gboolean processCallback(gpointer user_data);
+
+    MediaStore &store;
+    MetadataExtractor &extractor;
+    // Items in the lanes are only valid while they are still listed here
+    // with the same sequence, everything else was cancelled or promoted.
+    std::deque<Item> lanes[ExtractionPriorityCount];
+    std::map<std::string, Entry> queued;
+    uint64_t nextSequence;
+    guint process_idle;
+    bool paused;
+    IndexingPriority indexingPriority;
+};
+
+}
+
+#endif
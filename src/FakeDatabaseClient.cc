@@ -0,0 +1,552 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstring>
+
+#include "FakeDatabaseClient.hh"
+
+namespace mediascanner {
+
+FakeDatabaseClient::PendingReply::PendingReply(FakeDatabaseClient *client, SlotRef handler,
+                                               const MojObject& response, MojErr err) :
+    client(client),
+    signal(this),
+    response(response),
+    err(err),
+    source(0)
+{
+    signal.connect(handler);
+}
+
+FakeDatabaseClient::FakeDatabaseClient() :
+    latencyMs(0),
+    maxResults(FAKE_DATABASE_MAX_RESULTS),
+    nextId(1),
+    nextRevision(1),
+    calls(0)
+{
+}
+
+FakeDatabaseClient::~FakeDatabaseClient()
+{
+    for (auto &reply : pendingReplies)
+        g_source_remove(reply->source);
+}
+
+void FakeDatabaseClient::setLatency(guint latencyMs)
+{
+    this->latencyMs = latencyMs;
+}
+
+void FakeDatabaseClient::setMaxResults(MojUInt32 maxResults)
+{
+    this->maxResults = maxResults;
+}
+
+void FakeDatabaseClient::addKind(const std::string& id, const std::vector<std::string>& extends)
+{
+    kinds[id] = extends;
+}
+
+void FakeDatabaseClient::addMediaKinds()
+{
+    static const char* fileKinds[] = {
+        "com.palm.media.audio.file:1",
+        "com.palm.media.image.file:1",
+        "com.palm.media.misc.file:1",
+        "com.palm.media.playlist.file:1",
+        "com.palm.media.video.file:1",
+    };
+    static const char* otherKinds[] = {
+        "com.palm.media.audio.album:1",
+        "com.palm.media.audio.artist:1",
+        "com.palm.media.audio.genre:1",
+        "com.palm.media.image.album:1",
+    };
+
+    addKind("com.palm.media.types:1");
+    addKind("com.palm.media.file:1", { "com.palm.media.types:1" });
+    for (auto kind : fileKinds)
+        addKind(kind, { "com.palm.media.file:1" });
+    for (auto kind : otherKinds)
+        addKind(kind);
+}
+
+size_t FakeDatabaseClient::objectCount() const
+{
+    return objects.size();
+}
+
+size_t FakeDatabaseClient::objectCount(const std::string& kind) const
+{
+    size_t count = 0;
+    for (auto &object : objects) {
+        MojString objectKind;
+        bool found = false;
+        if (object.second.get("_kind", objectKind, found) == MojErrNone && found &&
+            isKindOf(objectKind.data(), kind))
+            count++;
+    }
+    return count;
+}
+
+size_t FakeDatabaseClient::callCount() const
+{
+    return calls;
+}
+
+size_t FakeDatabaseClient::pendingReplyCount() const
+{
+    return pendingReplies.size();
+}
+
+MojErr FakeDatabaseClient::reply(SlotRef handler, MojObject& response)
+{
+    MojErr err = response.putBool("returnValue", true);
+    MojErrCheck(err);
+
+    MojRefCountedPtr<PendingReply> pending(new PendingReply(this, handler, response, MojErrNone));
+    MojAllocCheck(pending.get());
+
+    pending->source = g_timeout_add(latencyMs, &FakeDatabaseClient::deliverReply, pending.get());
+    pendingReplies.push_back(pending);
+
+    return MojErrNone;
+}
+
+MojErr FakeDatabaseClient::replyError(SlotRef handler, MojErr err, const char *errorText)
+{
+    MojObject response;
+    response.putBool("returnValue", false);
+    response.putInt("errorCode", err);
+    response.putString("errorText", errorText);
+
+    MojRefCountedPtr<PendingReply> pending(new PendingReply(this, handler, response, err));
+    MojAllocCheck(pending.get());
+
+    pending->source = g_timeout_add(latencyMs, &FakeDatabaseClient::deliverReply, pending.get());
+    pendingReplies.push_back(pending);
+
+    return MojErrNone;
+}
+
+gboolean FakeDatabaseClient::deliverReply(gpointer user_data)
+{
+    PendingReply *pending = static_cast<PendingReply*>(user_data);
+    FakeDatabaseClient *client = pending->client;
+
+    // Keep it alive while the handler runs, it might call us again
+    MojRefCountedPtr<PendingReply> reply(pending);
+    for (auto iter = client->pendingReplies.begin(); iter != client->pendingReplies.end(); ++iter) {
+        if (iter->get() == pending) {
+            client->pendingReplies.erase(iter);
+            break;
+        }
+    }
+
+    reply->signal.fire(reply->response, reply->err);
+
+    return FALSE;
+}
+
+bool FakeDatabaseClient::isKindOf(const std::string& kind, const std::string& base) const
+{
+    if (kind == base)
+        return true;
+
+    auto known = kinds.find(kind);
+    if (known == kinds.end())
+        return false;
+
+    for (auto &extended : known->second) {
+        if (isKindOf(extended, base))
+            return true;
+    }
+    return false;
+}
+
+static std::string stringOf(const MojObject& value, bool caseless)
+{
+    MojString str;
+    value.stringValue(str);
+    if (!caseless)
+        return str.data();
+
+    gchar *folded = g_utf8_casefold(str.data(), -1);
+    std::string result = folded;
+    g_free(folded);
+    return result;
+}
+
+static bool sameValue(const MojObject& a, const MojObject& b, bool caseless)
+{
+    if (caseless && a.type() == MojObject::TypeString && b.type() == MojObject::TypeString)
+        return stringOf(a, true) == stringOf(b, true);
+    return a == b;
+}
+
+bool FakeDatabaseClient::matches(const MojObject& object, const MojObject& clauses) const
+{
+    for (MojObject::ConstArrayIterator clause = clauses.arrayBegin(); clause != clauses.arrayEnd(); ++clause) {
+        MojString prop, op, collate;
+        MojObject expected, value;
+        bool found = false;
+        if (clause->getRequired("prop", prop) != MojErrNone ||
+            clause->getRequired("op", op) != MojErrNone ||
+            clause->getRequired("val", expected) != MojErrNone)
+            return false;
+        bool caseless = clause->get("collate", collate, found) == MojErrNone && found &&
+                        collate == "primary";
+
+        if (!object.get(prop.data(), value))
+            return false;
+
+        bool match = false;
+        if (op == "=" && expected.type() == MojObject::TypeArray) {
+            for (MojObject::ConstArrayIterator item = expected.arrayBegin(); item != expected.arrayEnd(); ++item)
+                match = match || sameValue(value, *item, caseless);
+        }
+        else if (op == "=")
+            match = sameValue(value, expected, caseless);
+        else if (op == "!=")
+            match = !sameValue(value, expected, caseless);
+        else if (op == "%")
+            match = value.type() == MojObject::TypeString &&
+                    g_str_has_prefix(stringOf(value, caseless).c_str(), stringOf(expected, caseless).c_str());
+        else if (op == "<")
+            match = value < expected;
+        else if (op == "<=")
+            match = !(expected < value);
+        else if (op == ">")
+            match = expected < value;
+        else if (op == ">=")
+            match = !(value < expected);
+
+        if (!match)
+            return false;
+    }
+    return true;
+}
+
+MojErr FakeDatabaseClient::query(const MojDbQuery& query, std::vector<std::string>& ids, size_t& total) const
+{
+    MojObject queryObj;
+    MojErr err = query.toObject(queryObj);
+    MojErrCheck(err);
+
+    MojString from;
+    err = queryObj.getRequired("from", from);
+    MojErrCheck(err);
+    if (kinds.find(from.data()) == kinds.end())
+        MojErrThrow(MojErrDbKindNotRegistered);
+
+    MojObject where(MojObject::TypeArray), filter(MojObject::TypeArray);
+    queryObj.get("where", where);
+    queryObj.get("filter", filter);
+
+    MojInt64 limit = maxResults;
+    bool found = false;
+    err = queryObj.get("limit", limit, found);
+    MojErrCheck(err);
+    if (!found || limit > (MojInt64) maxResults)
+        limit = maxResults;
+
+    total = 0;
+    for (auto &object : objects) {
+        MojString kind;
+        found = false;
+        if (object.second.get("_kind", kind, found) != MojErrNone || !found ||
+            !isKindOf(kind.data(), from.data()))
+            continue;
+        if (!matches(object.second, where) || !matches(object.second, filter))
+            continue;
+
+        total++;
+        if ((MojInt64) ids.size() < limit)
+            ids.push_back(object.first);
+    }
+
+    return MojErrNone;
+}
+
+MojErr FakeDatabaseClient::validate(const MojObject& object, bool mergeIt, const char *&errorText) const
+{
+    MojString id, kind;
+    bool hasId = false, hasKind = false;
+    MojErr err = object.get("_id", id, hasId);
+    MojErrCheck(err);
+    err = object.get("_kind", kind, hasKind);
+    MojErrCheck(err);
+
+    if (mergeIt && (!hasId || objects.find(id.data()) == objects.end())) {
+        errorText = "object not found";
+        return MojErrNotFound;
+    }
+    if (!mergeIt && !hasKind) {
+        errorText = "object has no kind";
+        return MojErrInvalidArg;
+    }
+    if (hasKind && kinds.find(kind.data()) == kinds.end()) {
+        errorText = "kind not registered";
+        return MojErrDbKindNotRegistered;
+    }
+    return MojErrNone;
+}
+
+MojErr FakeDatabaseClient::store(const MojObject& object, bool mergeIt, MojObject& result)
+{
+    MojString id;
+    bool hasId = false;
+    MojErr err = object.get("_id", id, hasId);
+    MojErrCheck(err);
+    if (!hasId) {
+        err = id.format("++fake%lld", (long long) nextId++);
+        MojErrCheck(err);
+    }
+
+    MojObject &stored = objects[id.data()];
+    if (mergeIt) {
+        for (MojObject::ConstIterator iter = object.begin(); iter != object.end(); ++iter) {
+            err = stored.put(iter.key().data(), iter.value());
+            MojErrCheck(err);
+        }
+    }
+    else {
+        stored = object;
+        err = stored.put("_id", MojObject(id));
+        MojErrCheck(err);
+    }
+
+    MojInt64 revision = nextRevision++;
+    err = stored.putInt("_rev", revision);
+    MojErrCheck(err);
+
+    err = result.put("id", MojObject(id));
+    MojErrCheck(err);
+    err = result.putInt("rev", revision);
+    MojErrCheck(err);
+
+    return MojErrNone;
+}
+
+MojErr FakeDatabaseClient::find(SlotRef handler, const MojDbQuery& query, bool watch, bool returnCount)
+{
+    calls++;
+
+    std::vector<std::string> ids;
+    size_t total = 0;
+    MojErr err = this->query(query, ids, total);
+    if (err != MojErrNone)
+        return replyError(handler, err, "invalid query");
+
+    MojObject queryObj;
+    err = query.toObject(queryObj);
+    MojErrCheck(err);
+    MojObject select(MojObject::TypeArray);
+    queryObj.get("select", select);
+
+    MojObject results(MojObject::TypeArray);
+    for (auto &id : ids) {
+        const MojObject &object = objects[id];
+        if (select.size() == 0) {
+            err = results.push(object);
+            MojErrCheck(err);
+            continue;
+        }
+
+        MojObject selected;
+        for (MojObject::ConstArrayIterator prop = select.arrayBegin(); prop != select.arrayEnd(); ++prop) {
+            MojString name;
+            MojObject value;
+            err = prop->stringValue(name);
+            MojErrCheck(err);
+            if (object.get(name.data(), value)) {
+                err = selected.put(name.data(), value);
+                MojErrCheck(err);
+            }
+        }
+        err = results.push(selected);
+        MojErrCheck(err);
+    }
+
+    MojObject response;
+    err = response.put("results", results);
+    MojErrCheck(err);
+    if (returnCount) {
+        err = response.putInt("count", total);
+        MojErrCheck(err);
+    }
+
+    return reply(handler, response);
+}
+
+MojErr FakeDatabaseClient::put(SlotRef handler, const MojObject* begin, const MojObject* end)
+{
+    calls++;
+
+    // Like the real database a batch is stored either completely or not at all
+    const char *errorText = nullptr;
+    for (const MojObject *object = begin; object != end; ++object) {
+        MojErr err = validate(*object, false, errorText);
+        if (err != MojErrNone)
+            return replyError(handler, err, errorText);
+    }
+
+    MojObject results(MojObject::TypeArray);
+    for (const MojObject *object = begin; object != end; ++object) {
+        MojObject result;
+        MojErr err = store(*object, false, result);
+        MojErrCheck(err);
+        err = results.push(result);
+        MojErrCheck(err);
+    }
+
+    MojObject response;
+    MojErr err = response.put("results", results);
+    MojErrCheck(err);
+
+    return reply(handler, response);
+}
+
+MojErr FakeDatabaseClient::merge(SlotRef handler, const MojObject* begin, const MojObject* end)
+{
+    calls++;
+
+    const char *errorText = nullptr;
+    for (const MojObject *object = begin; object != end; ++object) {
+        MojErr err = validate(*object, true, errorText);
+        if (err != MojErrNone)
+            return replyError(handler, err, errorText);
+    }
+
+    MojObject results(MojObject::TypeArray);
+    for (const MojObject *object = begin; object != end; ++object) {
+        MojObject result;
+        MojErr err = store(*object, true, result);
+        MojErrCheck(err);
+        err = results.push(result);
+        MojErrCheck(err);
+    }
+
+    MojObject response;
+    MojErr err = response.put("results", results);
+    MojErrCheck(err);
+
+    return reply(handler, response);
+}
+
+MojErr FakeDatabaseClient::del(SlotRef handler, const MojObject* idsBegin, const MojObject* idsEnd,
+                               MojUInt32 flags)
+{
+    calls++;
+
+    MojObject results(MojObject::TypeArray);
+    for (const MojObject *id = idsBegin; id != idsEnd; ++id) {
+        MojString idStr;
+        MojErr err = id->stringValue(idStr);
+        MojErrCheck(err);
+        if (objects.erase(idStr.data()) == 0)
+            continue;
+
+        MojObject result;
+        err = result.put("id", *id);
+        MojErrCheck(err);
+        err = results.push(result);
+        MojErrCheck(err);
+    }
+
+    MojObject response;
+    MojErr err = response.put("results", results);
+    MojErrCheck(err);
+
+    return reply(handler, response);
+}
+
+MojErr FakeDatabaseClient::del(SlotRef handler, const MojDbQuery& query, MojUInt32 flags)
+{
+    calls++;
+
+    std::vector<std::string> ids;
+    size_t total = 0;
+    MojErr err = this->query(query, ids, total);
+    if (err != MojErrNone)
+        return replyError(handler, err, "invalid query");
+
+    for (auto &id : ids)
+        objects.erase(id);
+
+    MojObject response;
+    err = response.putInt("count", ids.size());
+    MojErrCheck(err);
+
+    return reply(handler, response);
+}
+
+MojErr FakeDatabaseClient::putKind(SlotRef handler, const MojObject& kind)
+{
+    calls++;
+
+    MojString id;
+    MojErr err = kind.getRequired("id", id);
+    if (err != MojErrNone)
+        return replyError(handler, MojErrInvalidArg, "kind has no id");
+
+    std::vector<std::string> extends;
+    MojObject extendsObj;
+    if (kind.get("extends", extendsObj)) {
+        for (MojObject::ConstArrayIterator iter = extendsObj.arrayBegin(); iter != extendsObj.arrayEnd(); ++iter) {
+            MojString extended;
+            err = iter->stringValue(extended);
+            MojErrCheck(err);
+            extends.push_back(extended.data());
+        }
+    }
+    addKind(id.data(), extends);
+
+    MojObject response;
+    return reply(handler, response);
+}
+
+MojErr FakeDatabaseClient::delKind(SlotRef handler, const MojChar* kindId)
+{
+    calls++;
+
+    if (kinds.erase(kindId) == 0)
+        return replyError(handler, MojErrDbKindNotRegistered, "kind not registered");
+
+    for (auto iter = objects.begin(); iter != objects.end();) {
+        MojString kind;
+        bool found = false;
+        if (iter->second.get("_kind", kind, found) == MojErrNone && found && kind == kindId)
+            iter = objects.erase(iter);
+        else
+            ++iter;
+    }
+
+    MojObject response;
+    return reply(handler, response);
+}
+
+MojErr FakeDatabaseClient::putPermissions(SlotRef handler, const MojObject& permissions)
+{
+    calls++;
+
+    MojObject response;
+    return reply(handler, response);
+}
+
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef FAKEDATABASECLIENT_HH
+#define FAKEDATABASECLIENT_HH
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <glib.h>
+
+#include "DatabaseClient.hh"
+
+// Same as the largest limit com.palm.db accepts for a query
+#define FAKE_DATABASE_MAX_RESULTS 500
+
+namespace mediascanner {
+
+/*
+ * Keeps everything in memory so the media database commands can run
+ * without com.palm.db, e.g. in the benchmark. Replies are delivered from
+ * the main loop after the configured latency and in the order the calls
+ * were made. Only the parts of the query language the commands use are
+ * understood: equality, lists of values, prefixes and primary collation.
+ * Deleted objects are always purged and results come in no particular
+ * order.
+ */
+class FakeDatabaseClient : public DatabaseClient
+{
+public:
+    FakeDatabaseClient();
+    ~FakeDatabaseClient();
+
+    void setLatency(guint latencyMs);
+    // Queries never return or delete more than this, whatever their limit
+    void setMaxResults(MojUInt32 maxResults);
+    // Objects can only be stored with a registered kind
+    void addKind(const std::string& id, const std::vector<std::string>& extends = std::vector<std::string>());
+    // Everything our kind files register
+    void addMediaKinds();
+
+    size_t objectCount() const;
+    // Includes objects of kinds extending the given one
+    size_t objectCount(const std::string& kind) const;
+    // Calls made so far, their replies might still be on the way
+    size_t callCount() const;
+    size_t pendingReplyCount() const;
+
+    MojErr find(SlotRef handler, const MojDbQuery& query,
+                bool watch = false, bool returnCount = false) override;
+    MojErr put(SlotRef handler, const MojObject* begin, const MojObject* end) override;
+    MojErr merge(SlotRef handler, const MojObject* begin, const MojObject* end) override;
+    MojErr del(SlotRef handler, const MojObject* idsBegin, const MojObject* idsEnd,
+               MojUInt32 flags = MojDbFlagNone) override;
+    MojErr del(SlotRef handler, const MojDbQuery& query,
+               MojUInt32 flags = MojDbFlagNone) override;
+    MojErr putKind(SlotRef handler, const MojObject& kind) override;
+    MojErr delKind(SlotRef handler, const MojChar* kindId) override;
+    MojErr putPermissions(SlotRef handler, const MojObject& permissions) override;
+
+private:
+    class PendingReply : public MojSignalHandler
+    {
+    public:
+        PendingReply(FakeDatabaseClient *client, SlotRef handler, const MojObject& response, MojErr err);
+
+        FakeDatabaseClient *client;
+        MojDbClient::Signal signal;
+        MojObject response;
+        MojErr err;
+        guint source;
+    };
+
+    MojErr reply(SlotRef handler, MojObject& response);
+    MojErr replyError(SlotRef handler, MojErr err, const char *errorText);
+    static gboolean deliverReply(gpointer user_data);
+
+    bool isKindOf(const std::string& kind, const std::string& base) const;
+    bool matches(const MojObject& object, const MojObject& clauses) const;
+    // Ids of everything matching the query, total counts all matches
+    // regardless of the limit
+    MojErr query(const MojDbQuery& query, std::vector<std::string>& ids, size_t& total) const;
+    MojErr validate(const MojObject& object, bool mergeIt, const char *&errorText) const;
+    MojErr store(const MojObject& object, bool mergeIt, MojObject& result);
+
+    std::map<std::string, MojObject> objects;
+    // Kind ids and what they extend
+    std::map<std::string, std::vector<std::string>> kinds;
+    std::vector<MojRefCountedPtr<PendingReply>> pendingReplies;
+    guint latencyMs;
+    MojUInt32 maxResults;
+    MojInt64 nextId;
+    MojInt64 nextRevision;
+    size_t calls;
+};
+
+}
+
+#endif
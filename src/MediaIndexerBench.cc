@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Offline benchmark of the indexing pipeline. It generates a synthetic
+ * media tree and times every stage on it, without com.palm.db or the
+ * Luna bus: the media database commands run against an in-memory fake.
+ * The results go out as JSON so they can be compared between builds.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "DirectoryWalker.hh"
+#include "FakeDatabaseClient.hh"
+#include "MediaFile.hh"
+#include "MediaStore.hh"
+#include "MetadataExtractor.hh"
+#include "MojoMediaDatabase.hh"
+#include "Scanner.hh"
+#include "Statistics.hh"
+#include "SyntheticMediaTree.hh"
+#include "Thumbnailer.hh"
+
+// Width of the thumbnails, the service uses eight grid units
+#define BENCH_THUMBNAIL_WIDTH 128
+
+using namespace std;
+using namespace mediascanner;
+
+struct StageResult {
+    string name;
+    size_t count;
+    gint64 totalUs;
+};
+
+// The stage returns how many items it handled
+static StageResult runStage(const char *name, const function<size_t()> &stage)
+{
+    fprintf(stderr, "Running %s...\n", name);
+    gint64 start = g_get_monotonic_time();
+    size_t count = stage();
+    StageResult result = { name, count, g_get_monotonic_time() - start };
+    return result;
+}
+
+// Runs the main loop until all queued commands are done. Aggregates are
+// recounted on their own schedule and not waited for.
+static size_t runCommands(MojoMediaDatabase &database)
+{
+    uint64_t finished = statistics().latency[CommandStage].count.value();
+    while (database.queuedCommands() > 0 || database.pendingRemovalCount() > 0)
+        g_main_context_iteration(nullptr, TRUE);
+    return statistics().latency[CommandStage].count.value() - finished;
+}
+
+// A directory given by the user might hold other files, only what we
+// generated there goes away
+static void removeGenerated(const string &base, bool temporary)
+{
+    if (temporary) {
+        removeTree(base);
+        return;
+    }
+    removeTree(base + "/tree");
+    removeTree(base + "/data");
+    removeTree(base + "/thumbnails");
+}
+
+static void writeResults(FILE *out, const SyntheticTreeOptions &options,
+                         int databaseLatency, int databaseMaxResults, size_t files,
+                         const vector<StageResult> &results)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"options\": { \"depth\": %d, \"fanout\": %d, \"filesPerDirectory\": %d, "
+                 "\"imageWidth\": %d, \"imageHeight\": %d, \"seed\": %u, "
+                 "\"databaseLatencyMs\": %d, \"databaseMaxResults\": %d },\n",
+            options.depth, options.fanout, options.filesPerDirectory,
+            options.imageWidth, options.imageHeight, options.seed,
+            databaseLatency, databaseMaxResults);
+    fprintf(out, "  \"files\": %zu,\n", files);
+    fprintf(out, "  \"stages\": {\n");
+    for (size_t n = 0; n < results.size(); n++) {
+        const StageResult &result = results[n];
+        fprintf(out, "    \"%s\": { \"count\": %zu, \"totalUs\": %lld, \"perItemUs\": %.1f }%s\n",
+                result.name.c_str(), result.count, (long long) result.totalUs,
+                result.count ? (double) result.totalUs / result.count : 0.0,
+                n + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+}
+
+int main(int argc, char **argv)
+{
+    SyntheticTreeOptions options;
+    gchar *directory = nullptr;
+    gchar *output = nullptr;
+    gboolean keep = FALSE;
+    int databaseLatency = 0;
+    int databaseMaxResults = FAKE_DATABASE_MAX_RESULTS;
+
+    GOptionEntry entries[] = {
+        { "depth", 'd', 0, G_OPTION_ARG_INT, &options.depth, "Levels of directories below the root", "N" },
+        { "fanout", 'f', 0, G_OPTION_ARG_INT, &options.fanout, "Subdirectories of every directory", "N" },
+        { "files", 'n', 0, G_OPTION_ARG_INT, &options.filesPerDirectory, "Files in every directory", "N" },
+        { "image-width", 0, 0, G_OPTION_ARG_INT, &options.imageWidth, "Width of generated images", "PIXELS" },
+        { "image-height", 0, 0, G_OPTION_ARG_INT, &options.imageHeight, "Height of generated images", "PIXELS" },
+        { "seed", 's', 0, G_OPTION_ARG_INT, &options.seed, "Seed for the generated tree", "N" },
+        { "db-latency", 0, 0, G_OPTION_ARG_INT, &databaseLatency, "Delay of every media database reply", "MS" },
+        { "db-max-results", 0, 0, G_OPTION_ARG_INT, &databaseMaxResults, "Most items a media database query returns", "N" },
+        { "directory", 0, 0, G_OPTION_ARG_STRING, &directory, "Where to work instead of a new temporary directory", "PATH" },
+        { "output", 'o', 0, G_OPTION_ARG_STRING, &output, "Write the results there instead of stdout", "FILE" },
+        { "keep", 'k', 0, G_OPTION_ARG_NONE, &keep, "Keep the generated files", nullptr },
+        { nullptr }
+    };
+
+    GError *error = nullptr;
+    GOptionContext *context = g_option_context_new("- benchmark the media indexer");
+    g_option_context_add_main_entries(context, entries, nullptr);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    string base;
+    bool temporary = !directory;
+    if (directory) {
+        base = directory;
+        g_free(directory);
+    } else {
+        gchar *tmp = g_dir_make_tmp("mediaindexer-bench-XXXXXX", &error);
+        if (!tmp) {
+            fprintf(stderr, "Could not create a temporary directory: %s\n", error->message);
+            g_error_free(error);
+            return 1;
+        }
+        base = tmp;
+        g_free(tmp);
+    }
+    const string root = base + "/tree";
+    const string dataDirectory = base + "/data";
+    const string thumbnailDirectory = base + "/thumbnails";
+
+    vector<StageResult> results;
+    size_t fileCount = 0;
+
+    try {
+        results.push_back(runStage("generate", [&]() {
+            fileCount = SyntheticMediaTree(options).generate(root);
+            return fileCount;
+        }));
+
+        MetadataExtractor extractor;
+        vector<DetectedFile> detected;
+        results.push_back(runStage("scan", [&]() {
+            Scanner scanner;
+            detected = scanner.scanFiles(&extractor, root, AllMedia, set<string>());
+            return detected.size();
+        }));
+
+        results.push_back(runStage("detect", [&]() {
+            for (auto &file : detected)
+                extractor.detect(file.path);
+            return detected.size();
+        }));
+
+        vector<MediaFile> extracted;
+        results.push_back(runStage("extract", [&]() {
+            for (auto &file : detected)
+                extracted.push_back(extractor.extract(file));
+            return extracted.size();
+        }));
+
+        FakeDatabaseClient client;
+        client.setLatency(databaseLatency);
+        client.setMaxResults(databaseMaxResults);
+        MojoMediaDatabase mojoDb(client);
+        // Thumbnails would end up in the real thumbnail directory
+        mojoDb.setPostponing(true);
+        {
+            // A new file database starts with a rebuild which drops all kinds
+            MediaStore store(&mojoDb, dataDirectory);
+            runCommands(mojoDb);
+            client.addMediaKinds();
+
+            results.push_back(runStage("store.insert", [&]() {
+                for (auto &file : extracted)
+                    store.insert(file);
+                return extracted.size();
+            }));
+
+            results.push_back(runStage("database.insert", [&]() {
+                return runCommands(mojoDb);
+            }));
+
+            results.push_back(runStage("store.getETag", [&]() {
+                for (auto &file : extracted)
+                    store.getETag(file.path());
+                return extracted.size();
+            }));
+
+            results.push_back(runStage("store.renameFilesBelowPath", [&]() {
+                store.renameFilesBelowPath(root, root + ".renamed");
+                return extracted.size();
+            }));
+
+            results.push_back(runStage("store.removeFilesBelowPath", [&]() {
+                store.removeFilesBelowPath(root + ".renamed");
+                return extracted.size();
+            }));
+
+            results.push_back(runStage("database.update", [&]() {
+                return runCommands(mojoDb);
+            }));
+        }
+
+        results.push_back(runStage("thumbnail", [&]() {
+            g_mkdir_with_parents(thumbnailDirectory.c_str(), 0755);
+            Thumbnailer thumbnailer(BENCH_THUMBNAIL_WIDTH);
+            size_t count = 0;
+            for (auto &file : detected) {
+                if (file.type != ImageMedia)
+                    continue;
+                string thumbnail = thumbnailDirectory + "/" + to_string(count++) + ".jpg";
+                thumbnailer.generate(file.path, thumbnail);
+            }
+            return count;
+        }));
+    } catch (const exception &e) {
+        fprintf(stderr, "Benchmark failed: %s\n", e.what());
+        if (!keep)
+            removeGenerated(base, temporary);
+        return 1;
+    }
+
+    if (!keep)
+        removeGenerated(base, temporary);
+
+    FILE *out = stdout;
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            fprintf(stderr, "Could not open %s: %s\n", output, strerror(errno));
+            g_free(output);
+            return 1;
+        }
+    }
+    writeResults(out, options, databaseLatency, databaseMaxResults, fileCount, results);
+    if (out != stdout)
+        fclose(out);
+    g_free(output);
+
+    return 0;
+}
@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Replays a watch trace recorded by the service, see the watchTrace
+ * setting. The directories and files the events talk about are recreated
+ * in a scratch directory right before the events are handed out, so the
+ * watcher finds what it found while recording. Extraction is paused and
+ * the media database is an in-memory fake, which leaves the handling of
+ * the events to be measured. Quiet periods are taken from the trace
+ * instead of waited for, so the same trace always ends the same way.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "DirectoryWalker.hh"
+#include "ExtractionQueue.hh"
+#include "FakeDatabaseClient.hh"
+#include "MediaStore.hh"
+#include "MetadataExtractor.hh"
+#include "MojoMediaDatabase.hh"
+#include "Statistics.hh"
+#include "SubtreeWatcher.hh"
+#include "WatchTrace.hh"
+#include "WatcherBackend.hh"
+
+// Watch descriptors for directories the recording never watched, no
+// events will ever come for them
+#define REPLAY_UNKNOWN_WATCH_BASE (1 << 29)
+
+using namespace std;
+using namespace mediascanner;
+
+// A directory given by the user might hold other files, only what we
+// created there goes away
+static void removeGenerated(const string &base, bool temporary)
+{
+    if (temporary) {
+        removeTree(base);
+        return;
+    }
+    removeTree(base + "/tree");
+    removeTree(base + "/data");
+}
+
+static string parentOf(const string &path)
+{
+    string::size_type slash = path.find_last_of('/');
+    return slash == string::npos || slash == 0 ? string("/") : path.substr(0, slash);
+}
+
+/*
+ * The recorded directories below a scratch directory, kept up to date with
+ * the events.
+ */
+class ShadowTree {
+public:
+    ShadowTree(const string &prefix) : prefix(prefix), batch(0) {}
+
+    const string& root() const { return prefix; }
+    bool isDirectory(const string &path) const { return paths.find(path) != paths.end(); }
+
+    void addWatch(int wd, const string &path)
+    {
+        directories[wd] = path;
+        paths.insert(path);
+        g_mkdir_with_parents((prefix + path).c_str(), 0755);
+    }
+
+    void apply(const WatchTraceRecord &record)
+    {
+        // A move is reported by a single read or two consecutive ones,
+        // anything older has left the recorded tree
+        for (auto move = moves.begin(); move != moves.end();) {
+            if (move->second.batch + 1 < batch) {
+                remove(move->second.path, true);
+                move = moves.erase(move);
+            } else {
+                ++move;
+            }
+        }
+
+        for (auto &event : record.events)
+            apply(event);
+        batch++;
+    }
+
+private:
+    struct Move {
+        string path;
+        size_t batch;
+    };
+
+    void apply(const WatchTraceEvent &event)
+    {
+        auto directory = directories.find(event.wd);
+        if (directory == directories.end() || event.name.empty())
+            return;
+
+        string path = directory->second + "/" + event.name;
+        bool isDir = event.mask & IN_ISDIR;
+
+        if (event.mask & (IN_CREATE | IN_CLOSE_WRITE)) {
+            create(path, isDir);
+        } else if (event.mask & IN_DELETE) {
+            remove(path, isDir);
+        } else if (event.mask & IN_MOVED_FROM) {
+            Move move = { path, batch };
+            moves[event.cookie] = move;
+        } else if (event.mask & IN_MOVED_TO) {
+            auto move = moves.find(event.cookie);
+            if (move == moves.end()) {
+                create(path, isDir);
+                return;
+            }
+            rename((prefix + move->second.path).c_str(), (prefix + path).c_str());
+            if (isDir)
+                renamePaths(move->second.path, path);
+            moves.erase(move);
+        }
+    }
+
+    void create(const string &path, bool isDir)
+    {
+        string real = prefix + path;
+        if (isDir) {
+            g_mkdir_with_parents(real.c_str(), 0755);
+            return;
+        }
+        int fd = open(real.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd != -1)
+            close(fd);
+    }
+
+    void remove(const string &path, bool isDir)
+    {
+        string real = prefix + path;
+        if (isDir)
+            removeTree(real);
+        else
+            unlink(real.c_str());
+    }
+
+    void renamePaths(const string &from, const string &to)
+    {
+        string fromPrefix = from + "/";
+        for (auto &directory : directories) {
+            string &path = directory.second;
+            if (path == from || path.compare(0, fromPrefix.size(), fromPrefix) == 0)
+                path = to + path.substr(from.size());
+        }
+        paths.clear();
+        for (auto &directory : directories)
+            paths.insert(directory.second);
+    }
+
+    string prefix;
+    map<int, string> directories;
+    set<string> paths;
+    map<uint32_t, Move> moves;
+    size_t batch;
+};
+
+/*
+ * Hands out the watch descriptors and events of the recording.
+ */
+class ReplayBackend final : public WatcherBackend {
+public:
+    ReplayBackend(const vector<WatchTraceRecord> &records, const string &prefix) :
+        prefix(prefix),
+        batch(nullptr),
+        nextUnknownWd(REPLAY_UNKNOWN_WATCH_BASE)
+    {
+        for (auto &record : records) {
+            if (record.type == TraceWatchAdded)
+                recordedWatches[record.path].push_back(record.wd);
+        }
+    }
+
+    vector<int> fds() const override
+    {
+        return vector<int>();
+    }
+
+    int addWatch(const string &path) override
+    {
+        auto recorded = recordedWatches.find(path.substr(prefix.size()));
+        if (recorded == recordedWatches.end() || recorded->second.empty())
+            return nextUnknownWd++;
+
+        int wd = recorded->second.front();
+        recorded->second.pop_front();
+        return wd;
+    }
+
+    void removeWatch(int wd) override
+    {
+    }
+
+    void readEvents(vector<WatchEvent> &events) override
+    {
+        if (!batch)
+            return;
+
+        for (auto &event : batch->events) {
+            WatchEvent watchEvent = { event.wd, event.mask, event.cookie, event.name.c_str() };
+            events.push_back(watchEvent);
+        }
+        batch = nullptr;
+    }
+
+    // Returned by the next read
+    void deliver(const WatchTraceRecord *record)
+    {
+        batch = record;
+    }
+
+private:
+    string prefix;
+    // Every time a directory was watched, in order
+    map<string, deque<int>> recordedWatches;
+    const WatchTraceRecord *batch;
+    int nextUnknownWd;
+};
+
+// Ones without a watched parent are roots, e.g. of a volume which was
+// mounted while recording
+static void addRecordedWatch(ShadowTree &shadow, const WatchTraceRecord &record, vector<string> &roots)
+{
+    if (record.type != TraceWatchAdded)
+        return;
+    if (!shadow.isDirectory(parentOf(record.path)) && !shadow.isDirectory(record.path))
+        roots.push_back(record.path);
+    shadow.addWatch(record.wd, record.path);
+}
+
+// Everything due right now, which includes database replies and checking
+// directories after an overflow
+static void runPending()
+{
+    while (g_main_context_iteration(nullptr, FALSE))
+        ;
+}
+
+static void runCommands(MojoMediaDatabase &database)
+{
+    while (database.queuedCommands() > 0 || database.pendingRemovalCount() > 0)
+        g_main_context_iteration(nullptr, TRUE);
+}
+
+// The trace path is the only string in the results which we don't control
+static string jsonEscape(const string &value)
+{
+    string escaped;
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char) c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", (unsigned char) c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+int main(int argc, char **argv)
+{
+    gchar *directory = nullptr;
+    gchar *output = nullptr;
+    gboolean keep = FALSE;
+    gboolean verbose = FALSE;
+
+    GOptionEntry entries[] = {
+        { "directory", 0, 0, G_OPTION_ARG_STRING, &directory, "Where to work instead of a new temporary directory", "PATH" },
+        { "output", 'o', 0, G_OPTION_ARG_STRING, &output, "Write the results there instead of stdout", "FILE" },
+        { "keep", 'k', 0, G_OPTION_ARG_NONE, &keep, "Keep the recreated files", nullptr },
+        { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Show what the watcher does, this slows it down", nullptr },
+        { nullptr }
+    };
+
+    GError *error = nullptr;
+    GOptionContext *context = g_option_context_new("TRACE - replay recorded watch events");
+    g_option_context_add_main_entries(context, entries, nullptr);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (argc != 2) {
+        fprintf(stderr, "Which trace should be replayed?\n");
+        return 1;
+    }
+    const string tracePath = argv[1];
+
+    vector<WatchTraceRecord> records;
+    string traceError;
+    if (!readWatchTrace(tracePath, records, traceError)) {
+        fprintf(stderr, "Could not read %s: %s\n", tracePath.c_str(), traceError.c_str());
+        return 1;
+    }
+
+    string base;
+    bool temporary = !directory;
+    if (directory) {
+        base = directory;
+        g_free(directory);
+    } else {
+        gchar *tmp = g_dir_make_tmp("mediaindexer-replay-XXXXXX", &error);
+        if (!tmp) {
+            fprintf(stderr, "Could not create a temporary directory: %s\n", error->message);
+            g_error_free(error);
+            return 1;
+        }
+        base = tmp;
+        g_free(tmp);
+    }
+
+    // The watcher tells about every single change which would be measured
+    // as well, the results go to where stdout was before
+    FILE *out = nullptr;
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            fprintf(stderr, "Could not open %s: %s\n", output, strerror(errno));
+            g_free(output);
+            return 1;
+        }
+        g_free(output);
+    } else {
+        out = fdopen(dup(STDOUT_FILENO), "w");
+        if (!out) {
+            fprintf(stderr, "Could not duplicate stdout: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    if (!verbose && !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "Could not silence the watcher output: %s\n", strerror(errno));
+        fclose(out);
+        return 1;
+    }
+
+    size_t batches = 0;
+    size_t events = 0;
+    gint64 handlingUs = 0;
+    size_t queued = 0;
+    int watches = 0;
+
+    try {
+        ShadowTree shadow(base + "/tree");
+
+        FakeDatabaseClient client;
+        MojoMediaDatabase mojoDb(client);
+        // Nothing is extracted so there can't be any thumbnails, but better
+        // safe than writing to the real thumbnail directory
+        mojoDb.setPostponing(true);
+        MediaStore store(&mojoDb, base + "/data");
+        // A new file database starts with a rebuild which drops all kinds
+        runCommands(mojoDb);
+        client.addMediaKinds();
+
+        MetadataExtractor extractor;
+        ExtractionQueue queue(store, extractor);
+        queue.setPaused(true);
+
+        ReplayBackend *backend = new ReplayBackend(records, shadow.root());
+        SubtreeWatcher watcher(store, queue, set<string>(), backend);
+
+        // The tree we started with
+        size_t next = 0;
+        vector<string> roots;
+        for (; next < records.size() && records[next].type != TraceEvents; next++)
+            addRecordedWatch(shadow, records[next], roots);
+        for (auto &root : roots)
+            watcher.addRoot(shadow.root() + root);
+
+        gint64 firstPendingUs = next < records.size() ? records[next].timeUs : 0;
+        while (next < records.size()) {
+            const WatchTraceRecord &record = records[next];
+            shadow.apply(record);
+
+            // Directories watched while handling the events existed by the
+            // time they were read
+            roots.clear();
+            size_t following = next + 1;
+            for (; following < records.size() && records[following].type != TraceEvents; following++)
+                addRecordedWatch(shadow, records[following], roots);
+
+            backend->deliver(&record);
+
+            gint64 start = g_get_monotonic_time();
+            watcher.processEvents();
+            // The watcher would have gone ahead once nothing happened for a while
+            if (following == records.size() ||
+                records[following].timeUs - record.timeUs >= PENDING_FILES_QUIET_PERIOD_MS * 1000 ||
+                records[following].timeUs - firstPendingUs >= PENDING_FILES_MAX_DELAY_US) {
+                watcher.flushPendingFiles();
+                firstPendingUs = following < records.size() ? records[following].timeUs : 0;
+            }
+            handlingUs += g_get_monotonic_time() - start;
+
+            batches++;
+            events += record.events.size();
+
+            runPending();
+
+            for (auto &root : roots)
+                watcher.addRoot(shadow.root() + root);
+            next = following;
+        }
+
+        runCommands(mojoDb);
+        queued = queue.size();
+        watches = watcher.directoryCount();
+    } catch (const exception &e) {
+        fprintf(stderr, "Replay failed: %s\n", e.what());
+        if (!keep)
+            removeGenerated(base, temporary);
+        fclose(out);
+        return 1;
+    }
+
+    if (!keep)
+        removeGenerated(base, temporary);
+
+    const Statistics &stats = statistics();
+    fprintf(out, "{\n");
+    fprintf(out, "  \"trace\": \"%s\",\n", jsonEscape(tracePath).c_str());
+    fprintf(out, "  \"batches\": %zu,\n", batches);
+    fprintf(out, "  \"events\": %zu,\n", events);
+    fprintf(out, "  \"handlingUs\": %lld,\n", (long long) handlingUs);
+    fprintf(out, "  \"eventsPerSecond\": %.1f,\n",
+            handlingUs ? events * (double) G_USEC_PER_SEC / handlingUs : 0.0);
+    fprintf(out, "  \"watches\": %d,\n", watches);
+    fprintf(out, "  \"filesQueued\": %zu,\n", queued);
+    fprintf(out, "  \"filesAdded\": %llu,\n", (unsigned long long) stats.filesDiscovered.value());
+    fprintf(out, "  \"filesRemoved\": %llu,\n", (unsigned long long) stats.filesRemoved.value());
+    fprintf(out, "  \"filesRenamed\": %llu,\n", (unsigned long long) stats.filesRenamed.value());
+    fprintf(out, "  \"directoriesRenamed\": %llu,\n", (unsigned long long) stats.directoriesRenamed.value());
+    fprintf(out, "  \"directoriesRemoved\": %llu\n", (unsigned long long) stats.directoriesRemoved.value());
+    fprintf(out, "}\n");
+    fclose(out);
+
+    return 0;
+}
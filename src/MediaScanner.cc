@@ -21,14 +21,19 @@
 #include<sys/select.h>
 #include<sys/stat.h>
 #include<sys/types.h>
+#include<fcntl.h>
 #include<sys/inotify.h>
 #include<unistd.h>
+#include<sys/syscall.h>
+#include<algorithm>
 #include<cstdio>
+#include<cstdlib>
 #include<cerrno>
 #include<cstring>
 #include<map>
 #include<memory>
 #include<cassert>
+#include<ctime>
 #include <dirent.h>
 #include <stdexcept>
 
@@ -38,7 +43,11 @@
 #include "MediaFile.hh"
 #include "MediaStore.hh"
 #include "MetadataExtractor.hh"
+#include "ExtractionQueue.hh"
+#include "MountMonitor.hh"
+#include "MojoMediaDatabase.hh"
 #include "SubtreeWatcher.hh"
+#include "WatchTrace.hh"
 #include "Scanner.hh"
 #include "util.h"
 #include "MediaScanner.hh"
@@ -47,6 +56,51 @@ using namespace std;
 
 using namespace mediascanner;
 
+// From linux/ioprio.h which isn't part of every toolchain
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+// Best effort level used outside of the background, 4 is the default
+#define IOPRIO_NORMAL_LEVEL 4
+// How often we check whether catching up after startup is done
+#define CATCH_UP_CHECK_INTERVAL_S 10
+// Directories done by a scan are saved this often
+#define CHECKPOINT_INTERVAL_S 30
+
+static void setIoPriority(IndexingPriority priority) {
+    int ioprio;
+    if (priority == BackgroundIndexing)
+        ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    else
+        ioprio = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | IOPRIO_NORMAL_LEVEL;
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0)
+        g_warning("Could not set I/O priority: %s", strerror(errno));
+}
+
+// Rewriting a file in place doesn't touch its directory, so the checkpoint
+// of a directory holds the newest status change of it and its files
+static time_t lastChangeIn(const string &directory) {
+    struct stat info;
+    if(lstat(directory.c_str(), &info) != 0)
+        return 0;
+    time_t lastChange = info.st_ctime;
+
+    unique_ptr<DIR, int(*)(DIR*)> dir(opendir(directory.c_str()), closedir);
+    if(!dir)
+        return lastChange;
+    struct dirent *de;
+    while((de = readdir(dir.get())) != nullptr) {
+        if(de->d_name[0] == '.')
+            continue;
+        if(fstatat(dirfd(dir.get()), de->d_name, &info, AT_SYMLINK_NOFOLLOW) == 0 &&
+           S_ISREG(info.st_mode) && info.st_ctime > lastChange)
+            lastChange = info.st_ctime;
+    }
+    return lastChange;
+}
+
 static std::string getCurrentUser() {
     int uid = geteuid();
     struct passwd *pwd = getpwuid(uid);
@@ -59,11 +113,21 @@ static std::string getCurrentUser() {
 }
 
 MediaScanner::MediaScanner(MojoMediaDatabase *mojoDb) :
-    sigint_id(0), sigterm_id(0)
+    sigint_id(0), sigterm_id(0),
+    mojoDb(mojoDb),
+    paused(false),
+    priority(NormalIndexing),
+    scansDeferred(false),
+    scan_idle(0),
+    catchingUp(false),
+    priorityAfterCatchUp(NormalIndexing),
+    catch_up_timeout(0),
+    checkpoint_timeout(0)
 {
     unique_ptr<MediaStore> tmp(new MediaStore(mojoDb));
     store = move(tmp);
     extractor.reset(new MetadataExtractor());
+    queue.reset(new ExtractionQueue(*store.get(), *extractor.get()));
 }
 
 void MediaScanner::setup(const std::set<std::string> dirsToIgnore)
@@ -71,6 +135,19 @@ void MediaScanner::setup(const std::set<std::string> dirsToIgnore)
     ignoredDirectories = dirsToIgnore;
 }
 
+void MediaScanner::recordWatchTrace(const std::string &path)
+{
+    watchTracePath = path;
+}
+
+void MediaScanner::createWatcher()
+{
+    WatcherBackend *backend = WatcherBackend::create();
+    if (!watchTracePath.empty())
+        backend = new TraceRecorder(backend, watchTracePath);
+    watcher.reset(new SubtreeWatcher(*store.get(), *queue.get(), ignoredDirectories, backend));
+}
+
 MediaScanner::~MediaScanner() {
     if (sigint_id != 0) {
         g_source_remove(sigint_id);
@@ -78,11 +155,26 @@ MediaScanner::~MediaScanner() {
     if (sigterm_id != 0) {
         g_source_remove(sigterm_id);
     }
+    if (scan_idle != 0) {
+        g_source_remove(scan_idle);
+    }
+    if (catch_up_timeout != 0) {
+        g_source_remove(catch_up_timeout);
+    }
+    if (checkpoint_timeout != 0) {
+        g_source_remove(checkpoint_timeout);
+    }
+
+    try {
+        saveCheckpoints();
+    } catch (const exception &e) {
+        g_warning("Could not save scan checkpoints: %s", e.what());
+    }
 }
 
 void MediaScanner::addDir(const string &dir) {
     assert(dir[0] == '/');
-    if(subtrees.find(dir) != subtrees.end()) {
+    if(roots.find(dir) != roots.end()) {
         g_message("%s: already watching this directory", __PRETTY_FUNCTION__);
         return;
     }
@@ -92,16 +184,290 @@ void MediaScanner::addDir(const string &dir) {
         return;
     }
 
-    unique_ptr<SubtreeWatcher> sw(new SubtreeWatcher(*store.get(), *extractor.get(), ignoredDirectories));
-    readFiles(*store.get(), dir, AllMedia);
-    sw->addDir(dir);
-    subtrees[dir] = move(sw);
+    if(!watcher)
+        createWatcher();
+    if(paused || scansDeferred)
+        deferredScans.push_back({dir, 0});
+    else
+        readFiles(*store.get(), dir, AllMedia);
+    watcher->addRoot(dir);
+    roots.insert(dir);
+}
+
+size_t MediaScanner::queuedFiles() const {
+    return queue->size();
+}
+
+void MediaScanner::pause() {
+    if(paused)
+        return;
+
+    printf("Pausing indexing.\n");
+    paused = true;
+    queue->setPaused(true);
+    mojoDb->setPostponing(true);
+}
+
+void MediaScanner::resume() {
+    if(!paused)
+        return;
+
+    printf("Resuming indexing.\n");
+    paused = false;
+    mojoDb->setPostponing(false);
+    queue->setPaused(false);
+    scheduleDeferredScans();
+}
+
+void MediaScanner::deferScans() {
+    scansDeferred = true;
+    if(!catchingUp) {
+        catchingUp = true;
+        priorityAfterCatchUp = priority;
+        applyPriority(BackgroundIndexing);
+    }
+}
+
+void MediaScanner::startDeferredScans() {
+    if(!scansDeferred)
+        return;
+
+    printf("Starting deferred scans of %zu directories.\n", deferredScans.size());
+    scansDeferred = false;
+    scheduleDeferredScans();
+    if(catchingUp && !catch_up_timeout)
+        catch_up_timeout = g_timeout_add_seconds(CATCH_UP_CHECK_INTERVAL_S, checkCatchUp, this);
+}
+
+void MediaScanner::scheduleDeferredScans() {
+    if(paused || scansDeferred || deferredScans.empty() || scan_idle)
+        return;
+    scan_idle = g_idle_add_full(G_PRIORITY_LOW, scanNextDeferredRoot, this, NULL);
+}
+
+gboolean MediaScanner::scanNextDeferredRoot(gpointer user_data) {
+    MediaScanner *scanner = static_cast<MediaScanner*>(user_data);
+
+    if(scanner->paused || scanner->deferredScans.empty()) {
+        scanner->scan_idle = 0;
+        return FALSE;
+    }
+
+    DeferredScan scan = scanner->deferredScans.front();
+    scanner->deferredScans.erase(scanner->deferredScans.begin());
+    // Removed again in the meantime
+    if(scanner->roots.find(scan.root) == scanner->roots.end())
+        return TRUE;
+
+    if(scan.since > 0)
+        scanner->watcher->reconcileRoot(scan.root, scan.since);
+    else
+        scanner->readFiles(*scanner->store.get(), scan.root, AllMedia);
+
+    return TRUE;
+}
+
+gboolean MediaScanner::checkCatchUp(gpointer user_data) {
+    MediaScanner *scanner = static_cast<MediaScanner*>(user_data);
+
+    if(!scanner->catchingUp) {
+        scanner->catch_up_timeout = 0;
+        return FALSE;
+    }
+
+    if(!scanner->deferredScans.empty() || scanner->queue->size() > 0)
+        return TRUE;
+
+    printf("Caught up with all changes since the last start.\n");
+    scanner->catchingUp = false;
+    scanner->catch_up_timeout = 0;
+    scanner->applyPriority(scanner->priorityAfterCatchUp);
+    return FALSE;
+}
+
+// Symlinks and ".." are resolved before looking at the roots so nothing
+// outside of them can be reached. The result is the path below the root
+// the file is indexed with, in case the root itself is a symlink.
+bool MediaScanner::resolveBelowRoot(const string &path, string &resolved) const {
+    unique_ptr<char, void(*)(void*)> realPath(realpath(path.c_str(), nullptr), free);
+    if(!realPath)
+        return false;
+    string real(realPath.get());
+
+    for(auto &root : roots) {
+        unique_ptr<char, void(*)(void*)> realRoot(realpath(root.c_str(), nullptr), free);
+        if(!realRoot)
+            continue;
+        string prefix(realRoot.get());
+        if(real == prefix || real.compare(0, prefix.size() + 1, prefix + "/") == 0) {
+            resolved = root + real.substr(prefix.size());
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MediaScanner::indexPath(const string &path, vector<string> &pending) {
+    string resolved;
+    if(path.empty() || path[0] != '/' || !resolveBelowRoot(path, resolved))
+        return false;
+
+    struct stat info;
+    if(stat(resolved.c_str(), &info) < 0)
+        return false;
+
+    vector<DetectedFile> files;
+    if(S_ISDIR(info.st_mode)) {
+        Scanner s;
+        files = s.scanFiles(extractor.get(), resolved, AllMedia, ignoredDirectories);
+    } else {
+        try {
+            files.push_back(extractor->detect(resolved));
+        } catch(const exception &e) {
+            fprintf(stderr, "Error when indexing %s: %s\n", resolved.c_str(), e.what());
+            return false;
+        }
+    }
+
+    for(auto &d : files) {
+        if(d.etag != store->getETag(d.path)) {
+            mojoDb->prioritize(d.path);
+            queue->enqueue(d, UrgentPriority);
+            pending.push_back(d.path);
+        } else if(mojoDb->insertPending(d.path)) {
+            // Extracted already but still waiting for the media database
+            mojoDb->prioritize(d.path);
+            pending.push_back(d.path);
+        }
+    }
+    return true;
+}
+
+void MediaScanner::setPriority(IndexingPriority priority) {
+    // Asked for explicitly, so it stays after catching up
+    catchingUp = false;
+    applyPriority(priority);
+}
+
+void MediaScanner::applyPriority(IndexingPriority priority) {
+    if(priority == this->priority)
+        return;
+
+    this->priority = priority;
+    setIoPriority(priority);
+    queue->setIndexingPriority(priority);
+}
+
+void MediaScanner::watchVolumes(const string &path) {
+    assert(path[0] == '/');
+    mountMonitor.reset(new MountMonitor(path, *this));
+    mountMonitor->start();
+}
+
+void MediaScanner::volumeMounted(const Volume &volume) {
+    const string &dir = volume.mountPoint;
+    // One of the configured roots is left alone
+    if(roots.find(dir) != roots.end())
+        return;
+
+    if (ignoredDirectories.find(dir) != ignoredDirectories.end()) {
+        g_warning("Ignoring directory %s", dir.c_str());
+        return;
+    }
+
+    // Something mounted inside a root is seen through that root already
+    for(auto &root : roots) {
+        if(dir.compare(0, root.size() + 1, root + "/") == 0) {
+            printf("Volume at %s is below the root %s, not adding it.\n",
+                   dir.c_str(), root.c_str());
+            return;
+        }
+    }
+
+    // Without a UUID we can't recognize it again, so it is handled like
+    // any other directory
+    if(volume.uuid.empty()) {
+        addDir(dir);
+        volumes[dir] = volume.uuid;
+        return;
+    }
+
+    // What we know about the mount point belongs to the volume mounted
+    // there before
+    string previous = store->getVolumeAt(dir);
+    if(!previous.empty() && previous != volume.uuid) {
+        printf("Another volume was mounted at %s before, dropping its files.\n", dir.c_str());
+        removeFilesBelowPath(*store.get(), dir);
+        store->clearCompletedDirectories(dir);
+        store->forgetVolume(previous);
+    }
+
+    store->attachVolume(volume.uuid, dir);
+
+    string knownMountPoint;
+    time_t lastSeen = 0;
+    if(store->getVolume(volume.uuid, knownMountPoint, lastSeen) && lastSeen > 0) {
+        printf("Volume %s is known, looking for changes only.\n", volume.uuid.c_str());
+        if(!watcher)
+            createWatcher();
+        watcher->addRoot(dir);
+        roots.insert(dir);
+        // Looking for the changes is a pass over the whole volume, which has
+        // to wait for the end of the startup like any other scan
+        if(paused || scansDeferred)
+            deferredScans.push_back({dir, lastSeen});
+        else
+            watcher->reconcileRoot(dir, lastSeen);
+    } else {
+        addDir(dir);
+    }
+
+    // Until it is removed again with everything indexed it counts as seen
+    // whenever it was seen completely the last time
+    store->setVolume(volume.uuid, dir, lastSeen);
+    volumes[dir] = volume.uuid;
+}
+
+void MediaScanner::volumeUnmounted(const Volume &volume) {
+    const string &dir = volume.mountPoint;
+    auto entry = volumes.find(dir);
+    if(entry == volumes.end())
+        return;
+
+    if(entry->second.empty()) {
+        removeDir(dir);
+        volumes.erase(entry);
+        return;
+    }
+
+    // What the scan got done so far is kept for when the volume comes back,
+    // before the queued files are dropped
+    saveCheckpoints();
+    forgetScan(dir);
+
+    // A scan we didn't get to yet leaves the index incomplete as well
+    size_t deferred = deferredScans.size();
+    deferredScans.erase(remove_if(deferredScans.begin(), deferredScans.end(),
+                                  [&](const DeferredScan &scan) { return scan.root == dir; }),
+                        deferredScans.end());
+
+    // The files stay in the index so we only have to look for changes once
+    // the volume comes back
+    bool complete = watcher->removeRoot(dir) && deferredScans.size() == deferred;
+    roots.erase(dir);
+    if(complete)
+        store->setVolume(entry->second, dir, time(nullptr));
+    store->detachVolume(dir);
+    volumes.erase(entry);
 }
 
 void MediaScanner::removeDir(const string &dir) {
     assert(dir[0] == '/');
-    assert(subtrees.find(dir) != subtrees.end());
-    subtrees.erase(dir);
+    assert(roots.find(dir) != roots.end());
+    watcher->removeRoot(dir);
+    roots.erase(dir);
+    forgetScan(dir);
+    store->clearCompletedDirectories(dir);
 
     // FIXME we need to remove all files below this directory
     removeFilesBelowPath(*store.get(), dir);
@@ -113,16 +479,107 @@ void MediaScanner::removeFilesBelowPath(MediaStore &store, const string &path)
 }
 
 void MediaScanner::readFiles(MediaStore &store, const string &subdir, const MediaType type) {
+    // Left over from a scan which was interrupted
+    map<string, time_t> completed = store.getCompletedDirectories(subdir);
+    if(!completed.empty())
+        printf("Resuming scan of %s, %zu directories were done already.\n", subdir.c_str(), completed.size());
+
+    map<string, PendingDirectory> directories;
     Scanner s;
+    s.detectFilesIn = [&](const string &directory) {
+        time_t lastChange = lastChangeIn(directory);
+        auto done = completed.find(directory);
+        if(done != completed.end() && done->second == lastChange)
+            return false;
+
+        PendingDirectory &pending = directories[directory];
+        pending.root = subdir;
+        pending.path = directory;
+        pending.lastChange = lastChange;
+        return true;
+    };
+
     vector<DetectedFile> files = s.scanFiles(extractor.get(), subdir, type, ignoredDirectories);
     for(auto &d : files) {
         // If the file is unchanged, skip it.
         if (d.etag == store.getETag(d.path))
             continue;
-        try {
-            store.insert(extractor->extract(d));
-        } catch(const exception &e) {
-            fprintf(stderr, "Error when indexing: %s\n", e.what());
+        queue->enqueue(d, BackgroundPriority);
+
+        auto directory = directories.find(d.path.substr(0, d.path.rfind('/')));
+        if(directory != directories.end())
+            directory->second.files.push_back(d.path);
+    }
+
+    for(auto &directory : directories)
+        pendingDirectories.push_back(move(directory.second));
+    scannedRoots.insert(subdir);
+    if(!checkpoint_timeout)
+        checkpoint_timeout = g_timeout_add_seconds(CHECKPOINT_INTERVAL_S, checkpointTimeout, this);
+}
+
+void MediaScanner::saveCheckpoints() {
+    map<string, vector<pair<string, time_t>>> done;
+    vector<PendingDirectory> remaining;
+    set<string> unfinished;
+    for(auto &directory : pendingDirectories) {
+        bool queued = false;
+        for(auto &file : directory.files) {
+            if(queue->isQueued(file)) {
+                queued = true;
+                break;
+            }
         }
+
+        // Extracted files are only safe once the media database has them,
+        // until then the journal might still reset their etags
+        if(queued || store->hasJournalEntriesBelow(directory.path)) {
+            unfinished.insert(directory.root);
+            remaining.push_back(move(directory));
+        } else {
+            done[directory.root].push_back(make_pair(directory.path, directory.lastChange));
+        }
+    }
+    pendingDirectories.swap(remaining);
+
+    for(auto &root : done) {
+        if(unfinished.find(root.first) != unfinished.end())
+            store->addCompletedDirectories(root.first, root.second);
+    }
+
+    // Nothing to resume once everything is indexed
+    for(auto root = scannedRoots.begin(); root != scannedRoots.end(); ) {
+        if(unfinished.find(*root) != unfinished.end()) {
+            ++root;
+            continue;
+        }
+        store->clearCompletedDirectories(*root);
+        root = scannedRoots.erase(root);
+    }
+}
+
+void MediaScanner::forgetScan(const string &root) {
+    vector<PendingDirectory> remaining;
+    for(auto &directory : pendingDirectories) {
+        if(directory.root != root)
+            remaining.push_back(move(directory));
+    }
+    pendingDirectories.swap(remaining);
+    scannedRoots.erase(root);
+}
+
+gboolean MediaScanner::checkpointTimeout(gpointer user_data) {
+    MediaScanner *scanner = static_cast<MediaScanner*>(user_data);
+
+    try {
+        scanner->saveCheckpoints();
+    } catch (const exception &e) {
+        g_warning("Could not save scan checkpoints: %s", e.what());
+    }
+
+    if(scanner->scannedRoots.empty()) {
+        scanner->checkpoint_timeout = 0;
+        return FALSE;
     }
+    return TRUE;
 }
@@ -25,36 +25,119 @@
 #include <string>
 #include <map>
 #include <set>
+#include <vector>
 
 #include "ScannerCore.hh"
+#include "MountMonitor.hh"
 
 namespace mediascanner
 {
 
 class MediaStore;
 class MetadataExtractor;
+class ExtractionQueue;
 class SubtreeWatcher;
 class MojoMediaDatabase;
 
-class MediaScanner final
+class MediaScanner final : public MountMonitorObserver
 {
 public:
     MediaScanner(MojoMediaDatabase *mojoDb);
     ~MediaScanner();
 
     void setup(const std::set<std::string> dirsToIgnore);
+    // Writes all watches and events to a trace for replaying them later,
+    // has to be called before the first directory is added
+    void recordWatchTrace(const std::string &path);
     void addDir(const std::string &dir);
     void removeDir(const std::string &dir);
+    // Volumes mounted below the path become roots while they are there
+    void watchVolumes(const std::string &path);
+    // Files waiting for their metadata to be extracted
+    size_t queuedFiles() const;
+
+    // Changes are still watched for while paused, but nothing is scanned,
+    // extracted or thumbnailed until indexing is resumed
+    void pause();
+    void resume();
+    bool isPaused() const { return paused; }
+    void setPriority(IndexingPriority priority);
+    IndexingPriority getPriority() const { return priority; }
+
+    // Moves a file or all files below a directory ahead of everything else.
+    // The files which are not in the media database yet are added to
+    // pending, fails for paths which don't exist or resolve to somewhere
+    // outside of our roots.
+    bool indexPath(const std::string &path, std::vector<std::string> &pending);
+
+    // Until startDeferredScans is called roots are only watched and all
+    // indexing is done in the background
+    void deferScans();
+    // Scans one root per main loop iteration. Once everything found is
+    // indexed we go back to the priority we had before.
+    void startDeferredScans();
+
+    void volumeMounted(const Volume &volume) override;
+    void volumeUnmounted(const Volume &volume) override;
 
 private:
     void readFiles(MediaStore &store, const std::string &subdir, const MediaType type);
     void removeFilesBelowPath(MediaStore &store, const std::string &path);
+    bool resolveBelowRoot(const std::string &path, std::string &resolved) const;
+    void createWatcher();
+    void applyPriority(IndexingPriority priority);
+    void scheduleDeferredScans();
+    static gboolean scanNextDeferredRoot(gpointer user_data);
+    static gboolean checkCatchUp(gpointer user_data);
+    void saveCheckpoints();
+    void forgetScan(const std::string &root);
+    static gboolean checkpointTimeout(gpointer user_data);
+
+    // A directory of a running scan, it counts as done once none of its
+    // files is queued anymore
+    struct PendingDirectory {
+        std::string root;
+        std::string path;
+        time_t lastChange;
+        std::vector<std::string> files;
+    };
 
     int sigint_id, sigterm_id;
+    MojoMediaDatabase *mojoDb;
+    bool paused;
+    IndexingPriority priority;
+    struct DeferredScan {
+        std::string root;
+        // Only what changed since then is looked for, 0 for a full scan
+        time_t since;
+    };
+
+    // Roots added while paused or during startup, they are scanned later
+    std::vector<DeferredScan> deferredScans;
+    bool scansDeferred;
+    guint scan_idle;
+    // Set while we are catching up after startup
+    bool catchingUp;
+    IndexingPriority priorityAfterCatchUp;
+    guint catch_up_timeout;
+    // Finished directories are saved from time to time so an interrupted
+    // scan doesn't have to start over
+    std::vector<PendingDirectory> pendingDirectories;
+    // Roots which were walked completely but whose files are still queued
+    std::set<std::string> scannedRoots;
+    guint checkpoint_timeout;
     std::unique_ptr<MediaStore> store;
     std::unique_ptr<MetadataExtractor> extractor;
-    std::map<std::string, std::unique_ptr<SubtreeWatcher>> subtrees;
+    std::unique_ptr<ExtractionQueue> queue;
+    // One watcher for all roots so moves between them are seen as such
+    std::unique_ptr<SubtreeWatcher> watcher;
+    std::set<std::string> roots;
+    // UUID of the volume mounted at each root which is a volume, empty
+    // if it doesn't have one
+    std::map<std::string, std::string> volumes;
     std::set<std::string> ignoredDirectories;
+    std::string watchTracePath;
+    std::unique_ptr<MountMonitor> mountMonitor;
 };
 
 } // namespace mediascanner
@@ -18,6 +18,8 @@
 #include "MediaScannerServiceApp.hh"
 #include "MojoMediaDatabase.hh"
 
+#define DEFAULT_STARTUP_DELAY_S 60
+
 int main(int argc, char** argv)
 {
     MediaScannerServiceApp app;
@@ -28,15 +30,26 @@ const char* const MediaScannerServiceApp::ServiceName = "org.webosports.service.
 
 MediaScannerServiceApp::MediaScannerServiceApp() :
     db_client(&service),
-    database(db_client),
+    luna_client(db_client),
+    database(luna_client),
     media_scanner(&database),
-    rootPath("/media/internal")
+    rootPath("/media/internal"),
+    volumesPath("/media"),
+    startupDelay(DEFAULT_STARTUP_DELAY_S)
 {
     s_log.level(MojLogger::LevelTrace);
 
     ignoredDirectories.insert(THUMBNAIL_DIR);
     ignoredDirectories.insert("/media/internal/android/Android");
     ignoredDirectories.insert("/media/internal/.cache");
+    ignoredDirectories.insert("/media/cryptofs");
+}
+
+MediaScannerServiceApp::~MediaScannerServiceApp()
+{
+    // The service keeps the handler alive for longer than the database
+    if (handler.get())
+        database.removeObserver(handler.get());
 }
 
 MojErr MediaScannerServiceApp::open()
@@ -52,9 +65,37 @@ MojErr MediaScannerServiceApp::open()
     err = service.attach(m_reactor.impl());
     MojErrCheck(err);
 
+    handler.reset(new MediaScannerServiceHandler(media_scanner, database));
+    MojAllocCheck(handler.get());
+
+    err = handler->init();
+    MojErrCheck(err);
+
+    err = service.addCategory(MojService::DefaultCategory, handler.get());
+    MojErrCheck(err);
+
     media_scanner.setup(ignoredDirectories);
+    if (!watchTrace.empty())
+        media_scanner.recordWatchTrace(watchTrace);
+
+    // Everything is watched right away but scanning waits for the boot to
+    // finish so we don't compete with it for the flash
+    if (startupDelay > 0)
+        media_scanner.deferScans();
+
     media_scanner.addDir(rootPath);
     media_scanner.addDir("/usr/share/wallpapers");
+    media_scanner.watchVolumes(volumesPath);
+
+    if (startupDelay > 0) {
+        bootWatcher.reset(new BootWatcher(service));
+        MojAllocCheck(bootWatcher.get());
+
+        err = bootWatcher->start(startupDelay, [this]() {
+            media_scanner.startDeferredScans();
+        });
+        MojErrCheck(err);
+    }
 
     return MojErrNone;
 }
@@ -70,6 +111,20 @@ MojErr MediaScannerServiceApp::configure(const MojObject &conf)
     if (conf.get("rootPath", rootPathObj) && rootPathObj.stringValue(rootPathStr))
         rootPath = rootPathStr.data();
 
+    MojObject volumesPathObj;
+    MojString volumesPathStr;
+    if (conf.get("volumesPath", volumesPathObj) && volumesPathObj.stringValue(volumesPathStr))
+        volumesPath = volumesPathStr.data();
+
+    MojObject startupDelayObj;
+    if (conf.get("startupDelay", startupDelayObj))
+        startupDelay = startupDelayObj.intValue();
+
+    MojObject watchTraceObj;
+    MojString watchTraceStr;
+    if (conf.get("watchTrace", watchTraceObj) && watchTraceObj.stringValue(watchTraceStr))
+        watchTrace = watchTraceStr.data();
+
     MojObject ignoredDirectoriesObj;
     if (conf.get("ignoredDirectories", ignoredDirectoriesObj) &&
         ignoredDirectoriesObj.type() == MojObject::Type::TypeArray) {
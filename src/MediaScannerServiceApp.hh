@@ -23,7 +23,10 @@
 #include <luna/MojLunaService.h>
 #include <db/MojDbServiceClient.h>
 
+#include "BootWatcher.hh"
+#include "DatabaseClient.hh"
 #include "MediaScanner.hh"
+#include "MediaScannerServiceHandler.hh"
 #include "MojoMediaDatabase.hh"
 
 #include <set>
@@ -37,6 +40,7 @@ public:
     static const char* const ServiceName;
 
     MediaScannerServiceApp();
+    ~MediaScannerServiceApp();
 
     virtual MojErr open();
     virtual MojErr configure(const MojObject& conf);
@@ -45,9 +49,17 @@ private:
     typedef MojReactorApp<MojGmainReactor> Base;
     MojLunaService service;
     MojDbServiceClient db_client;
+    LunaDatabaseClient luna_client;
     MojoMediaDatabase database;
     MediaScanner media_scanner;
+    MojRefCountedPtr<MediaScannerServiceHandler> handler;
+    MojRefCountedPtr<BootWatcher> bootWatcher;
     std::string rootPath;
+    std::string volumesPath;
+    // Seconds to wait for the end of the boot before we scan anyway
+    MojInt64 startupDelay;
+    // Where to record watch events to, nothing is recorded if empty
+    std::string watchTrace;
     std::set<std::string> ignoredDirectories;
 };
 
@@ -0,0 +1,512 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MediaScannerServiceHandler.hh"
+#include "MediaScanner.hh"
+#include "MojoMediaDatabase.hh"
+#include "Statistics.hh"
+
+// Subscribers get a new status this often
+#define STATUS_UPDATE_INTERVAL_S 5
+// Throughput is only measured over periods at least this long
+#define THROUGHPUT_MIN_PERIOD_US G_USEC_PER_SEC
+// A summary of all counters goes to the log this often
+#define STATISTICS_LOG_INTERVAL_S 300
+// Indexing resumes by itself after this unless the caller asks for longer
+#define PAUSE_DEFAULT_TIMEOUT_S 300
+#define PAUSE_MAX_TIMEOUT_S 3600
+// Files requested with indexPath which are not in the media database by
+// then are given up on, they probably failed to extract
+#define INDEX_PATH_TIMEOUT_S 60
+
+using namespace mediascanner;
+
+const MediaScannerServiceHandler::Method MediaScannerServiceHandler::s_methods[] = {
+    { "getStatus", (Callback) &MediaScannerServiceHandler::getStatus },
+    { "pause", (Callback) &MediaScannerServiceHandler::pause },
+    { "resume", (Callback) &MediaScannerServiceHandler::resume },
+    { "setPriority", (Callback) &MediaScannerServiceHandler::setPriority },
+    { "indexPath", (Callback) &MediaScannerServiceHandler::indexPath },
+    { NULL, NULL }
+};
+
+MediaScannerServiceHandler::StatusSubscription::StatusSubscription(MojServiceMessage *message) :
+    message(message),
+    cancelled(false),
+    cancel_slot(this, &StatusSubscription::handleCancel)
+{
+    message->notifyCancel(cancel_slot);
+}
+
+MojErr MediaScannerServiceHandler::StatusSubscription::handleCancel(MojServiceMessage *message)
+{
+    // Dropped with the next update, we are called from within the message
+    cancelled = true;
+    return MojErrNone;
+}
+
+MediaScannerServiceHandler::IndexRequest::IndexRequest(MojServiceMessage *message, const MojString &path,
+                                                       const std::vector<std::string> &files, gint64 deadline) :
+    message(message),
+    path(path),
+    pending(files.begin(), files.end()),
+    total(files.size()),
+    deadline(deadline),
+    cancelled(false),
+    cancel_slot(this, &IndexRequest::handleCancel)
+{
+    message->notifyCancel(cancel_slot);
+}
+
+MojErr MediaScannerServiceHandler::IndexRequest::handleCancel(MojServiceMessage *message)
+{
+    cancelled = true;
+    return MojErrNone;
+}
+
+MediaScannerServiceHandler::MediaScannerServiceHandler(MediaScanner &scanner, MojoMediaDatabase &database) :
+    scanner(scanner),
+    database(database),
+    update_timeout(0),
+    log_timeout(0),
+    pause_timeout(0),
+    priority_timeout(0),
+    index_timeout(0),
+    lastLoggedCommitted(0),
+    lastLoggedDiscovered(0),
+    lastSampleTime(g_get_monotonic_time()),
+    lastExtracted(0),
+    lastCommitted(0),
+    extractedPerSecond(0),
+    committedPerSecond(0)
+{
+}
+
+MediaScannerServiceHandler::~MediaScannerServiceHandler()
+{
+    if (update_timeout)
+        g_source_remove(update_timeout);
+    if (log_timeout)
+        g_source_remove(log_timeout);
+    if (pause_timeout)
+        g_source_remove(pause_timeout);
+    if (priority_timeout)
+        g_source_remove(priority_timeout);
+    if (index_timeout)
+        g_source_remove(index_timeout);
+}
+
+static const char* priorityName(IndexingPriority priority)
+{
+    switch (priority) {
+    case BackgroundIndexing:
+        return "background";
+    case HighIndexing:
+        return "high";
+    default:
+        return "normal";
+    }
+}
+
+MojErr MediaScannerServiceHandler::init()
+{
+    MojErr err = addMethods(s_methods);
+    MojErrCheck(err);
+
+    log_timeout = g_timeout_add_seconds(STATISTICS_LOG_INTERVAL_S, logStatistics, this);
+    database.addObserver(this);
+
+    return MojErrNone;
+}
+
+static MojErr putHistogram(MojObject &latency, const char *name, const LatencyHistogram &histogram)
+{
+    uint64_t count = histogram.count.value();
+
+    MojObject stageObj;
+    MojErr err = stageObj.putInt("count", count);
+    MojErrCheck(err);
+    err = stageObj.putInt("averageUs", count ? histogram.totalUs.value() / count : 0);
+    MojErrCheck(err);
+    err = stageObj.putInt("p50Us", histogram.percentileUs(50));
+    MojErrCheck(err);
+    err = stageObj.putInt("p95Us", histogram.percentileUs(95));
+    MojErrCheck(err);
+    err = stageObj.putInt("p99Us", histogram.percentileUs(99));
+    MojErrCheck(err);
+    err = stageObj.putInt("maxUs", histogram.maxUs.value());
+    MojErrCheck(err);
+
+    // Entry n counts everything faster than 2^n microseconds, empty buckets
+    // at the end are left out
+    int used = LATENCY_BUCKETS;
+    while (used > 0 && histogram.buckets[used - 1].value() == 0)
+        used--;
+    MojObject bucketsObj(MojObject::TypeArray);
+    for (int n = 0; n < used; n++) {
+        err = bucketsObj.push(MojObject((MojInt64) histogram.buckets[n].value()));
+        MojErrCheck(err);
+    }
+    err = stageObj.put("histogram", bucketsObj);
+    MojErrCheck(err);
+
+    err = latency.put(name, stageObj);
+    MojErrCheck(err);
+
+    return MojErrNone;
+}
+
+MojErr MediaScannerServiceHandler::buildStatus(MojObject &status)
+{
+    const Statistics &stats = statistics();
+    MojErr err;
+
+    MojObject filesObj;
+    err = filesObj.putInt("discovered", stats.filesDiscovered.value());
+    MojErrCheck(err);
+    err = filesObj.putInt("queued", stats.filesQueued.value());
+    MojErrCheck(err);
+    err = filesObj.putInt("extracted", stats.filesExtracted.value());
+    MojErrCheck(err);
+    err = filesObj.putInt("unchanged", stats.filesUnchanged.value());
+    MojErrCheck(err);
+    err = filesObj.putInt("failed", stats.filesFailed.value());
+    MojErrCheck(err);
+    err = filesObj.putInt("committed", stats.filesCommitted.value());
+    MojErrCheck(err);
+    err = status.put("files", filesObj);
+    MojErrCheck(err);
+
+    err = status.putBool("paused", scanner.isPaused());
+    MojErrCheck(err);
+    err = status.putString("priority", priorityName(scanner.getPriority()));
+    MojErrCheck(err);
+
+    MojObject queuesObj;
+    err = queuesObj.putInt("extraction", scanner.queuedFiles());
+    MojErrCheck(err);
+    err = queuesObj.putInt("databaseCommands", database.queuedCommands());
+    MojErrCheck(err);
+    err = queuesObj.putInt("pendingRemovals", database.pendingRemovalCount());
+    MojErrCheck(err);
+    err = queuesObj.putInt("dirtyAggregates", database.dirtyAggregateCount());
+    MojErrCheck(err);
+    err = queuesObj.putInt("postponedCommands", database.postponedCommandCount());
+    MojErrCheck(err);
+    err = status.put("queues", queuesObj);
+    MojErrCheck(err);
+
+    // Short periods say more about the timer than about us, until a longer
+    // one passed the last measurement is kept
+    gint64 now = g_get_monotonic_time();
+    gint64 period = now - lastSampleTime;
+    if (period >= THROUGHPUT_MIN_PERIOD_US) {
+        uint64_t extracted = stats.filesExtracted.value();
+        uint64_t committed = stats.filesCommitted.value();
+        double seconds = (double) period / G_USEC_PER_SEC;
+        extractedPerSecond = (extracted - lastExtracted) / seconds;
+        committedPerSecond = (committed - lastCommitted) / seconds;
+        lastSampleTime = now;
+        lastExtracted = extracted;
+        lastCommitted = committed;
+    }
+
+    MojObject throughputObj;
+    err = throughputObj.putDecimal("extractedPerSecond", MojDecimal(extractedPerSecond));
+    MojErrCheck(err);
+    err = throughputObj.putDecimal("committedPerSecond", MojDecimal(committedPerSecond));
+    MojErrCheck(err);
+    err = status.put("throughput", throughputObj);
+    MojErrCheck(err);
+
+    MojObject latencyObj;
+    for (int stage = 0; stage < StatisticsStageCount; stage++) {
+        err = putHistogram(latencyObj, Statistics::stageName((StatisticsStage) stage),
+                           stats.latency[stage]);
+        MojErrCheck(err);
+    }
+    err = status.put("latency", latencyObj);
+    MojErrCheck(err);
+
+    MojObject commandsObj;
+    for (auto &command : stats.commandLatency) {
+        err = putHistogram(commandsObj, command.first.c_str(), command.second);
+        MojErrCheck(err);
+    }
+    err = status.put("commandLatency", commandsObj);
+    MojErrCheck(err);
+
+    return MojErrNone;
+}
+
+MojErr MediaScannerServiceHandler::getStatus(MojServiceMessage *message, MojObject &payload)
+{
+    MojObject status;
+    MojErr err = buildStatus(status);
+    MojErrCheck(err);
+
+    bool subscribe = false;
+    payload.get("subscribe", subscribe);
+    if (subscribe) {
+        MojRefCountedPtr<StatusSubscription> subscription(new StatusSubscription(message));
+        subscriptions.push_back(subscription);
+        if (!update_timeout)
+            update_timeout = g_timeout_add_seconds(STATUS_UPDATE_INTERVAL_S, updateSubscriptions, this);
+    }
+    err = status.putBool("subscribed", subscribe);
+    MojErrCheck(err);
+
+    err = message->replySuccess(status);
+    MojErrCheck(err);
+
+    return MojErrNone;
+}
+
+MojErr MediaScannerServiceHandler::pause(MojServiceMessage *message, MojObject &payload)
+{
+    MojInt64 timeout = PAUSE_DEFAULT_TIMEOUT_S;
+    payload.get("timeout", timeout);
+    if (timeout <= 0 || timeout > PAUSE_MAX_TIMEOUT_S)
+        MojErrThrowMsg(MojErrInvalidArg, "timeout must be between 1 and %d seconds", PAUSE_MAX_TIMEOUT_S);
+
+    // Every pause restarts the timeout so a foreground app can keep us
+    // paused by repeating the call while it is busy
+    if (pause_timeout)
+        g_source_remove(pause_timeout);
+    pause_timeout = g_timeout_add_seconds(timeout, pauseExpired, this);
+
+    scanner.pause();
+
+    MojErr err = message->replySuccess();
+    MojErrCheck(err);
+
+    return MojErrNone;
+}
+
+MojErr MediaScannerServiceHandler::resume(MojServiceMessage *message, MojObject &payload)
+{
+    if (pause_timeout) {
+        g_source_remove(pause_timeout);
+        pause_timeout = 0;
+    }
+
+    scanner.resume();
+
+    MojErr err = message->replySuccess();
+    MojErrCheck(err);
+
+    return MojErrNone;
+}
+
+MojErr MediaScannerServiceHandler::setPriority(MojServiceMessage *message, MojObject &payload)
+{
+    MojString name;
+    MojErr err = payload.getRequired("priority", name);
+    MojErrCheck(err);
+
+    IndexingPriority priority;
+    if (name == "background")
+        priority = BackgroundIndexing;
+    else if (name == "normal")
+        priority = NormalIndexing;
+    else if (name == "high")
+        priority = HighIndexing;
+    else
+        MojErrThrowMsg(MojErrInvalidArg, "unknown priority %s", name.data());
+
+    if (priority_timeout) {
+        g_source_remove(priority_timeout);
+        priority_timeout = 0;
+    }
+
+    // Without a timeout the priority stays until it is changed again
+    MojInt64 timeout = 0;
+    payload.get("timeout", timeout);
+    if (timeout > 0 && priority != NormalIndexing)
+        priority_timeout = g_timeout_add_seconds(timeout, priorityExpired, this);
+
+    scanner.setPriority(priority);
+
+    err = message->replySuccess();
+    MojErrCheck(err);
+
+    return MojErrNone;
+}
+
+MojErr MediaScannerServiceHandler::indexPath(MojServiceMessage *message, MojObject &payload)
+{
+    MojString path;
+    MojErr err = payload.getRequired("path", path);
+    MojErrCheck(err);
+
+    std::vector<std::string> files;
+    if (!scanner.indexPath(path.data(), files))
+        MojErrThrowMsg(MojErrInvalidArg, "%s is not an existing file or directory below an indexed path", path.data());
+
+    MojRefCountedPtr<IndexRequest> request(new IndexRequest(message, path, files,
+        g_get_monotonic_time() + INDEX_PATH_TIMEOUT_S * G_USEC_PER_SEC));
+    MojAllocCheck(request.get());
+
+    // Everything is indexed already
+    if (request->pending.empty())
+        return replyIndexed(*request);
+
+    indexRequests.push_back(request);
+    if (!index_timeout)
+        index_timeout = g_timeout_add_seconds(1, expireIndexRequests, this);
+
+    return MojErrNone;
+}
+
+MojErr MediaScannerServiceHandler::replyIndexed(IndexRequest &request)
+{
+    MojObject reply;
+    MojErr err = reply.putString("path", request.path);
+    MojErrCheck(err);
+    err = reply.putBool("complete", request.pending.empty());
+    MojErrCheck(err);
+    err = reply.putInt("indexed", request.total - request.pending.size());
+    MojErrCheck(err);
+    err = reply.putInt("failed", request.pending.size());
+    MojErrCheck(err);
+
+    err = request.message->replySuccess(reply);
+    MojErrCheck(err);
+
+    return MojErrNone;
+}
+
+// Keeps the priority of files another request still waits for
+void MediaScannerServiceHandler::releasePaths(IndexRequest &request)
+{
+    for (auto &path : request.pending) {
+        bool wanted = false;
+        for (auto &other : indexRequests) {
+            if (other.get() != &request && other->pending.count(path))
+                wanted = true;
+        }
+        if (!wanted)
+            database.forgetPriority(path);
+    }
+}
+
+void MediaScannerServiceHandler::fileInserted(const std::string& path, int journalSeq)
+{
+    std::vector<MojRefCountedPtr<IndexRequest>> remaining;
+    for (auto &request : indexRequests) {
+        request->pending.erase(path);
+        if (request->pending.empty()) {
+            if (!request->cancelled)
+                replyIndexed(*request);
+        } else {
+            remaining.push_back(request);
+        }
+    }
+    indexRequests.swap(remaining);
+}
+
+gboolean MediaScannerServiceHandler::expireIndexRequests(gpointer user_data)
+{
+    MediaScannerServiceHandler *handler = static_cast<MediaScannerServiceHandler*>(user_data);
+    gint64 now = g_get_monotonic_time();
+
+    std::vector<MojRefCountedPtr<IndexRequest>> expired;
+    std::vector<MojRefCountedPtr<IndexRequest>> remaining;
+    for (auto &request : handler->indexRequests) {
+        if (request->cancelled || now >= request->deadline)
+            expired.push_back(request);
+        else
+            remaining.push_back(request);
+    }
+    handler->indexRequests.swap(remaining);
+
+    for (auto &request : expired) {
+        handler->releasePaths(*request);
+        if (!request->cancelled)
+            handler->replyIndexed(*request);
+    }
+
+    if (handler->indexRequests.empty()) {
+        handler->index_timeout = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+gboolean MediaScannerServiceHandler::pauseExpired(gpointer user_data)
+{
+    MediaScannerServiceHandler *handler = static_cast<MediaScannerServiceHandler*>(user_data);
+
+    g_message("Indexing was paused for too long, resuming");
+    handler->pause_timeout = 0;
+    handler->scanner.resume();
+
+    return FALSE;
+}
+
+gboolean MediaScannerServiceHandler::priorityExpired(gpointer user_data)
+{
+    MediaScannerServiceHandler *handler = static_cast<MediaScannerServiceHandler*>(user_data);
+
+    handler->priority_timeout = 0;
+    handler->scanner.setPriority(NormalIndexing);
+
+    return FALSE;
+}
+
+gboolean MediaScannerServiceHandler::updateSubscriptions(gpointer user_data)
+{
+    MediaScannerServiceHandler *handler = static_cast<MediaScannerServiceHandler*>(user_data);
+
+    std::vector<MojRefCountedPtr<StatusSubscription>> subscriptions;
+    for (auto &subscription : handler->subscriptions) {
+        if (!subscription->cancelled)
+            subscriptions.push_back(subscription);
+    }
+    handler->subscriptions.swap(subscriptions);
+
+    if (handler->subscriptions.empty()) {
+        handler->update_timeout = 0;
+        return FALSE;
+    }
+
+    MojObject status;
+    if (handler->buildStatus(status) != MojErrNone)
+        return TRUE;
+    status.putBool("subscribed", true);
+
+    for (auto &subscription : handler->subscriptions)
+        subscription->message->replySuccess(status);
+
+    return TRUE;
+}
+
+gboolean MediaScannerServiceHandler::logStatistics(gpointer user_data)
+{
+    MediaScannerServiceHandler *handler = static_cast<MediaScannerServiceHandler*>(user_data);
+    const Statistics &stats = statistics();
+
+    // Nothing to tell while we are idle
+    uint64_t discovered = stats.filesDiscovered.value();
+    uint64_t committed = stats.filesCommitted.value();
+    if (discovered == handler->lastLoggedDiscovered && committed == handler->lastLoggedCommitted)
+        return TRUE;
+    handler->lastLoggedDiscovered = discovered;
+    handler->lastLoggedCommitted = committed;
+
+    stats.logSummary();
+    return TRUE;
+}
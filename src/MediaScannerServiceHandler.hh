@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEDIASCANNERSERVICEHANDLER_HH
+#define MEDIASCANNERSERVICEHANDLER_HH
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <glib.h>
+#include <core/MojService.h>
+#include <core/MojServiceMessage.h>
+
+#include "MojoMediaDatabase.hh"
+
+namespace mediascanner {
+class MediaScanner;
+}
+
+/*
+ * The methods of our luna service.
+ */
+class MediaScannerServiceHandler : public MojService::CategoryHandler,
+                                   public mediascanner::MojoMediaDatabaseObserver
+{
+public:
+    MediaScannerServiceHandler(mediascanner::MediaScanner &scanner,
+                               mediascanner::MojoMediaDatabase &database);
+    ~MediaScannerServiceHandler();
+
+    MojErr init();
+
+    void fileInserted(const std::string& path, int journalSeq) override;
+
+private:
+    class StatusSubscription : public MojSignalHandler
+    {
+    public:
+        StatusSubscription(MojServiceMessage *message);
+
+        MojErr handleCancel(MojServiceMessage *message);
+
+        MojRefCountedPtr<MojServiceMessage> message;
+        bool cancelled;
+        MojServiceMessage::CancelSignal::Slot<StatusSubscription> cancel_slot;
+    };
+
+    class IndexRequest : public MojSignalHandler
+    {
+    public:
+        IndexRequest(MojServiceMessage *message, const MojString &path,
+                     const std::vector<std::string> &files, gint64 deadline);
+
+        MojErr handleCancel(MojServiceMessage *message);
+
+        MojRefCountedPtr<MojServiceMessage> message;
+        MojString path;
+        // Files which are not in the media database yet
+        std::set<std::string> pending;
+        size_t total;
+        gint64 deadline;
+        bool cancelled;
+        MojServiceMessage::CancelSignal::Slot<IndexRequest> cancel_slot;
+    };
+
+    MojErr getStatus(MojServiceMessage *message, MojObject &payload);
+    MojErr pause(MojServiceMessage *message, MojObject &payload);
+    MojErr resume(MojServiceMessage *message, MojObject &payload);
+    MojErr setPriority(MojServiceMessage *message, MojObject &payload);
+    MojErr indexPath(MojServiceMessage *message, MojObject &payload);
+
+    MojErr buildStatus(MojObject &status);
+    static gboolean updateSubscriptions(gpointer user_data);
+    static gboolean logStatistics(gpointer user_data);
+    static gboolean pauseExpired(gpointer user_data);
+    static gboolean priorityExpired(gpointer user_data);
+    MojErr replyIndexed(IndexRequest &request);
+    void releasePaths(IndexRequest &request);
+    static gboolean expireIndexRequests(gpointer user_data);
+
+    static const Method s_methods[];
+
+    mediascanner::MediaScanner &scanner;
+    mediascanner::MojoMediaDatabase &database;
+    std::vector<MojRefCountedPtr<StatusSubscription>> subscriptions;
+    guint update_timeout;
+    guint log_timeout;
+    // Nobody stays in control of indexing forever, once these fire
+    // we go back to normal
+    guint pause_timeout;
+    guint priority_timeout;
+    std::vector<MojRefCountedPtr<IndexRequest>> indexRequests;
+    guint index_timeout;
+    uint64_t lastLoggedCommitted;
+    uint64_t lastLoggedDiscovered;
+    // Counters at the previous status, throughput is measured from there
+    gint64 lastSampleTime;
+    uint64_t lastExtracted;
+    uint64_t lastCommitted;
+    double extractedPerSecond;
+    double committedPerSecond;
+};
+
+#endif
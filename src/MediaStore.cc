@@ -33,6 +33,7 @@
 #include "internal/utils.hh"
 #include "internal/sqliteutils.hh"
 #include "MojoMediaDatabase.hh"
+#include "Statistics.hh"
 
 using namespace std;
 
@@ -40,7 +41,13 @@ namespace  mediascanner {
 
 // Increment this whenever changing db schema.
 // It will cause dbstore to rebuild its tables.
-static const int schemaVersion = 5;
+static const int schemaVersion = 11;
+// Same for the databases of the volumes, which only hold their files table
+static const int volumeSchemaVersion = 1;
+
+// Acknowledged journal entries are dropped in batches to save disk writes
+#define JOURNAL_ACKNOWLEDGE_DELAY_MS 1000
+#define JOURNAL_ACKNOWLEDGE_BATCH_SIZE 100
 
 static int getSchemaVersion(sqlite3 *db)
 {
@@ -67,6 +74,9 @@ void deleteTables(sqlite3 *db)
 {
     string deleteCmd(R"(
 DROP TABLE IF EXISTS files;
+DROP TABLE IF EXISTS journal;
+DROP TABLE IF EXISTS volumes;
+DROP TABLE IF EXISTS scanCheckpoints;
 DROP TABLE IF EXISTS schemaVersion;
 )");
     execute_sql(db, deleteCmd);
@@ -79,6 +89,19 @@ CREATE TABLE schemaVersion (version INTEGER);
 CREATE TABLE files (
     path TEXT PRIMARY KEY NOT NULL,
     etag TEXT);
+CREATE TABLE journal (
+    path TEXT PRIMARY KEY NOT NULL,
+    operation INTEGER,
+    seq INTEGER);
+CREATE TABLE volumes (
+    uuid TEXT PRIMARY KEY NOT NULL,
+    mountPoint TEXT,
+    lastSeen INTEGER);
+CREATE TABLE scanCheckpoints (
+    root TEXT NOT NULL,
+    directory TEXT NOT NULL,
+    lastChange INTEGER,
+    PRIMARY KEY (root, directory));
 )");
     execute_sql(db, schema);
 
@@ -87,16 +110,22 @@ CREATE TABLE files (
     version.step();
 }
 
-#define LUNA_DATA_DIR   "/var/luna/data"
+// One database per volume, named after its filesystem UUID
+#define VOLUME_DB_SUBDIR "/filenotify-volumes"
 
-MediaStore::MediaStore(MojoMediaDatabase *mojoDb) :
+MediaStore::MediaStore(MojoMediaDatabase *mojoDb, const string &dataDirectory) :
     mFileDb(0),
-    mMojoDb(mojoDb)
+    mMojoDb(mojoDb),
+    mAcknowledgeTimeout(0),
+    mNextJournalSeq(1),
+    mNextVolume(0),
+    mVolumeDirectory(dataDirectory + VOLUME_DB_SUBDIR)
 {
-    if (!g_file_test(LUNA_DATA_DIR, G_FILE_TEST_EXISTS))
-        g_mkdir_with_parents(LUNA_DATA_DIR, 0755);
+    if (!g_file_test(dataDirectory.c_str(), G_FILE_TEST_EXISTS))
+        g_mkdir_with_parents(dataDirectory.c_str(), 0755);
 
-    int err = sqlite3_open(LUNA_DATA_DIR "/filenotify.db3", &mFileDb);
+    string path = dataDirectory + "/filenotify.db3";
+    int err = sqlite3_open(path.c_str(), &mFileDb);
     if (err) {
         g_critical("Could not open database: %s", sqlite3_errmsg(mFileDb));
         return;
@@ -107,52 +136,396 @@ MediaStore::MediaStore(MojoMediaDatabase *mojoDb) :
         createTables(mFileDb);
         mMojoDb->prepareForRebuild(true);
     }
+    else {
+        Statement query(mFileDb, "SELECT MAX(seq) FROM journal");
+        if (query.step())
+            mNextJournalSeq = query.getInt(0) + 1;
+        query.finalize();
+
+        replayJournal("");
+    }
+
+    mMojoDb->addObserver(this);
 }
 
 MediaStore::~MediaStore()
 {
+    mMojoDb->removeObserver(this);
+
+    if (mAcknowledgeTimeout)
+        g_source_remove(mAcknowledgeTimeout);
+
+    try {
+        flushAcknowledged();
+    } catch (const exception &e) {
+        g_warning("Could not update journal: %s", e.what());
+    }
+
     int err = sqlite3_close(mFileDb);
     if (err != SQLITE_OK) {
         g_warning("Could not close database connection: %s", sqlite3_errmsg(mFileDb));
     }
 }
 
+// Every change we hand over to the media database is recorded in the journal
+// until the database tells us it's done. If we get killed in between the
+// journal is replayed on the next start. A newer change of the same path
+// replaces the entry, the sequence number tells which one got acknowledged.
+int MediaStore::journal(const string &path, JournalOperation operation)
+{
+    int seq = mNextJournalSeq++;
+
+    Statement query(mFileDb, "INSERT OR REPLACE INTO journal (path, operation, seq) VALUES (?, ?, ?)");
+    query.bind(1, path);
+    query.bind(2, operation);
+    query.bind(3, seq);
+    query.step();
+
+    return seq;
+}
+
 void MediaStore::insert(const MediaFile &m)
 {
-    Statement query(mFileDb, "INSERT OR REPLACE INTO files (path, etag) VALUES (?, ?)");
+    ScopedTimer timer(StoreStage);
+
+    Transaction transaction(mFileDb);
+
     string fileName = m.path();
+    string sql = "INSERT OR REPLACE INTO " + filesTable(fileName) + " (path, etag) VALUES (?, ?)";
+    Statement query(mFileDb, sql.c_str());
     query.bind(1, fileName);
     query.bind(2, m.etag());
     query.step();
 
-    mMojoDb->insert(m);
+    int seq = journal(fileName, JournalInsert);
+    transaction.commit();
+
+    mMojoDb->insert(m, seq);
 }
 
 void MediaStore::remove(const string &filename)
 {
-    Statement del(mFileDb, "DELETE FROM files WHERE path = ?");
+    ScopedTimer timer(StoreStage);
+
+    removeFile(filename);
+}
+
+// Also used by rename, whose own timer already covers it
+void MediaStore::removeFile(const string &filename)
+{
+    Transaction transaction(mFileDb);
+
+    string sql = "DELETE FROM " + filesTable(filename) + " WHERE path = ?";
+    Statement del(mFileDb, sql.c_str());
     del.bind(1, filename);
     del.step();
 
-    mMojoDb->remove(filename);
+    int seq = journal(filename, JournalRemove);
+    transaction.commit();
+
+    mMojoDb->remove(filename, seq);
+}
+
+static string directoryPrefix(const string &path)
+{
+    string pathPrefix = path;
+    if (pathPrefix.empty() || pathPrefix[pathPrefix.size() - 1] != '/')
+        pathPrefix += '/';
+    return pathPrefix;
+}
+
+// All paths below the prefix sort between "<prefix>/" and "<prefix>0" which
+// lets sqlite use the primary key index for the range
+static string directoryPrefixEnd(const string &pathPrefix)
+{
+    string pathPrefixEnd = pathPrefix;
+    pathPrefixEnd[pathPrefixEnd.size() - 1] = '/' + 1;
+    return pathPrefixEnd;
 }
 
 void MediaStore::removeFilesBelowPath(const string &path)
 {
-    Statement query(mFileDb, "SELECT path FROM files WHERE path like ?");
-    query.bind(1, string_format("%s%%", path.c_str()));
+    ScopedTimer timer(StoreStage);
+
+    string pathPrefix = directoryPrefix(path);
+    string pathPrefixEnd = directoryPrefixEnd(pathPrefix);
+
+    Transaction transaction(mFileDb);
+
+    for (auto &table : filesTablesBelowPath(path)) {
+        string sql = "DELETE FROM " + table + " WHERE path >= ? AND path < ?";
+        Statement del(mFileDb, sql.c_str());
+        del.bind(1, pathPrefix);
+        del.bind(2, pathPrefixEnd);
+        del.step();
+    }
+
+    int seq = journal(pathPrefix, JournalRemoveBelowPath);
+    transaction.commit();
+
+    mMojoDb->removeFilesBelowPath(pathPrefix, seq);
+}
 
+void MediaStore::rename(const string &from, const string &to)
+{
+    ScopedTimer timer(StoreStage);
+
+    // A file which is replaced by the move has to go first
+    if (getETag(to).size() > 0)
+        removeFile(to);
+
+    Transaction transaction(mFileDb);
+
+    // Moves between filesystems show up as delete and create, both paths
+    // belong to the same volume
+    string sql = "UPDATE " + filesTable(from) + " SET path = ? WHERE path = ?";
+    Statement update(mFileDb, sql.c_str());
+    update.bind(1, to);
+    update.bind(2, from);
+    update.step();
+
+    // Nothing to do for files we never indexed
+    if (sqlite3_changes(mFileDb) == 0)
+        return;
+
+    // If we don't get to finish the rename the old item gets removed and the
+    // file is sent again
+    int fromSeq = journal(from, JournalRemove);
+    int toSeq = journal(to, JournalInsert);
+    transaction.commit();
+
+    mMojoDb->rename(from, to, fromSeq, toSeq);
+}
+
+void MediaStore::renameFilesBelowPath(const string &from, const string &to)
+{
+    renameFilesBelowPathIn(filesTable(from), from, to);
+}
+
+void MediaStore::renameFilesBelowPathIn(const string &table, const string &from, const string &to)
+{
+    ScopedTimer timer(StoreStage);
+
+    string fromPrefix = directoryPrefix(from);
+    string toPrefix = directoryPrefix(to);
+
+    Transaction transaction(mFileDb);
+
+    string sql = "UPDATE " + table + " SET path = ?1 || substr(path, length(?2) + 1) "
+                 "WHERE path >= ?2 AND path < ?3";
+    Statement update(mFileDb, sql.c_str());
+    update.bind(1, toPrefix);
+    update.bind(2, fromPrefix);
+    update.bind(3, directoryPrefixEnd(fromPrefix));
+    update.step();
+
+    int fromSeq = journal(fromPrefix, JournalRemoveBelowPath);
+    int toSeq = journal(toPrefix, JournalInsertBelowPath);
+    transaction.commit();
+
+    mMojoDb->renameFilesBelowPath(fromPrefix, toPrefix, fromSeq, toSeq);
+}
+
+void MediaStore::replayJournal(const string &mountPoint)
+{
+    struct Entry {
+        string path;
+        int operation;
+        int seq;
+    };
+    vector<Entry> entries;
+
+    Statement query(mFileDb, "SELECT path, operation, seq FROM journal");
     while (query.step()) {
-        std::string filePath = query.getText(0);
-        remove(filePath);
+        string path = query.getText(0);
+        int operation = query.getInt(1);
+        // Files of a volume can only be reset once its database is there
+        if (operation == JournalInsert || operation == JournalInsertBelowPath) {
+            bool belowMountPoint = !mountPoint.empty() &&
+                path.compare(0, mountPoint.size() + 1, directoryPrefix(mountPoint)) == 0;
+            if (mountPoint.empty() ? isBelowVolume(path) : !belowMountPoint)
+                continue;
+        } else if (!mountPoint.empty()) {
+            continue;
+        }
+        entries.push_back({path, operation, query.getInt(2)});
+    }
+
+    if (entries.size() == 0)
+        return;
+
+    g_message("Replaying %d unfinished operations from the journal", (int) entries.size());
+
+    Transaction transaction(mFileDb);
+
+    for (auto &entry : entries) {
+        switch (entry.operation) {
+        case JournalInsert: {
+            // Forgetting the etag makes the next scan send the file again. That
+            // is persistent on its own so the journal entry isn't needed anymore.
+            string sql = "UPDATE " + filesTable(entry.path) + " SET etag = '' WHERE path = ?";
+            Statement reset(mFileDb, sql.c_str());
+            reset.bind(1, entry.path);
+            reset.step();
+
+            Statement del(mFileDb, "DELETE FROM journal WHERE path = ?");
+            del.bind(1, entry.path);
+            del.step();
+
+            forgetVolumeState(entry.path);
+            forgetCompletedDirectories(entry.path);
+            break;
+        }
+        case JournalInsertBelowPath: {
+            string sql = "UPDATE " + filesTable(entry.path) +
+                         " SET etag = '' WHERE path >= ? AND path < ?";
+            Statement reset(mFileDb, sql.c_str());
+            reset.bind(1, entry.path);
+            reset.bind(2, directoryPrefixEnd(entry.path));
+            reset.step();
+
+            Statement del(mFileDb, "DELETE FROM journal WHERE path = ?");
+            del.bind(1, entry.path);
+            del.step();
+
+            forgetVolumeState(entry.path);
+            forgetCompletedDirectories(entry.path);
+            break;
+        }
+        case JournalRemove:
+            mMojoDb->remove(entry.path, entry.seq);
+            break;
+        case JournalRemoveBelowPath:
+            mMojoDb->removeFilesBelowPath(entry.path, entry.seq);
+            break;
+        }
+    }
+
+    transaction.commit();
+}
+
+bool MediaStore::isBelowVolume(const string &path)
+{
+    Statement query(mFileDb, "SELECT uuid FROM volumes "
+                             "WHERE ?1 >= mountPoint || '/' AND ?1 < mountPoint || '0'");
+    query.bind(1, path);
+    return query.step();
+}
+
+// A reset etag is only noticed by a full scan, reconciling a volume would
+// skip files which didn't change since it was last seen
+void MediaStore::forgetVolumeState(const string &path)
+{
+    Statement update(mFileDb, "UPDATE volumes SET lastSeen = 0 "
+                              "WHERE ?1 >= mountPoint || '/' AND ?1 < mountPoint || '0'");
+    update.bind(1, path);
+    update.step();
+}
+
+// A resumed scan would skip the files again whose etag we just reset
+void MediaStore::forgetCompletedDirectories(const string &path)
+{
+    if (!path.empty() && path[path.size() - 1] == '/') {
+        Statement del(mFileDb, "DELETE FROM scanCheckpoints "
+                               "WHERE directory = ? OR (directory >= ? AND directory < ?)");
+        del.bind(1, path.substr(0, path.size() - 1));
+        del.bind(2, path);
+        del.bind(3, directoryPrefixEnd(path));
+        del.step();
+    } else {
+        Statement del(mFileDb, "DELETE FROM scanCheckpoints WHERE directory = ?");
+        del.bind(1, path.substr(0, path.rfind('/')));
+        del.step();
     }
 }
 
+void MediaStore::fileInserted(const std::string& path, int journalSeq)
+{
+    acknowledge(path, journalSeq);
+}
+
+void MediaStore::fileRemoved(const std::string& path, int journalSeq)
+{
+    acknowledge(path, journalSeq);
+}
+
+void MediaStore::filesBelowPathRemoved(const std::string& path, int journalSeq)
+{
+    acknowledge(path, journalSeq);
+}
+
+void MediaStore::fileRenamed(const std::string& from, const std::string& to,
+                             int fromJournalSeq, int toJournalSeq)
+{
+    acknowledge(from, fromJournalSeq);
+    acknowledge(to, toJournalSeq);
+}
+
+void MediaStore::filesBelowPathRenamed(const std::string& from, const std::string& to,
+                                       int fromJournalSeq, int toJournalSeq)
+{
+    acknowledge(from, fromJournalSeq);
+    acknowledge(to, toJournalSeq);
+}
+
+void MediaStore::acknowledge(const std::string& path, int journalSeq)
+{
+    // Changes started by someone else were never journalled
+    if (journalSeq == 0)
+        return;
+
+    mAcknowledged.push_back(make_pair(path, journalSeq));
+
+    if (mAcknowledged.size() >= JOURNAL_ACKNOWLEDGE_BATCH_SIZE) {
+        if (mAcknowledgeTimeout) {
+            g_source_remove(mAcknowledgeTimeout);
+            mAcknowledgeTimeout = 0;
+        }
+        flushAcknowledged();
+    }
+    else if (mAcknowledgeTimeout == 0) {
+        mAcknowledgeTimeout = g_timeout_add(JOURNAL_ACKNOWLEDGE_DELAY_MS, &MediaStore::acknowledgeTimeout, this);
+    }
+}
+
+gboolean MediaStore::acknowledgeTimeout(gpointer user_data)
+{
+    MediaStore *store = static_cast<MediaStore*>(user_data);
+    store->mAcknowledgeTimeout = 0;
+
+    try {
+        store->flushAcknowledged();
+    } catch (const exception &e) {
+        g_warning("Could not update journal: %s", e.what());
+    }
+
+    return FALSE;
+}
+
+void MediaStore::flushAcknowledged()
+{
+    if (mAcknowledged.size() == 0)
+        return;
+
+    Transaction transaction(mFileDb);
+
+    for (auto &entry : mAcknowledged) {
+        // The file might have been changed again in the meantime in which
+        // case the entry was replaced and the newer one has to stay
+        Statement del(mFileDb, "DELETE FROM journal WHERE path = ? AND seq = ?");
+        del.bind(1, entry.first);
+        del.bind(2, entry.second);
+        del.step();
+    }
+
+    transaction.commit();
+    mAcknowledged.clear();
+}
+
 std::string MediaStore::getETag(const string &filename)
 {
-    Statement query(mFileDb, R"(
-SELECT etag FROM files WHERE path = ?
-)");
+    string sql = "SELECT etag FROM " + filesTable(filename) + " WHERE path = ?";
+    Statement query(mFileDb, sql.c_str());
     query.bind(1, filename);
     if (query.step()) {
         return query.getText(0);
@@ -161,4 +534,227 @@ SELECT etag FROM files WHERE path = ?
     }
 }
 
+std::vector<std::string> MediaStore::getFilesInDirectory(const string &directory)
+{
+    string pathPrefix = directoryPrefix(directory);
+
+    string sql = "SELECT path FROM " + filesTable(directory) + " WHERE path >= ? AND path < ?";
+    Statement query(mFileDb, sql.c_str());
+    query.bind(1, pathPrefix);
+    query.bind(2, directoryPrefixEnd(pathPrefix));
+
+    vector<string> files;
+    while (query.step()) {
+        string path = query.getText(0);
+        // Skip everything in subdirectories
+        if (path.find('/', pathPrefix.size()) == string::npos)
+            files.push_back(path);
+    }
+    return files;
+}
+
+std::vector<std::string> MediaStore::getSubdirectories(const string &directory)
+{
+    string pathPrefix = directoryPrefix(directory);
+    string pathPrefixEnd = directoryPrefixEnd(pathPrefix);
+
+    // Jumps over the content of every subdirectory instead of reading it
+    string sql = "SELECT path FROM " + filesTable(directory) +
+                 " WHERE path >= ? AND path < ? LIMIT 1";
+    Statement query(mFileDb, sql.c_str());
+    vector<string> directories;
+    string lower = pathPrefix;
+    while (true) {
+        query.bind(1, lower);
+        query.bind(2, pathPrefixEnd);
+        if (!query.step())
+            break;
+        string path = query.getText(0);
+        query.reset();
+
+        size_t slash = path.find('/', pathPrefix.size());
+        if (slash == string::npos) {
+            lower = path + '\x01';
+        } else {
+            directories.push_back(path.substr(0, slash));
+            lower = path.substr(0, slash) + '0';
+        }
+    }
+    return directories;
+}
+
+std::map<std::string, time_t> MediaStore::getCompletedDirectories(const string &root)
+{
+    Statement query(mFileDb, "SELECT directory, lastChange FROM scanCheckpoints WHERE root = ?");
+    query.bind(1, root);
+
+    map<string, time_t> directories;
+    while (query.step())
+        directories[query.getText(0)] = query.getInt(1);
+    return directories;
+}
+
+void MediaStore::addCompletedDirectories(const string &root,
+                                         const vector<pair<string, time_t>> &directories)
+{
+    Transaction transaction(mFileDb);
+
+    Statement query(mFileDb, "INSERT OR REPLACE INTO scanCheckpoints (root, directory, lastChange) "
+                             "VALUES (?, ?, ?)");
+    for (auto &directory : directories) {
+        query.bind(1, root);
+        query.bind(2, directory.first);
+        query.bind(3, (int) directory.second);
+        query.step();
+        query.reset();
+    }
+
+    transaction.commit();
+}
+
+void MediaStore::clearCompletedDirectories(const string &root)
+{
+    Statement del(mFileDb, "DELETE FROM scanCheckpoints WHERE root = ?");
+    del.bind(1, root);
+    del.step();
+}
+
+bool MediaStore::hasJournalEntriesBelow(const string &directory)
+{
+    string pathPrefix = directoryPrefix(directory);
+
+    Statement query(mFileDb, "SELECT path FROM journal WHERE path >= ? AND path < ? LIMIT 1");
+    query.bind(1, pathPrefix);
+    query.bind(2, directoryPrefixEnd(pathPrefix));
+    return query.step();
+}
+
+bool MediaStore::getVolume(const string &uuid, string &mountPoint, time_t &lastSeen)
+{
+    Statement query(mFileDb, "SELECT mountPoint, lastSeen FROM volumes WHERE uuid = ?");
+    query.bind(1, uuid);
+    if (!query.step())
+        return false;
+    mountPoint = query.getText(0);
+    lastSeen = query.getInt(1);
+    return true;
+}
+
+std::string MediaStore::getVolumeAt(const string &mountPoint)
+{
+    Statement query(mFileDb, "SELECT uuid FROM volumes WHERE mountPoint = ?");
+    query.bind(1, mountPoint);
+    if (query.step())
+        return query.getText(0);
+    return "";
+}
+
+void MediaStore::setVolume(const string &uuid, const string &mountPoint, time_t lastSeen)
+{
+    Statement query(mFileDb, "INSERT OR REPLACE INTO volumes (uuid, mountPoint, lastSeen) "
+                             "VALUES (?, ?, ?)");
+    query.bind(1, uuid);
+    query.bind(2, mountPoint);
+    query.bind(3, (int) lastSeen);
+    query.step();
+}
+
+void MediaStore::forgetVolume(const string &uuid)
+{
+    Statement del(mFileDb, "DELETE FROM volumes WHERE uuid = ?");
+    del.bind(1, uuid);
+    del.step();
+
+    if (unlink(volumeDatabasePath(uuid).c_str()) != 0 && errno != ENOENT)
+        g_warning("Could not remove database of volume %s: %s", uuid.c_str(), strerror(errno));
+}
+
+string MediaStore::volumeDatabasePath(const string &uuid) const
+{
+    return mVolumeDirectory + "/" + uuid + ".db3";
+}
+
+void MediaStore::attachVolume(const string &uuid, const string &mountPoint)
+{
+    if (mVolumes.find(mountPoint) != mVolumes.end())
+        detachVolume(mountPoint);
+
+    if (!g_file_test(mVolumeDirectory.c_str(), G_FILE_TEST_EXISTS))
+        g_mkdir_with_parents(mVolumeDirectory.c_str(), 0755);
+
+    string schema = "volume" + to_string(mNextVolume++);
+    Statement attach(mFileDb, "ATTACH DATABASE ? AS ?");
+    attach.bind(1, volumeDatabasePath(uuid));
+    attach.bind(2, schema);
+    attach.step();
+    attach.finalize();
+
+    string version = "PRAGMA " + schema + ".user_version";
+    Statement query(mFileDb, version.c_str());
+    bool current = query.step() && query.getInt(0) == volumeSchemaVersion;
+    query.finalize();
+    if (!current) {
+        execute_sql(mFileDb, "DROP TABLE IF EXISTS " + schema + ".files;"
+                             "CREATE TABLE " + schema + ".files ("
+                             "path TEXT PRIMARY KEY NOT NULL, etag TEXT);" +
+                             version + " = " + to_string(volumeSchemaVersion) + ";");
+    }
+    printf("Attached database of volume %s at %s.\n", uuid.c_str(), mountPoint.c_str());
+
+    // The paths in there and in the journal start with where it was
+    // mounted the last time
+    string knownMountPoint = mountPoint;
+    time_t lastSeen;
+    getVolume(uuid, knownMountPoint, lastSeen);
+    mVolumes[knownMountPoint] = schema;
+    replayJournal(knownMountPoint);
+
+    if (knownMountPoint != mountPoint) {
+        renameFilesBelowPathIn(schema + ".files", knownMountPoint, mountPoint);
+        mVolumes.erase(knownMountPoint);
+        mVolumes[mountPoint] = schema;
+    }
+}
+
+void MediaStore::detachVolume(const string &mountPoint)
+{
+    auto volume = mVolumes.find(mountPoint);
+    if (volume == mVolumes.end())
+        return;
+
+    Statement detach(mFileDb, "DETACH DATABASE ?");
+    detach.bind(1, volume->second);
+    detach.step();
+
+    mVolumes.erase(volume);
+    printf("Detached database of volume at %s.\n", mountPoint.c_str());
+}
+
+static bool isBelow(const string &path, const string &directory)
+{
+    return path.compare(0, directory.size(), directory) == 0 &&
+           (path.size() == directory.size() || path[directory.size()] == '/');
+}
+
+string MediaStore::filesTable(const string &path) const
+{
+    // Volumes can't be mounted inside each other below the media roots, the
+    // first match is the only one
+    for (auto &volume : mVolumes) {
+        if (isBelow(path, volume.first))
+            return volume.second + ".files";
+    }
+    return "files";
+}
+
+vector<string> MediaStore::filesTablesBelowPath(const string &path) const
+{
+    vector<string> tables(1, filesTable(path));
+    for (auto &volume : mVolumes) {
+        if (volume.first != path && isBelow(volume.first, path))
+            tables.push_back(volume.second + ".files");
+    }
+    return tables;
+}
+
 } // namespace mediascanner
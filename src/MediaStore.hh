@@ -20,22 +20,27 @@
 #ifndef MEDIASTORE_H_
 #define MEDIASTORE_H_
 
+#include <ctime>
+#include <map>
 #include <vector>
 #include <string>
+#include <utility>
 #include <sqlite3.h>
+#include <glib.h>
 
+#include "config.h"
 #include "ScannerCore.hh"
+#include "MojoMediaDatabase.hh"
 
 namespace mediascanner {
 
 class MediaFile;
 class Album;
-class MojoMediaDatabase;
 
-class MediaStore final
+class MediaStore final : public MojoMediaDatabaseObserver
 {
 public:
-    MediaStore(MojoMediaDatabase *mojoDb);
+    MediaStore(MojoMediaDatabase *mojoDb, const std::string &dataDirectory = LUNA_DATA_DIR);
     MediaStore(const MediaStore &other) = delete;
     MediaStore operator=(const MediaStore &other) = delete;
     ~MediaStore();
@@ -43,11 +48,79 @@ public:
     void insert(const MediaFile &m);
     void remove(const std::string &fileName);
     void removeFilesBelowPath(const std::string& path);
+    void rename(const std::string &from, const std::string &to);
+    void renameFilesBelowPath(const std::string &from, const std::string &to);
     std::string getETag(const std::string &filename);
+    std::vector<std::string> getFilesInDirectory(const std::string &directory);
+    std::vector<std::string> getSubdirectories(const std::string &directory);
+
+    // Directories of an unfinished scan whose files were all indexed, with
+    // the last change of them and their files at that point
+    std::map<std::string, time_t> getCompletedDirectories(const std::string &root);
+    void addCompletedDirectories(const std::string &root,
+                                 const std::vector<std::pair<std::string, time_t>> &directories);
+    // Called once the scan of the root is done
+    void clearCompletedDirectories(const std::string &root);
+    // Whether changes below the directory still wait for the media database
+    bool hasJournalEntriesBelow(const std::string &directory);
+
+    // Volumes are known by their filesystem UUID. lastSeen is when the
+    // volume was last removed with all its files indexed, 0 if never.
+    bool getVolume(const std::string &uuid, std::string &mountPoint, time_t &lastSeen);
+    std::string getVolumeAt(const std::string &mountPoint);
+    void setVolume(const std::string &uuid, const std::string &mountPoint, time_t lastSeen);
+    // Also drops the database of the volume, which has to be detached
+    void forgetVolume(const std::string &uuid);
+
+    // Files below the mount point are kept in the volume's own database
+    // while it is attached
+    void attachVolume(const std::string &uuid, const std::string &mountPoint);
+    void detachVolume(const std::string &mountPoint);
+
+    void fileInserted(const std::string& path, int journalSeq) override;
+    void fileRemoved(const std::string& path, int journalSeq) override;
+    void filesBelowPathRemoved(const std::string& path, int journalSeq) override;
+    void fileRenamed(const std::string& from, const std::string& to,
+                     int fromJournalSeq, int toJournalSeq) override;
+    void filesBelowPathRenamed(const std::string& from, const std::string& to,
+                               int fromJournalSeq, int toJournalSeq) override;
 
 private:
+    enum JournalOperation {
+        JournalInsert,
+        JournalRemove,
+        JournalRemoveBelowPath,
+        JournalInsertBelowPath,
+    };
+
+    void removeFile(const std::string &filename);
+    // Returns the sequence number of the new entry
+    int journal(const std::string &path, JournalOperation operation);
+    // With a mount point only the deferred entries for that volume are
+    // replayed, otherwise everything but those
+    void replayJournal(const std::string &mountPoint);
+    bool isBelowVolume(const std::string &path);
+    void forgetVolumeState(const std::string &path);
+    // The path is a file or, with a trailing slash, everything below it
+    void forgetCompletedDirectories(const std::string &path);
+    void renameFilesBelowPathIn(const std::string &table, const std::string &from,
+                                const std::string &to);
+    std::string filesTable(const std::string &path) const;
+    std::vector<std::string> filesTablesBelowPath(const std::string &path) const;
+    std::string volumeDatabasePath(const std::string &uuid) const;
+    void acknowledge(const std::string& path, int journalSeq);
+    void flushAcknowledged();
+    static gboolean acknowledgeTimeout(gpointer user_data);
+
     sqlite3 *mFileDb;
     MojoMediaDatabase *mMojoDb;
+    std::vector<std::pair<std::string, int>> mAcknowledged;
+    guint mAcknowledgeTimeout;
+    int mNextJournalSeq;
+    // Schema name of the attached database for every volume's mount point
+    std::map<std::string, std::string> mVolumes;
+    unsigned mNextVolume;
+    std::string mVolumeDirectory;
 };
 
 } // namespace mediascanner
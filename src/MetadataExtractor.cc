@@ -20,6 +20,7 @@
 #include "MediaFile.hh"
 #include "internal/utils.hh"
 #include "MetadataExtractor.hh"
+#include "Statistics.hh"
 
 #include <glib-object.h>
 #include <gio/gio.h>
@@ -29,7 +30,6 @@
 #include <string>
 #include <stdexcept>
 #include <memory>
-#include <libgen.h>
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
@@ -58,6 +58,8 @@ MetadataExtractor::~MetadataExtractor()
 
 DetectedFile MetadataExtractor::detect(const std::string &path)
 {
+    ScopedTimer timer(DetectStage);
+
     std::unique_ptr<GFile, void(*)(void *)> file(
         g_file_new_for_path(path.c_str()), g_object_unref);
     if (!file) {
@@ -113,6 +115,8 @@ const char *get_filename_extension(const char *filename)
 
 void MetadataExtractor::extractForAudio(MediaFile &mf, const DetectedFile &d)
 {
+    ScopedTimer timer(TagStage);
+
     TagLib::FileRef file(d.path.c_str());
 
     if (!file.isNull()) {
@@ -177,6 +181,12 @@ std::string MetadataExtractor::getAlbumNameFromPath(const std::string& path)
     return path.substr(path.find_last_of("/") + 1, path.size() - 1);
 }
 
+std::string MetadataExtractor::getNameFromPath(const std::string& path)
+{
+    std::string fileNameWithExtension = path.substr(path.find_last_of("/") + 1);
+    return fileNameWithExtension.substr(0, fileNameWithExtension.find_last_of("."));
+}
+
 void MetadataExtractor::extractForImage(MediaFile &mf, const DetectedFile &d)
 {
     mf.setMediaType("image");
@@ -189,15 +199,14 @@ void MetadataExtractor::extractForImage(MediaFile &mf, const DetectedFile &d)
 
 MediaFile MetadataExtractor::extract(const DetectedFile &d)
 {
+    ScopedTimer timer(ExtractStage);
+
     MediaFile mf;
     mf.setPath(d.path);
     mf.setEtag(d.etag);
     mf.setType(d.type);
 
-    std::string fileNameWithExtension = basename(const_cast<char *>(d.path.c_str()));
-    std::string pureFileName = fileNameWithExtension.substr(0, fileNameWithExtension.find_last_of("."));
-
-    mf.setName(pureFileName);
+    mf.setName(getNameFromPath(d.path));
     mf.setExtension(get_filename_extension(d.path.c_str()));
 
     // FIXME better take the creation time of the file itself and not when we have discovered the file
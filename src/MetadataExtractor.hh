@@ -54,8 +54,9 @@ public:
     void extractForAudio(MediaFile &mf, const DetectedFile &d);
     void extractForImage(MediaFile &mf, const DetectedFile &d);
 
-    std::string getAlbumPathFromImage(const std::string& path);
-    std::string getAlbumNameFromPath(const std::string& path);
+    static std::string getAlbumPathFromImage(const std::string& path);
+    static std::string getAlbumNameFromPath(const std::string& path);
+    static std::string getNameFromPath(const std::string& path);
 };
 
 }
@@ -14,7 +14,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <QImage>
+#include <algorithm>
+#include <ctime>
+#include <vector>
 
 #include <Settings.h>
 
@@ -23,10 +25,27 @@
 #include "MojoMediaObjectSerializer.hh"
 #include "internal/utils.hh"
 #include "MediaFile.hh"
+#include "MetadataExtractor.hh"
+#include "Statistics.hh"
+#include "Thumbnailer.hh"
 
 #define DB_KIND_DIRECTORY "/etc/palm/db/kinds/"
 #define DB_PERMISSION_DIRECTORY "/etc/palm/db/permissions/"
 
+// Aggregate totals are recounted once no new item was added for this period
+#define AGGREGATE_RECOUNT_QUIET_PERIOD_MS 2000
+// but never later than this after the first item was marked dirty
+#define AGGREGATE_RECOUNT_MAX_DELAY_US (10 * G_USEC_PER_SEC)
+
+// Removed files are collected for this period and then deleted in one batch
+#define REMOVE_BATCH_DELAY_MS 250
+// Number of files queried and deleted with a single database call
+#define REMOVE_BATCH_CHUNK_SIZE 100
+// Number of items deleted with a single database call when rebuilding
+#define REMOVE_ALL_CHUNK_SIZE 500
+// A chunk which fails this often in a row aborts the rebuild
+#define REMOVE_ALL_MAX_ATTEMPTS 3
+
 namespace mediascanner
 {
 
@@ -65,17 +84,28 @@ class BaseCommand : public MojSignalHandler
 public:
     BaseCommand(const std::string& name, MojoMediaDatabase *database) :
         database(database),
-        _name(name)
+        _name(name),
+        _urgent(false)
     {
     }
 
     virtual void execute() = 0;
 
+    // Work nobody waits for which can be held back while indexing is paused
+    virtual bool postponable() const { return false; }
+    // Urgent commands are never moved ahead of these
+    virtual bool keepsOrder() const { return false; }
+    // The file an insert is about, empty for everything else
+    virtual std::string insertedPath() const { return std::string(); }
+
     std::string name() const { return _name; }
+    bool urgent() const { return _urgent; }
+    void markUrgent() { _urgent = true; }
 
 protected:
     MojoMediaDatabase *database;
     std::string _name;
+    bool _urgent;
 };
 
 class GenerateAlbumThumbnailsCommand : public BaseCommand
@@ -102,14 +132,20 @@ private:
 class InsertCommand : public BaseCommand
 {
 public:
-    InsertCommand(MojoMediaDatabase *database, MediaFile file) :
+    InsertCommand(MojoMediaDatabase *database, MediaFile file, int journalSeq) :
         BaseCommand("Insert", database),
         file(file),
+        journalSeq(journalSeq),
         find_existing_slot(this, &InsertCommand::FindExistingResponse),
         insert_slot(this, &InsertCommand::InsertResponse)
     {
     }
 
+    std::string insertedPath() const
+    {
+        return file.path();
+    }
+
     void execute()
     {
         MojDbQuery query;
@@ -142,6 +178,7 @@ protected:
 
         if (results.size() > 0) {
             // FIXME update it with new meta data
+            database->notifyFileInserted(file.path(), journalSeq);
             database->finish();
             return MojErrNone;
         }
@@ -161,6 +198,10 @@ protected:
     {
         ResponseToException(response, responseErr);
 
+        // The app waiting for the file wants to see its thumbnail as well
+        bool thumbnailUrgent = database->isUrgent(file.path());
+        database->notifyFileInserted(file.path(), journalSeq);
+
         MojObject results;
         MojErr err = response.getRequired("results", results);
         ErrorToException(err);
@@ -182,7 +223,11 @@ protected:
 
         if (file.type() == ImageMedia && file.albumPath().size() > 0) {
 
-            database->enqueue(new GenerateImageThumbnailCommand(database, idToUpdate, file.path(), file.extension()), false);
+            BaseCommand *thumbnailCommand = new GenerateImageThumbnailCommand(database, idToUpdate, file.path(), file.extension());
+            if (thumbnailUrgent)
+                database->enqueueUrgent(thumbnailCommand);
+            else
+                database->enqueue(thumbnailCommand, false);
             database->enqueue(new AddAlbumForImageCommand(database, file, idToUpdate), false);
         }
         else if (file.type() == AudioMedia) {
@@ -205,41 +250,99 @@ protected:
 
 private:
     MediaFile file;
+    int journalSeq;
 };
 
-class RemoveCommand : public BaseCommand
+class RemoveBatchCommand : public BaseCommand
 {
 public:
-    RemoveCommand(MojoMediaDatabase *database, std::string filename) :
-        BaseCommand("Remove", database),
-        query_removal_slot(this, &RemoveCommand::QueryForRemovalResponse),
-        remove_slot(this, &RemoveCommand::RemoveResponse),
-        filename(filename)
+    RemoveBatchCommand(MojoMediaDatabase *database, const std::vector<std::string>& paths,
+                       const std::vector<int>& journalSeqs) :
+        BaseCommand("RemoveBatch", database),
+        query_removal_slot(this, &RemoveBatchCommand::QueryForRemovalResponse),
+        remove_slot(this, &RemoveBatchCommand::RemoveResponse),
+        paths(paths),
+        journalSeqs(journalSeqs),
+        prefixJournalSeq(0),
+        nextPath(0),
+        chunkStart(0)
+    {
+    }
+
+    RemoveBatchCommand(MojoMediaDatabase *database, const std::string& pathPrefix, int journalSeq) :
+        BaseCommand("RemoveBatch", database),
+        query_removal_slot(this, &RemoveBatchCommand::QueryForRemovalResponse),
+        remove_slot(this, &RemoveBatchCommand::RemoveResponse),
+        pathPrefix(pathPrefix),
+        prefixJournalSeq(journalSeq),
+        nextPath(0),
+        chunkStart(0)
+    {
+    }
+
+    bool keepsOrder() const
     {
+        return true;
     }
 
     void execute()
+    {
+        queryNextChunk();
+    }
+
+protected:
+    MojDbClient::Signal::Slot<RemoveBatchCommand> query_removal_slot;
+    MojDbClient::Signal::Slot<RemoveBatchCommand> remove_slot;
+
+    bool removesBelowPrefix() const
+    {
+        return pathPrefix.size() > 0;
+    }
+
+    void queryNextChunk()
     {
         MojDbQuery query;
         query.select("_id");
+        query.select("_kind");
+        query.select("albumId");
+        query.select("album");
+        query.select("genre");
+        query.select("artist");
 
         // We're querying for the base type of all stored files here to avoid
         // querying each type separately
         query.from("com.palm.media.file:1");
+        query.limit(REMOVE_BATCH_CHUNK_SIZE);
+
+        if (removesBelowPrefix()) {
+            // Everything we find gets deleted so we simply ask for the first
+            // chunk again until nothing is left below the prefix
+            MojString prefixStr;
+            prefixStr.assign(pathPrefix.c_str());
+            query.where("path", MojDbQuery::OpPrefix, MojObject(prefixStr));
+        }
+        else {
+            if (nextPath >= paths.size()) {
+                done();
+                return;
+            }
 
-        MojString filenameStr;
-        filenameStr.assign(filename.c_str());
-        MojObject filenameObj(filenameStr);
-        query.where("path", MojDbQuery::OpEq, filenameObj);
+            chunkStart = nextPath;
+
+            // Passing an array matches all items with one of the paths
+            MojObject pathsObj(MojObject::TypeArray);
+            for (int n = 0; n < REMOVE_BATCH_CHUNK_SIZE && nextPath < paths.size(); n++, nextPath++) {
+                MojString pathStr;
+                pathStr.assign(paths[nextPath].c_str());
+                pathsObj.push(MojObject(pathStr));
+            }
+            query.where("path", MojDbQuery::OpEq, pathsObj);
+        }
 
         MojErr err = database->databaseClient().find(query_removal_slot, query);
         ErrorToException(err);
     }
 
-protected:
-    MojDbClient::Signal::Slot<RemoveCommand> query_removal_slot;
-    MojDbClient::Signal::Slot<RemoveCommand> remove_slot;
-
     MojErr QueryForRemovalResponse(MojObject &response, MojErr responseErr)
     {
         ResponseToException(response, responseErr);
@@ -249,7 +352,13 @@ protected:
         ErrorToException(err);
 
         if (results.size() == 0) {
-            database->finish();
+            if (removesBelowPrefix()) {
+                done();
+            }
+            else {
+                chunkRemoved();
+                queryNextChunk();
+            }
             return MojErrNone;
         }
 
@@ -266,6 +375,26 @@ protected:
 
             err = removeIds.push(idToRemove);
             ErrorToException(err);
+
+            // Only images which are already assigned to an album carry an
+            // albumId we have to account for
+            MojString albumIdStr;
+            bool hasAlbumId = false;
+            if (item.get("albumId", albumIdStr, hasAlbumId) == MojErrNone && hasAlbumId &&
+                albumIdStr.length() > 0) {
+                std::pair<MojObject, int> &removed = removedFromAlbums[albumIdStr.data()];
+                removed.first = MojObject(albumIdStr);
+                removed.second++;
+            }
+
+            MojString kind;
+            bool hasKind = false;
+            if (item.get("_kind", kind, hasKind) == MojErrNone && hasKind &&
+                g_str_has_prefix(kind.data(), "com.palm.media.audio.file:")) {
+                addAggregateName(item, "album", removedAudioAlbums);
+                addAggregateName(item, "genre", removedAudioGenres);
+                addAggregateName(item, "artist", removedAudioArtists);
+            }
         }
 
         err = database->databaseClient().del(remove_slot, removeIds.begin(), removeIds.end(), MojDbFlagPurge);
@@ -278,89 +407,497 @@ protected:
     {
         ResponseToException(response, err);
 
-        database->finish();
+        if (!removesBelowPrefix())
+            chunkRemoved();
+
+        queryNextChunk();
 
         return MojErrNone;
     }
 
+    void addAggregateName(const MojObject &item, const char *property, std::set<std::string> &names)
+    {
+        MojString name;
+        bool found = false;
+        if (item.get(property, name, found) == MojErrNone && found && name.length() > 0)
+            names.insert(name.data());
+    }
+
+    void chunkRemoved()
+    {
+        for (size_t n = chunkStart; n < nextPath; n++)
+            database->notifyFileRemoved(paths[n], journalSeqs[n]);
+    }
+
+    void done()
+    {
+        // Album maintenance happens once for the whole batch
+        for (auto &entry : removedFromAlbums)
+            database->adjustImageAlbumCount(entry.second.first, -entry.second.second);
+        if (!removedAudioAlbums.empty())
+            database->enqueue(new MarkAudioAggregatesDirtyCommand(database, AudioAlbumAggregate, removedAudioAlbums), false);
+        if (!removedAudioGenres.empty())
+            database->enqueue(new MarkAudioAggregatesDirtyCommand(database, AudioGenreAggregate, removedAudioGenres), false);
+        if (!removedAudioArtists.empty())
+            database->enqueue(new MarkAudioAggregatesDirtyCommand(database, AudioArtistAggregate, removedAudioArtists), false);
+
+        if (removesBelowPrefix())
+            database->notifyFilesBelowPathRemoved(pathPrefix, prefixJournalSeq);
+
+        database->finish();
+    }
+
 private:
-    std::string filename;
+    std::vector<std::string> paths;
+    std::vector<int> journalSeqs;
+    std::string pathPrefix;
+    int prefixJournalSeq;
+    size_t nextPath;
+    size_t chunkStart;
+    std::map<std::string, std::pair<MojObject, int>> removedFromAlbums;
+    std::set<std::string> removedAudioAlbums;
+    std::set<std::string> removedAudioGenres;
+    std::set<std::string> removedAudioArtists;
 };
 
-class RemoveAllCommand : public BaseCommand
+class RenameImageAlbumsCommand : public BaseCommand
 {
 public:
-    RemoveAllCommand(MojoMediaDatabase *database) :
-        BaseCommand("RemoveAll", database),
-        query_removal_slot(this, &RemoveAllCommand::QueryForRemovalResponse),
-        remove_slot(this, &RemoveAllCommand::RemoveResponse)
+    RenameImageAlbumsCommand(MojoMediaDatabase *database, const std::string& fromPrefix, const std::string& toPrefix) :
+        BaseCommand("RenameImageAlbums", database),
+        query_albums_slot(this, &RenameImageAlbumsCommand::QueryAlbumsResponse),
+        update_albums_slot(this, &RenameImageAlbumsCommand::UpdateAlbumsResponse),
+        fromPrefix(fromPrefix),
+        toPrefix(toPrefix),
+        queriedMovedDirectory(false)
+    {
+    }
+
+    // An urgent insert of an image below the new path would otherwise find
+    // the album still at the old one and create a second album
+    bool keepsOrder() const
     {
+        return true;
     }
 
     void execute()
+    {
+        queryNextChunk();
+    }
+
+protected:
+    MojDbClient::Signal::Slot<RenameImageAlbumsCommand> query_albums_slot;
+    MojDbClient::Signal::Slot<RenameImageAlbumsCommand> update_albums_slot;
+
+    void queryNextChunk()
     {
         MojDbQuery query;
         query.select("_id");
+        query.select("path");
+        query.from("com.palm.media.image.album:1");
+        query.limit(REMOVE_BATCH_CHUNK_SIZE);
+
+        // First the album of the moved directory itself, then all albums
+        // below it. Renamed albums don't match anymore so we simply repeat
+        // the query until nothing is left.
+        MojString pathStr;
+        if (!queriedMovedDirectory) {
+            pathStr.assign(fromPrefix.c_str(), fromPrefix.size() - 1);
+            query.where("path", MojDbQuery::OpEq, MojObject(pathStr));
+        }
+        else {
+            pathStr.assign(fromPrefix.c_str());
+            query.where("path", MojDbQuery::OpPrefix, MojObject(pathStr));
+        }
 
-        // We're querying for the base type of all stored files here to avoid
-        // querying each type separately
-        query.from("com.palm.media.types:1");
-
-        MojErr err = database->databaseClient().find(query_removal_slot, query);
+        MojErr err = database->databaseClient().find(query_albums_slot, query);
         ErrorToException(err);
     }
 
-protected:
-    MojDbClient::Signal::Slot<RemoveAllCommand> query_removal_slot;
-    MojDbClient::Signal::Slot<RemoveAllCommand> remove_slot;
+    MojErr QueryAlbumsResponse(MojObject &response, MojErr responseErr)
+    {
+        ResponseToException(response, responseErr);
 
-    MojErr QueryForRemovalResponse(MojObject &response, MojErr responseErr)
+        MojObject results;
+        MojErr err = response.getRequired("results", results);
+        ErrorToException(err);
+
+        if (results.size() == 0) {
+            if (queriedMovedDirectory) {
+                database->finish();
+            }
+            else {
+                queriedMovedDirectory = true;
+                queryNextChunk();
+            }
+            return MojErrNone;
+        }
+
+        MojObject::ObjectVec objects;
+
+        for (int n = 0; n < results.size(); n++) {
+            MojObject item;
+            if (!results.at(n, item))
+                continue;
+
+            MojObject albumId;
+            err = item.getRequired("_id", albumId);
+            ErrorToException(err);
+
+            MojString pathStr;
+            err = item.getRequired("path", pathStr);
+            ErrorToException(err);
+
+            std::string path = pathStr.data();
+            std::string newPath = toPrefix.substr(0, toPrefix.size() - 1);
+            if (path.size() >= fromPrefix.size())
+                newPath = toPrefix + path.substr(fromPrefix.size());
+            std::string name = MetadataExtractor::getAlbumNameFromPath(newPath);
+
+            MojObject toMerge;
+            toMerge.put("_id", albumId);
+            toMerge.putString("path", newPath.c_str());
+            toMerge.putString("name", name.c_str());
+            toMerge.putString("searchKey", name.c_str());
+            objects.push(toMerge);
+        }
+
+        err = database->databaseClient().merge(update_albums_slot, objects.begin(), objects.end());
+        ErrorToException(err);
+
+        return MojErrNone;
+    }
+
+    MojErr UpdateAlbumsResponse(MojObject &response, MojErr responseErr)
     {
+        // Bail out instead of looping over the same albums again and again
         if (responseErr != MojErrNone) {
             database->finish();
             return MojErrNone;
         }
 
+        queryNextChunk();
+
+        return MojErrNone;
+    }
+
+private:
+    std::string fromPrefix;
+    std::string toPrefix;
+    bool queriedMovedDirectory;
+};
+
+class RenameCommand : public BaseCommand
+{
+public:
+    RenameCommand(MojoMediaDatabase *database, const std::string& from, const std::string& to, bool belowPath,
+                  int fromJournalSeq, int toJournalSeq) :
+        BaseCommand("Rename", database),
+        query_files_slot(this, &RenameCommand::QueryFilesResponse),
+        update_files_slot(this, &RenameCommand::UpdateFilesResponse),
+        from(from),
+        to(to),
+        belowPath(belowPath),
+        fromJournalSeq(fromJournalSeq),
+        toJournalSeq(toJournalSeq)
+    {
+    }
+
+    bool keepsOrder() const
+    {
+        return true;
+    }
+
+    void execute()
+    {
+        queryNextChunk();
+    }
+
+protected:
+    MojDbClient::Signal::Slot<RenameCommand> query_files_slot;
+    MojDbClient::Signal::Slot<RenameCommand> update_files_slot;
+
+    struct AlbumChange {
+        MojObject imageId;
+        MojObject oldAlbumId;
+        std::string path;
+    };
+
+    void queryNextChunk()
+    {
+        MojDbQuery query;
+        query.select("_id");
+        query.select("_kind");
+        query.select("path");
+        query.select("albumId");
+        query.select("albumPath");
+
+        // We're querying for the base type of all stored files here to avoid
+        // querying each type separately
+        query.from("com.palm.media.file:1");
+        query.limit(REMOVE_BATCH_CHUNK_SIZE);
+
+        // Renamed files don't match anymore so we query the first chunk again
+        // until everything below the prefix is moved
+        MojString pathStr;
+        pathStr.assign(from.c_str());
+        query.where("path", belowPath ? MojDbQuery::OpPrefix : MojDbQuery::OpEq, MojObject(pathStr));
+
+        MojErr err = database->databaseClient().find(query_files_slot, query);
+        ErrorToException(err);
+    }
+
+    std::string renamedPath(const std::string& path) const
+    {
+        if (!belowPath)
+            return to;
+        return to + path.substr(from.size());
+    }
+
+    MojErr QueryFilesResponse(MojObject &response, MojErr responseErr)
+    {
+        ResponseToException(response, responseErr);
+
         MojObject results;
         MojErr err = response.getRequired("results", results);
         ErrorToException(err);
 
         if (results.size() == 0) {
-            database->finish();
+            done();
             return MojErrNone;
         }
 
-        MojObject::ObjectVec removeIds;
+        MojObject::ObjectVec objects;
+        albumChanges.clear();
 
         for (int n = 0; n < results.size(); n++) {
             MojObject item;
-            if(!results.at(n, item))
+            if (!results.at(n, item))
                 continue;
 
-            MojObject idToRemove;
-            err = item.getRequired("_id", idToRemove);
+            MojObject id;
+            err = item.getRequired("_id", id);
             ErrorToException(err);
 
-            err = removeIds.push(idToRemove);
+            MojString kindStr, pathStr;
+            err = item.getRequired("_kind", kindStr);
             ErrorToException(err);
+            err = item.getRequired("path", pathStr);
+            ErrorToException(err);
+
+            std::string kind = kindStr.data();
+            std::string newPath = renamedPath(pathStr.data());
+
+            MojObject toMerge;
+            toMerge.put("_id", id);
+            toMerge.putString("path", newPath.c_str());
+
+            if (kind == "com.palm.media.image.file:1")
+                updateImage(item, id, newPath, toMerge);
+            else if (kind == "com.palm.media.misc.file:1") {
+                std::string name = MetadataExtractor::getNameFromPath(newPath);
+                toMerge.putString("name", name.c_str());
+                toMerge.putString("searchKey", name.c_str());
+            }
+
+            objects.push(toMerge);
         }
 
-        err = database->databaseClient().del(remove_slot, removeIds.begin(), removeIds.end(), MojDbFlagPurge);
+        err = database->databaseClient().merge(update_files_slot, objects.begin(), objects.end());
         ErrorToException(err);
 
         return MojErrNone;
     }
 
-    MojErr RemoveResponse(MojObject &response, MojErr err)
+    void updateImage(MojObject& item, const MojObject& id, const std::string& newPath, MojObject& toMerge)
     {
-        ResponseToException(response, err);
+        MojString albumPathStr, albumIdStr;
+        bool found = false;
+        item.get("albumPath", albumPathStr, found);
+        item.get("albumId", albumIdStr, found);
+
+        std::string albumPath = albumPathStr.data();
+        std::string newAlbumPath = MetadataExtractor::getAlbumPathFromImage(newPath);
+        if (newAlbumPath == albumPath)
+            return;
+
+        toMerge.putString("albumPath", newAlbumPath.c_str());
+
+        // When a whole directory was moved its album is renamed along with it
+        // by the RenameImageAlbumsCommand, otherwise the image moves over to
+        // a different album.
+        std::string albumPrefix = albumPath + "/";
+        if (belowPath && albumPrefix.compare(0, from.size(), from) == 0 &&
+            renamedPath(albumPrefix) == newAlbumPath + "/")
+            return;
+
+        toMerge.putString("albumId", "");
+
+        AlbumChange change;
+        change.imageId = id;
+        if (albumIdStr.length() > 0)
+            change.oldAlbumId = MojObject(albumIdStr);
+        change.path = newPath;
+        albumChanges.push_back(change);
+    }
+
+    MojErr UpdateFilesResponse(MojObject &response, MojErr responseErr)
+    {
+        // Bail out instead of looping over the same files again and again
+        if (responseErr != MojErrNone) {
+            done();
+            return MojErrNone;
+        }
+
+        for (auto &change : albumChanges) {
+            if (change.oldAlbumId.type() != MojObject::TypeUndefined)
+                database->adjustImageAlbumCount(change.oldAlbumId, -1);
+
+            MediaFile file;
+            file.setPath(change.path);
+            file.setType(ImageMedia);
+            file.setCreatedTime(time(NULL));
+            file.setAlbumPath(MetadataExtractor::getAlbumPathFromImage(change.path));
+            file.setAlbum(MetadataExtractor::getAlbumNameFromPath(file.albumPath()));
+
+            database->enqueue(new AddAlbumForImageCommand(database, file, change.imageId), false);
+        }
+        albumChanges.clear();
+
+        if (belowPath)
+            queryNextChunk();
+        else
+            done();
+
+        return MojErrNone;
+    }
+
+    void done()
+    {
+        if (belowPath) {
+            database->enqueue(new RenameImageAlbumsCommand(database, from, to), false);
+            database->notifyFilesBelowPathRenamed(from, to, fromJournalSeq, toJournalSeq);
+        }
+        else {
+            database->notifyFileRenamed(from, to, fromJournalSeq, toJournalSeq);
+        }
 
         database->finish();
+    }
+
+private:
+    std::string from;
+    std::string to;
+    bool belowPath;
+    int fromJournalSeq;
+    int toJournalSeq;
+    std::vector<AlbumChange> albumChanges;
+};
+
+class RemoveAllCommand : public BaseCommand
+{
+public:
+    RemoveAllCommand(MojoMediaDatabase *database) :
+        BaseCommand("RemoveAll", database),
+        remove_slot(this, &RemoveAllCommand::RemoveResponse),
+        currentKind(0),
+        removedCount(0),
+        failedAttempts(0)
+    {
+    }
+
+    bool keepsOrder() const
+    {
+        return true;
+    }
+
+    void execute()
+    {
+        removeNextChunk();
+    }
+
+protected:
+    MojDbClient::Signal::Slot<RemoveAllCommand> remove_slot;
+
+    // All files are stored with a kind extending the base type but the
+    // albums, genres and artists have to be dropped separately
+    static const char* const kinds[];
+    static const size_t kindCount;
+
+    void removeNextChunk()
+    {
+        if (currentKind >= kindCount) {
+            g_message("Removed %lld items from the database", (long long) removedCount);
+            database->finish();
+            return;
+        }
+
+        // Deleting by query spares us fetching all ids first. The database
+        // limits how many items a single query touches so we repeat it until
+        // a chunk comes back incomplete.
+        MojDbQuery query;
+        query.from(kinds[currentKind]);
+        query.limit(REMOVE_ALL_CHUNK_SIZE);
+
+        MojErr err = database->databaseClient().del(remove_slot, query, MojDbFlagPurge);
+        ErrorToException(err);
+    }
+
+    MojErr RemoveResponse(MojObject &response, MojErr responseErr)
+    {
+        MojInt64 count = 0;
+
+        // The kind doesn't exist yet when we're rebuilding for the first time
+        if (responseErr == MojErrDbKindNotRegistered) {
+            failedAttempts = 0;
+            currentKind++;
+            removeNextChunk();
+            return MojErrNone;
+        }
+
+        // Moving on would leave the rest of the items behind for good
+        if (responseErr != MojErrNone || response.getRequired("count", count) != MojErrNone) {
+            failedAttempts++;
+            g_warning("Could not remove items of %s from the database (error %d, attempt %d)",
+                      kinds[currentKind], (int) responseErr, failedAttempts);
+            if (failedAttempts >= REMOVE_ALL_MAX_ATTEMPTS) {
+                g_critical("Aborting the rebuild of the media database, %lld items were removed",
+                           (long long) removedCount);
+                database->finish();
+                return MojErrNone;
+            }
+            removeNextChunk();
+            return MojErrNone;
+        }
+        failedAttempts = 0;
+
+        removedCount += count;
+        if (count > 0)
+            g_message("Removed %lld items from the database so far", (long long) removedCount);
+
+        if (count < REMOVE_ALL_CHUNK_SIZE)
+            currentKind++;
+
+        removeNextChunk();
 
         return MojErrNone;
     }
+
+private:
+    size_t currentKind;
+    MojInt64 removedCount;
+    int failedAttempts;
 };
 
+const char* const RemoveAllCommand::kinds[] = {
+    "com.palm.media.types:1",
+    "com.palm.media.audio.album:1",
+    "com.palm.media.audio.genre:1",
+    "com.palm.media.audio.artist:1",
+    "com.palm.media.image.album:1",
+};
+const size_t RemoveAllCommand::kindCount = G_N_ELEMENTS(RemoveAllCommand::kinds);
+
 class PutKindCommand :public BaseCommand
 {
 public:
@@ -372,6 +909,11 @@ public:
     {
     }
 
+    bool keepsOrder() const
+    {
+        return true;
+    }
+
     void execute()
     {
         gchar *kindContent = 0;
@@ -421,13 +963,7 @@ protected:
         MojObject permissions;
         permissions.fromJson(permissionsContent, permissionsContentLength);
 
-        MojObject perms;
-        perms.put("permissions", permissions);
-
-        MojRefCountedPtr<MojServiceRequest> request;
-        database->databaseClient().service()->createRequest(request);
-
-        MojErr err = request->send(put_permissions_slot, "com.palm.db", "putPermissions", perms);
+        MojErr err = database->databaseClient().putPermissions(put_permissions_slot, permissions);
         ErrorToException(err);
 
         return MojErrNone;
@@ -456,6 +992,11 @@ public:
     {
     }
 
+    bool keepsOrder() const
+    {
+        return true;
+    }
+
     void execute()
     {
         std::string kindWithVersion = kindName;
@@ -478,16 +1019,26 @@ private:
     std::string kindName;
 };
 
-MojoMediaDatabase::MojoMediaDatabase(MojDbServiceClient& dbclient) :
+MojoMediaDatabase::MojoMediaDatabase(DatabaseClient& dbclient) :
     dbclient(dbclient),
     currentCommand(0),
     previousCommand(0),
-    restart_timeout(0)
+    restart_timeout(0),
+    recount_timeout(0),
+    firstDirtyTime(0),
+    remove_batch_timeout(0),
+    commandStarted(0),
+    postponing(false)
 {
 }
 
 MojoMediaDatabase::~MojoMediaDatabase()
 {
+    if (recount_timeout)
+        g_source_remove(recount_timeout);
+    if (remove_batch_timeout)
+        g_source_remove(remove_batch_timeout);
+
     resetQueue();
     if (previousCommand)
         delete previousCommand;
@@ -495,11 +1046,86 @@ MojoMediaDatabase::~MojoMediaDatabase()
         delete currentCommand;
 }
 
-MojDbServiceClient& MojoMediaDatabase::databaseClient() const
+size_t MojoMediaDatabase::queuedCommands() const
+{
+    return commandQueue.size() + (currentCommand ? 1 : 0);
+}
+
+size_t MojoMediaDatabase::postponedCommandCount() const
+{
+    return postponedCommands.size();
+}
+
+void MojoMediaDatabase::setPostponing(bool postponing)
+{
+    this->postponing = postponing;
+    if (postponing)
+        return;
+
+    commandQueue.insert(commandQueue.end(), postponedCommands.begin(), postponedCommands.end());
+    postponedCommands.clear();
+    checkRestarting();
+}
+
+size_t MojoMediaDatabase::pendingRemovalCount() const
+{
+    return pendingRemovals.size();
+}
+
+size_t MojoMediaDatabase::dirtyAggregateCount() const
+{
+    return dirtyAggregates.size();
+}
+
+DatabaseClient& MojoMediaDatabase::databaseClient() const
 {
     return dbclient;
 }
 
+void MojoMediaDatabase::addObserver(MojoMediaDatabaseObserver *observer)
+{
+    observers.push_back(observer);
+}
+
+void MojoMediaDatabase::removeObserver(MojoMediaDatabaseObserver *observer)
+{
+    observers.erase(std::remove(observers.begin(), observers.end(), observer), observers.end());
+}
+
+void MojoMediaDatabase::notifyFileInserted(const std::string& path, int journalSeq)
+{
+    statistics().filesCommitted.add();
+    for (auto observer : observers)
+        observer->fileInserted(path, journalSeq);
+    urgentPaths.erase(path);
+}
+
+void MojoMediaDatabase::notifyFileRemoved(const std::string& path, int journalSeq)
+{
+    for (auto observer : observers)
+        observer->fileRemoved(path, journalSeq);
+}
+
+void MojoMediaDatabase::notifyFilesBelowPathRemoved(const std::string& path, int journalSeq)
+{
+    for (auto observer : observers)
+        observer->filesBelowPathRemoved(path, journalSeq);
+}
+
+void MojoMediaDatabase::notifyFileRenamed(const std::string& from, const std::string& to,
+                                          int fromJournalSeq, int toJournalSeq)
+{
+    for (auto observer : observers)
+        observer->fileRenamed(from, to, fromJournalSeq, toJournalSeq);
+}
+
+void MojoMediaDatabase::notifyFilesBelowPathRenamed(const std::string& from, const std::string& to,
+                                                    int fromJournalSeq, int toJournalSeq)
+{
+    for (auto observer : observers)
+        observer->filesBelowPathRenamed(from, to, fromJournalSeq, toJournalSeq);
+}
+
 gboolean MojoMediaDatabase::checkQueue(gpointer user_data)
 {
     MojoMediaDatabase *database = static_cast<MojoMediaDatabase*>(user_data);
@@ -509,6 +1135,12 @@ gboolean MojoMediaDatabase::checkQueue(gpointer user_data)
 
 void MojoMediaDatabase::finish()
 {
+    if (currentCommand) {
+        gint64 elapsed = g_get_monotonic_time() - commandStarted;
+        statistics().latency[CommandStage].record(elapsed);
+        statistics().commandLatency[currentCommand->name()].record(elapsed);
+    }
+
     previousCommand = currentCommand;
     currentCommand = 0;
 
@@ -524,6 +1156,70 @@ void MojoMediaDatabase::enqueue(BaseCommand *command, bool restart)
         checkRestarting();
 }
 
+// Behind all other urgent commands and everything which has to stay in order
+std::deque<BaseCommand*>::iterator MojoMediaDatabase::urgentPosition()
+{
+    auto position = commandQueue.end();
+    while (position != commandQueue.begin()) {
+        BaseCommand *previous = *(position - 1);
+        if (previous->urgent() || previous->keepsOrder())
+            break;
+        --position;
+    }
+    return position;
+}
+
+void MojoMediaDatabase::enqueueUrgent(BaseCommand *command)
+{
+    command->retain();
+    command->markUrgent();
+    commandQueue.insert(urgentPosition(), command);
+    checkRestarting();
+}
+
+void MojoMediaDatabase::prioritize(const std::string& path)
+{
+    urgentPaths.insert(path);
+
+    auto queued = std::find_if(commandQueue.begin(), commandQueue.end(),
+                               [&path](BaseCommand *command) { return command->insertedPath() == path; });
+    if (queued == commandQueue.end())
+        return;
+
+    BaseCommand *command = *queued;
+    auto position = urgentPosition();
+    command->markUrgent();
+
+    // Moving it behind something it was queued before could change the outcome
+    if (position >= queued)
+        return;
+    size_t index = position - commandQueue.begin();
+    commandQueue.erase(queued);
+    commandQueue.insert(commandQueue.begin() + index, command);
+}
+
+void MojoMediaDatabase::forgetPriority(const std::string& path)
+{
+    urgentPaths.erase(path);
+}
+
+bool MojoMediaDatabase::isUrgent(const std::string& path) const
+{
+    return urgentPaths.find(path) != urgentPaths.end();
+}
+
+bool MojoMediaDatabase::insertPending(const std::string& path) const
+{
+    if (currentCommand && currentCommand->insertedPath() == path)
+        return true;
+
+    for (auto command : commandQueue) {
+        if (command->insertedPath() == path)
+            return true;
+    }
+    return false;
+}
+
 gboolean MojoMediaDatabase::restartQueue(gpointer user_data)
 {
     MojoMediaDatabase *database = static_cast<MojoMediaDatabase*>(user_data);
@@ -544,6 +1240,12 @@ void MojoMediaDatabase::executeNextCommand()
         previousCommand = 0;
     }
 
+    while (postponing && commandQueue.size() > 0 && commandQueue.front()->postponable() &&
+           !commandQueue.front()->urgent()) {
+        postponedCommands.push_back(commandQueue.front());
+        commandQueue.pop_front();
+    }
+
     if (commandQueue.size() == 0 || currentCommand) {
         restart_timeout = 0;
         return;
@@ -551,6 +1253,7 @@ void MojoMediaDatabase::executeNextCommand()
 
     currentCommand = commandQueue.front();
     commandQueue.pop_front();
+    commandStarted = g_get_monotonic_time();
 
     try {
         currentCommand->execute();
@@ -562,32 +1265,192 @@ void MojoMediaDatabase::executeNextCommand()
     restart_timeout = 0;
 }
 
-void MojoMediaDatabase::insert(const MediaFile &file)
+void MojoMediaDatabase::insert(const MediaFile &file, int journalSeq)
+{
+    // A file might get removed and added again so we have to keep the order
+    flushPendingRemovals();
+    if (isUrgent(file.path()))
+        enqueueUrgent(new InsertCommand(this, file, journalSeq));
+    else
+        enqueue(new InsertCommand(this, file, journalSeq));
+}
+
+void MojoMediaDatabase::remove(const std::string &filename, int journalSeq)
+{
+    pendingRemovals.push_back(filename);
+    pendingRemovalJournalSeqs.push_back(journalSeq);
+
+    if (remove_batch_timeout == 0)
+        remove_batch_timeout = g_timeout_add(REMOVE_BATCH_DELAY_MS, &MojoMediaDatabase::removeBatchTimeout, this);
+}
+
+void MojoMediaDatabase::rename(const std::string &from, const std::string &to,
+                               int fromJournalSeq, int toJournalSeq)
+{
+    flushPendingRemovals();
+    enqueue(new RenameCommand(this, from, to, false, fromJournalSeq, toJournalSeq));
+}
+
+void MojoMediaDatabase::renameFilesBelowPath(const std::string &from, const std::string &to,
+                                             int fromJournalSeq, int toJournalSeq)
+{
+    flushPendingRemovals();
+
+    std::string fromPrefix = from;
+    if (fromPrefix.empty() || fromPrefix[fromPrefix.size() - 1] != '/')
+        fromPrefix += '/';
+    std::string toPrefix = to;
+    if (toPrefix.empty() || toPrefix[toPrefix.size() - 1] != '/')
+        toPrefix += '/';
+
+    enqueue(new RenameCommand(this, fromPrefix, toPrefix, true, fromJournalSeq, toJournalSeq));
+}
+
+void MojoMediaDatabase::removeFilesBelowPath(const std::string &path, int journalSeq)
+{
+    flushPendingRemovals();
+
+    std::string pathPrefix = path;
+    if (pathPrefix.empty() || pathPrefix[pathPrefix.size() - 1] != '/')
+        pathPrefix += '/';
+
+    enqueue(new RemoveBatchCommand(this, pathPrefix, journalSeq));
+}
+
+gboolean MojoMediaDatabase::removeBatchTimeout(gpointer user_data)
+{
+    MojoMediaDatabase *database = static_cast<MojoMediaDatabase*>(user_data);
+    database->remove_batch_timeout = 0;
+    database->flushPendingRemovals();
+    return FALSE;
+}
+
+void MojoMediaDatabase::flushPendingRemovals()
+{
+    if (remove_batch_timeout) {
+        g_source_remove(remove_batch_timeout);
+        remove_batch_timeout = 0;
+    }
+
+    if (pendingRemovals.size() == 0)
+        return;
+
+    enqueue(new RemoveBatchCommand(this, pendingRemovals, pendingRemovalJournalSeqs));
+    pendingRemovals.clear();
+    pendingRemovalJournalSeqs.clear();
+}
+
+void MojoMediaDatabase::markAggregateDirty(AggregateType type, const MojObject& id, const MojObject& name)
+{
+    DirtyAggregate aggregate = { type, id, name };
+    dirtyAggregates[aggregateKey(id)] = aggregate;
+
+    // Every new mark pushes the recount further out so an import of a whole
+    // album only triggers a single recount. To still get updated totals
+    // during long running imports we stop postponing after a maximum delay.
+    gint64 now = g_get_monotonic_time();
+    if (recount_timeout == 0) {
+        firstDirtyTime = now;
+    }
+    else if (now - firstDirtyTime < AGGREGATE_RECOUNT_MAX_DELAY_US) {
+        g_source_remove(recount_timeout);
+        recount_timeout = 0;
+    }
+
+    if (recount_timeout == 0)
+        recount_timeout = g_timeout_add(AGGREGATE_RECOUNT_QUIET_PERIOD_MS, &MojoMediaDatabase::recountTimeout, this);
+}
+
+gboolean MojoMediaDatabase::recountTimeout(gpointer user_data)
+{
+    MojoMediaDatabase *database = static_cast<MojoMediaDatabase*>(user_data);
+    database->recount_timeout = 0;
+    database->flushDirtyAggregates();
+    return FALSE;
+}
+
+std::string MojoMediaDatabase::aggregateKey(const MojObject& id) const
+{
+    MojString idStr;
+    MojErr err = id.stringValue(idStr);
+    ErrorToException(err);
+
+    return idStr.data();
+}
+
+ImageAlbumCounter& MojoMediaDatabase::imageAlbumCounter(const MojObject& albumId)
+{
+    return imageAlbumCounters[aggregateKey(albumId)];
+}
+
+void MojoMediaDatabase::adjustImageAlbumCount(const MojObject& albumId, int delta)
 {
-    enqueue(new InsertCommand(this, file));
+    ImageAlbumCounter &counter = imageAlbumCounter(albumId);
+    if (counter.known)
+        counter.count += delta;
+
+    // The new total is written to the database (or the album dropped) with
+    // the next coalesced aggregate update
+    markAggregateDirty(ImageAlbumAggregate, albumId, MojObject());
 }
 
-void MojoMediaDatabase::remove(const std::string &filename)
+void MojoMediaDatabase::forgetImageAlbum(const MojObject& albumId)
 {
-    enqueue(new RemoveCommand(this, filename));
+    imageAlbumCounters.erase(aggregateKey(albumId));
+}
+
+void MojoMediaDatabase::flushDirtyAggregates()
+{
+    for (auto &entry : dirtyAggregates) {
+        const DirtyAggregate &aggregate = entry.second;
+
+        switch (aggregate.type) {
+        case AudioAlbumAggregate:
+            enqueue(new CountAlbumAudiosCommand(this, aggregate.id, aggregate.name), false);
+            break;
+        case AudioGenreAggregate:
+            enqueue(new CountGenreAudiosCommand(this, aggregate.id, aggregate.name), false);
+            break;
+        case AudioArtistAggregate:
+            enqueue(new CountArtistAudiosCommand(this, aggregate.id, aggregate.name), false);
+            break;
+        case ImageAlbumAggregate:
+            enqueue(new UpdateImageAlbumCommand(this, aggregate.id), false);
+            break;
+        }
+    }
+
+    dirtyAggregates.clear();
+    checkRestarting();
 }
 
 void MojoMediaDatabase::resetQueue()
 {
+    dirtyAggregates.clear();
+    imageAlbumCounters.clear();
+    pendingRemovals.clear();
+    pendingRemovalJournalSeqs.clear();
+
     while(commandQueue.size() > 0) {
         BaseCommand *command = commandQueue.front();
         commandQueue.pop_front();
         delete command;
     }
+
+    while(postponedCommands.size() > 0) {
+        BaseCommand *command = postponedCommands.front();
+        postponedCommands.pop_front();
+        delete command;
+    }
 }
 
 void MojoMediaDatabase::prepareForRebuild(bool withSchemaRebuild)
 {
     resetQueue();
-    enqueue(new RemoveAllCommand(this));
 
     if (withSchemaRebuild) {
-        /* Remove all kinds and register them again */
+        /* Remove all kinds and register them again. Dropping a kind removes
+         * all of its items as well so there is no need to delete them first. */
         enqueue(new RemoveKindCommand(this, "com.palm.media.audio.file"));
         enqueue(new RemoveKindCommand(this, "com.palm.media.misc.file"));
         enqueue(new RemoveKindCommand(this, "com.palm.media.video.file"));
@@ -612,6 +1475,9 @@ void MojoMediaDatabase::prepareForRebuild(bool withSchemaRebuild)
         enqueue(new PutKindCommand(this, "com.palm.media.image.album"));
         enqueue(new PutKindCommand(this, "com.palm.media.file"));
     }
+    else {
+        enqueue(new RemoveAllCommand(this));
+    }
 }
 
 } // namespace mediascanner
@@ -17,9 +17,15 @@
 #ifndef MOJOMEDIADATABASE_H
 #define MOJOMEDIADATABASE_H
 
-#include <db/MojDbServiceClient.h>
 #include "db/MojDb.h"
+#include <glib.h>
 #include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "DatabaseClient.hh"
 
 namespace mediascanner
 {
@@ -27,36 +33,138 @@ namespace mediascanner
 class MediaFile;
 class BaseCommand;
 
+enum AggregateType {
+    AudioAlbumAggregate,
+    AudioGenreAggregate,
+    AudioArtistAggregate,
+    ImageAlbumAggregate,
+};
+
+struct ImageAlbumCounter {
+    ImageAlbumCounter() : count(0), known(false), pendingAssignments(0) {}
+
+    // Number of images in the album, only valid when known is set
+    int count;
+    bool known;
+    // Images which are about to be assigned to the album
+    int pendingAssignments;
+};
+
+class MojoMediaDatabaseObserver
+{
+public:
+    virtual ~MojoMediaDatabaseObserver() {}
+
+    // Called once the database has finished processing the operation. The
+    // journal sequence numbers are the ones the operation was started with.
+    virtual void fileInserted(const std::string& path, int journalSeq) {}
+    virtual void fileRemoved(const std::string& path, int journalSeq) {}
+    virtual void filesBelowPathRemoved(const std::string& path, int journalSeq) {}
+    virtual void fileRenamed(const std::string& from, const std::string& to,
+                             int fromJournalSeq, int toJournalSeq) {}
+    virtual void filesBelowPathRenamed(const std::string& from, const std::string& to,
+                                       int fromJournalSeq, int toJournalSeq) {}
+};
+
 class MojoMediaDatabase
 {
 public:
-    MojoMediaDatabase(MojDbServiceClient& dbclient);
+    MojoMediaDatabase(DatabaseClient& dbclient);
     ~MojoMediaDatabase();
 
-    void insert(const mediascanner::MediaFile& file);
-    void remove(const std::string& filename);
+    // The journal sequence numbers are handed back to the observers, 0 if
+    // the caller doesn't keep a journal
+    void insert(const mediascanner::MediaFile& file, int journalSeq = 0);
+    void remove(const std::string& filename, int journalSeq = 0);
+    void removeFilesBelowPath(const std::string& path, int journalSeq = 0);
+    void rename(const std::string& from, const std::string& to,
+                int fromJournalSeq = 0, int toJournalSeq = 0);
+    void renameFilesBelowPath(const std::string& from, const std::string& to,
+                              int fromJournalSeq = 0, int toJournalSeq = 0);
     void prepareForRebuild(bool withSchemaRebuild);
 
-    MojDbServiceClient& databaseClient() const;
+    DatabaseClient& databaseClient() const;
+
+    // Includes the command which is currently executed
+    size_t queuedCommands() const;
+    size_t pendingRemovalCount() const;
+    size_t postponedCommandCount() const;
+
+    // Holds back thumbnails and other postponable commands until called
+    // again with false
+    void setPostponing(bool postponing);
+    size_t dirtyAggregateCount() const;
+
+    void addObserver(MojoMediaDatabaseObserver *observer);
+    void removeObserver(MojoMediaDatabaseObserver *observer);
+    void notifyFileInserted(const std::string& path, int journalSeq);
+    void notifyFileRemoved(const std::string& path, int journalSeq);
+    void notifyFilesBelowPathRemoved(const std::string& path, int journalSeq);
+    void notifyFileRenamed(const std::string& from, const std::string& to,
+                           int fromJournalSeq, int toJournalSeq);
+    void notifyFilesBelowPathRenamed(const std::string& from, const std::string& to,
+                                     int fromJournalSeq, int toJournalSeq);
 
     void finish();
 
     void enqueue(BaseCommand *command, bool restart = true);
+    // Ahead of everything which doesn't have to stay in order
+    void enqueueUrgent(BaseCommand *command);
+
+    // Inserts of the file are moved to the front of the queue, whether
+    // they are queued already or come later, until one is done
+    void prioritize(const std::string& path);
+    void forgetPriority(const std::string& path);
+    bool isUrgent(const std::string& path) const;
+    // Includes the command which is currently executed
+    bool insertPending(const std::string& path) const;
+
+    // Marks the totals of an album, genre or artist as outdated. All marks
+    // are coalesced and recounted once the import has been quiet for a while.
+    void markAggregateDirty(AggregateType type, const MojObject& id, const MojObject& name);
+
+    ImageAlbumCounter& imageAlbumCounter(const MojObject& albumId);
+    void adjustImageAlbumCount(const MojObject& albumId, int delta);
+    void forgetImageAlbum(const MojObject& albumId);
 
 private:
+    std::string aggregateKey(const MojObject& id) const;
     void checkRestarting();
+    std::deque<BaseCommand*>::iterator urgentPosition();
     void executeNextCommand();
     void resetQueue();
+    void flushDirtyAggregates();
+    void flushPendingRemovals();
 
     static gboolean restartQueue(gpointer user_data);
     static gboolean checkQueue(gpointer user_data);
+    static gboolean recountTimeout(gpointer user_data);
+    static gboolean removeBatchTimeout(gpointer user_data);
+
+    struct DirtyAggregate {
+        AggregateType type;
+        MojObject id;
+        MojObject name;
+    };
 
 private:
-    MojDbServiceClient& dbclient;
+    DatabaseClient& dbclient;
     std::deque<BaseCommand*> commandQueue;
     BaseCommand *currentCommand;
     BaseCommand *previousCommand;
     int restart_timeout;
+    std::map<std::string, DirtyAggregate> dirtyAggregates;
+    std::map<std::string, ImageAlbumCounter> imageAlbumCounters;
+    guint recount_timeout;
+    gint64 firstDirtyTime;
+    std::vector<std::string> pendingRemovals;
+    std::vector<int> pendingRemovalJournalSeqs;
+    guint remove_batch_timeout;
+    std::vector<MojoMediaDatabaseObserver*> observers;
+    gint64 commandStarted;
+    std::deque<BaseCommand*> postponedCommands;
+    std::set<std::string> urgentPaths;
+    bool postponing;
 
     friend class BaseCommand;
 };
@@ -17,8 +17,10 @@ public:
         query.from("com.palm.media.audio.file:1");
         query.where("isRingtone", MojDbQuery::OpEq, MojObject(false));
         query.where("album", MojDbQuery::OpEq, albumName, MojDbCollationPrimary);
+        // we're only interested in the total count of matching items
+        query.limit(1);
 
-        MojErr err = database->databaseClient().find(query_audios_slot, query);
+        MojErr err = database->databaseClient().find(query_audios_slot, query, false, true);
         ErrorToException(err);
     }
 
@@ -30,21 +32,31 @@ protected:
     {
         ResponseToException(response, responseErr);
 
-        MojObject results;
-        MojErr err = response.getRequired("results", results);
+        MojInt64 count = 0;
+        MojErr err = response.getRequired("count", count);
         if (err != MojErrNone) {
             database->finish();
             return MojErrNone;
         }
 
+        MojObject::ObjectVec objects;
+
+        // No track is part of the album anymore so we can drop it
+        if (count == 0) {
+            objects.push(albumIdToMerge);
+            err = database->databaseClient().del(album_update_slot, objects.begin(), objects.end(), MojDbFlagPurge);
+            if (err != MojErrNone)
+                database->finish();
+            return MojErrNone;
+        }
+
         MojObject toMerge;
         toMerge.put("_id", albumIdToMerge);
 
         MojObject totalObj;
-        totalObj.putInt("tracks", results.size());
+        totalObj.putInt("tracks", count);
         toMerge.put("total", totalObj);
 
-        MojObject::ObjectVec objects;
         objects.push(toMerge);
 
         err = database->databaseClient().merge(album_update_slot, objects.begin(), objects.end());
@@ -167,7 +179,7 @@ protected:
             ErrorToException(err);
         }
 
-        database->enqueue(new CountAlbumAudiosCommand(database, albumId, albumName), false);
+        database->markAggregateDirty(AudioAlbumAggregate, albumId, albumName);
 
         // FIXME: generate thumbnails
         database->enqueue(new GenerateAlbumThumbnailsCommand(database, albumId), false);
@@ -205,16 +217,18 @@ public:
         query.from("com.palm.media.audio.file:1");
         query.where("isRingtone", MojDbQuery::OpEq, MojObject(false));
         query.where("genre", MojDbQuery::OpEq, genreName);
+        query.limit(1);
 
-        MojErr err = database->databaseClient().find(query_audios_file_slot, query);
+        MojErr err = database->databaseClient().find(query_audios_file_slot, query, false, true);
         ErrorToException(err);
 
         MojDbQuery query_album;
         query_album.select("_id");
         query_album.from("com.palm.media.audio.album:1");
         query_album.where("genre", MojDbQuery::OpEq, genreName);
+        query_album.limit(1);
 
-        err = database->databaseClient().find(query_audios_album_slot, query_album);
+        err = database->databaseClient().find(query_audios_album_slot, query_album, false, true);
         ErrorToException(err);
     }
 
@@ -227,14 +241,14 @@ protected:
     {
         ResponseToException(response, responseErr);
 
-        MojObject results;
-        MojErr err = response.getRequired("results", results);
+        MojInt64 count = 0;
+        MojErr err = response.getRequired("count", count);
         if (err != MojErrNone) {
             database->finish();
             return MojErrNone;
         }
 
-        total_tracks = results.size();
+        total_tracks = count;
         return updateAudio();
     }
 
@@ -242,14 +256,14 @@ protected:
     {
         ResponseToException(response, responseErr);
 
-        MojObject results;
-        MojErr err = response.getRequired("results", results);
+        MojInt64 count = 0;
+        MojErr err = response.getRequired("count", count);
         if (err != MojErrNone) {
             database->finish();
             return MojErrNone;
         }
 
-        total_albums = results.size();
+        total_albums = count;
         return updateAudio();
     }
 
@@ -258,6 +272,18 @@ protected:
         if ((total_tracks == -1) || (total_albums == -1))
             return MojErrNone;
 
+        MojObject::ObjectVec objects;
+        MojErr err;
+
+        // No track is part of the genre anymore so we can drop it
+        if (total_tracks == 0) {
+            objects.push(genreIdToMerge);
+            err = database->databaseClient().del(genre_update_slot, objects.begin(), objects.end(), MojDbFlagPurge);
+            if (err != MojErrNone)
+                database->finish();
+            return MojErrNone;
+        }
+
         MojObject toMerge;
         toMerge.put("_id", genreIdToMerge);
 
@@ -266,10 +292,9 @@ protected:
         totalObj.putInt("albums", total_albums);
         toMerge.put("total", totalObj);
 
-        MojObject::ObjectVec objects;
         objects.push(toMerge);
 
-        MojErr err = database->databaseClient().merge(genre_update_slot, objects.begin(), objects.end());
+        err = database->databaseClient().merge(genre_update_slot, objects.begin(), objects.end());
         if (err != MojErrNone) {
             database->finish();
             return MojErrNone;
@@ -390,7 +415,7 @@ protected:
             ErrorToException(err);
         }
 
-        database->enqueue(new CountGenreAudiosCommand(database, genreId, genreName), false);
+        database->markAggregateDirty(AudioGenreAggregate, genreId, genreName);
 
         // FIXME: generate thumbnails
         database->enqueue(new GenerateAlbumThumbnailsCommand(database, genreId), false);
@@ -428,16 +453,18 @@ public:
         query.from("com.palm.media.audio.file:1");
         query.where("isRingtone", MojDbQuery::OpEq, MojObject(false));
         query.where("artist", MojDbQuery::OpEq, artistName);
+        query.limit(1);
 
-        MojErr err = database->databaseClient().find(query_audios_file_slot, query);
+        MojErr err = database->databaseClient().find(query_audios_file_slot, query, false, true);
         ErrorToException(err);
 
         MojDbQuery query_album;
         query_album.select("_id");
         query_album.from("com.palm.media.audio.album:1");
         query_album.where("artist", MojDbQuery::OpEq, artistName);
+        query_album.limit(1);
 
-        err = database->databaseClient().find(query_audios_album_slot, query_album);
+        err = database->databaseClient().find(query_audios_album_slot, query_album, false, true);
         ErrorToException(err);
     }
 
@@ -450,14 +477,14 @@ protected:
     {
         ResponseToException(response, responseErr);
 
-        MojObject results;
-        MojErr err = response.getRequired("results", results);
+        MojInt64 count = 0;
+        MojErr err = response.getRequired("count", count);
         if (err != MojErrNone) {
             database->finish();
             return MojErrNone;
         }
 
-        total_tracks = results.size();
+        total_tracks = count;
         return updateAudio();
     }
 
@@ -465,14 +492,14 @@ protected:
     {
         ResponseToException(response, responseErr);
 
-        MojObject results;
-        MojErr err = response.getRequired("results", results);
+        MojInt64 count = 0;
+        MojErr err = response.getRequired("count", count);
         if (err != MojErrNone) {
             database->finish();
             return MojErrNone;
         }
 
-        total_albums = results.size();
+        total_albums = count;
         return updateAudio();
     }
 
@@ -481,6 +508,18 @@ protected:
         if ((total_tracks == -1) || (total_albums == -1))
             return MojErrNone;
 
+        MojObject::ObjectVec objects;
+        MojErr err;
+
+        // No track is part of the artist anymore so we can drop it
+        if (total_tracks == 0) {
+            objects.push(artistIdToMerge);
+            err = database->databaseClient().del(artist_update_slot, objects.begin(), objects.end(), MojDbFlagPurge);
+            if (err != MojErrNone)
+                database->finish();
+            return MojErrNone;
+        }
+
         MojObject toMerge;
         toMerge.put("_id", artistIdToMerge);
 
@@ -489,10 +528,9 @@ protected:
         totalObj.putInt("albums", total_albums);
         toMerge.put("total", totalObj);
 
-        MojObject::ObjectVec objects;
         objects.push(toMerge);
 
-        MojErr err = database->databaseClient().merge(artist_update_slot, objects.begin(), objects.end());
+        err = database->databaseClient().merge(artist_update_slot, objects.begin(), objects.end());
         if (err != MojErrNone) {
             database->finish();
             return MojErrNone;
@@ -613,7 +651,7 @@ protected:
             ErrorToException(err);
         }
 
-        database->enqueue(new CountArtistAudiosCommand(database, artistId, artistName), false);
+        database->markAggregateDirty(AudioArtistAggregate, artistId, artistName);
 
         // FIXME: generate thumbnails
         database->enqueue(new GenerateAlbumThumbnailsCommand(database, artistId), false);
@@ -628,3 +666,95 @@ private:
     MojObject idToUpdate;
     MojObject artistName;
 };
+
+// Audio files only carry the names of their album, genre and artist. Once
+// files are removed the matching aggregates are looked up so their totals
+// get recounted, and empty ones dropped, with the next aggregate update.
+class MarkAudioAggregatesDirtyCommand : public BaseCommand
+{
+public:
+    MarkAudioAggregatesDirtyCommand(MojoMediaDatabase *database, AggregateType type, const std::set<std::string>& names) :
+        BaseCommand("MarkAudioAggregatesDirty", database),
+        query_aggregates_slot(this, &MarkAudioAggregatesDirtyCommand::QueryAggregatesResponse),
+        type(type),
+        names(names.begin(), names.end()),
+        nextName(0)
+    {
+    }
+
+    void execute()
+    {
+        queryNextChunk();
+    }
+
+protected:
+    MojDbClient::Signal::Slot<MarkAudioAggregatesDirtyCommand> query_aggregates_slot;
+
+    const char* kind() const
+    {
+        switch (type) {
+        case AudioGenreAggregate:
+            return "com.palm.media.audio.genre:1";
+        case AudioArtistAggregate:
+            return "com.palm.media.audio.artist:1";
+        default:
+            return "com.palm.media.audio.album:1";
+        }
+    }
+
+    void queryNextChunk()
+    {
+        if (nextName >= names.size()) {
+            database->finish();
+            return;
+        }
+
+        // Passing an array matches all aggregates with one of the names
+        MojObject namesObj(MojObject::TypeArray);
+        for (int n = 0; n < REMOVE_BATCH_CHUNK_SIZE && nextName < names.size(); n++, nextName++) {
+            MojString nameStr;
+            nameStr.assign(names[nextName].c_str());
+            namesObj.push(MojObject(nameStr));
+        }
+
+        MojDbQuery query;
+        query.select("_id");
+        query.select("name");
+        query.from(kind());
+        query.where("name", MojDbQuery::OpEq, namesObj, MojDbCollationPrimary);
+
+        MojErr err = database->databaseClient().find(query_aggregates_slot, query);
+        ErrorToException(err);
+    }
+
+    MojErr QueryAggregatesResponse(MojObject &response, MojErr responseErr)
+    {
+        ResponseToException(response, responseErr);
+
+        MojObject results;
+        MojErr err = response.getRequired("results", results);
+        ErrorToException(err);
+
+        for (int n = 0; n < results.size(); n++) {
+            MojObject item;
+            if (!results.at(n, item))
+                continue;
+
+            MojObject id;
+            MojObject name;
+            if (item.getRequired("_id", id) != MojErrNone || item.getRequired("name", name) != MojErrNone)
+                continue;
+
+            database->markAggregateDirty(type, id, name);
+        }
+
+        queryNextChunk();
+
+        return MojErrNone;
+    }
+
+private:
+    AggregateType type;
+    std::vector<std::string> names;
+    size_t nextName;
+};
@@ -1,57 +1,90 @@
-class CountAlbumImagesCommand : public BaseCommand
+class UpdateImageAlbumCommand : public BaseCommand
 {
 public:
-    CountAlbumImagesCommand(MojoMediaDatabase *database, const MojObject& albumId) :
-        BaseCommand("CountAlbumImagesCommand", database),
-        query_images_slot(this, &CountAlbumImagesCommand::QueryImagesResponse),
-        album_update_slot(this, &CountAlbumImagesCommand::AlbumUpdateResponse),
+    UpdateImageAlbumCommand(MojoMediaDatabase *database, const MojObject& albumId) :
+        BaseCommand("UpdateImageAlbumCommand", database),
+        query_images_slot(this, &UpdateImageAlbumCommand::QueryImagesResponse),
+        album_update_slot(this, &UpdateImageAlbumCommand::AlbumUpdateResponse),
         albumId(albumId)
     {
     }
 
     void execute()
     {
+        // Once we know how many images an album has the counter is kept up to
+        // date incrementally and we don't have to ask the database again.
+        if (database->imageAlbumCounter(albumId).known) {
+            updateAlbum();
+            return;
+        }
+
         MojDbQuery query;
         query.select("_id");
         query.from("com.palm.media.image.file:1");
         query.where("albumId", MojDbQuery::OpEq, albumId);
+        query.limit(1);
 
-        MojErr err = database->databaseClient().find(query_images_slot, query);
+        MojErr err = database->databaseClient().find(query_images_slot, query, false, true);
         ErrorToException(err);
     }
 
 protected:
-    MojDbClient::Signal::Slot<CountAlbumImagesCommand> query_images_slot;
-    MojDbClient::Signal::Slot<CountAlbumImagesCommand> album_update_slot;
+    MojDbClient::Signal::Slot<UpdateImageAlbumCommand> query_images_slot;
+    MojDbClient::Signal::Slot<UpdateImageAlbumCommand> album_update_slot;
 
     MojErr QueryImagesResponse(MojObject &response, MojErr responseErr)
     {
         ResponseToException(response, responseErr);
 
-        MojObject results;
-        MojErr err = response.getRequired("results", results);
+        MojInt64 count = 0;
+        MojErr err = response.getRequired("count", count);
         if (err != MojErrNone) {
             database->finish();
             return MojErrNone;
         }
 
+        ImageAlbumCounter &counter = database->imageAlbumCounter(albumId);
+        counter.count = count;
+        counter.known = true;
+
+        updateAlbum();
+
+        return MojErrNone;
+    }
+
+    void updateAlbum()
+    {
+        MojErr err;
+        const ImageAlbumCounter &counter = database->imageAlbumCounter(albumId);
+
+        // Don't drop the album when there are still images waiting to be
+        // assigned to it
+        if (counter.count <= 0 && counter.pendingAssignments == 0) {
+            // No image is part of the album anymore so we can drop it
+            MojObject::ObjectVec removeIds;
+            removeIds.push(albumId);
+
+            database->forgetImageAlbum(albumId);
+
+            err = database->databaseClient().del(album_update_slot, removeIds.begin(), removeIds.end(), MojDbFlagPurge);
+            if (err != MojErrNone)
+                database->finish();
+            return;
+        }
+
         MojObject toMerge;
         toMerge.put("_id", albumId);
 
         MojObject totalObj;
-        totalObj.putInt("images", results.size());
+        totalObj.putInt("images", std::max(counter.count, 0));
         toMerge.put("total", totalObj);
 
         MojObject::ObjectVec objects;
         objects.push(toMerge);
 
         err = database->databaseClient().merge(album_update_slot, objects.begin(), objects.end());
-        if (err != MojErrNone) {
+        if (err != MojErrNone)
             database->finish();
-            return MojErrNone;
-        }
-
-        return MojErrNone;
     }
 
     MojErr AlbumUpdateResponse(MojObject &response, MojErr responseErr)
@@ -96,7 +129,14 @@ protected:
 
     MojErr ImageUpdateResponse(MojObject &response, MojErr responseErr)
     {
-        database->enqueue(new CountAlbumImagesCommand(database, albumId), false);
+        ImageAlbumCounter &counter = database->imageAlbumCounter(albumId);
+        if (counter.pendingAssignments > 0)
+            counter.pendingAssignments--;
+
+        if (responseErr == MojErrNone)
+            database->adjustImageAlbumCount(albumId, 1);
+        else
+            database->markAggregateDirty(ImageAlbumAggregate, albumId, MojObject());
 
         database->finish();
 
@@ -116,7 +156,8 @@ public:
         query_album_slot(this, &AddAlbumForImageCommand::QueryForAlbumResponse),
         insert_album_slot(this, &AddAlbumForImageCommand::InsertAlbumResponse),
         file(file),
-        idToUpdate(idToUpdate)
+        idToUpdate(idToUpdate),
+        albumCreated(false)
     {
     }
 
@@ -190,6 +231,8 @@ protected:
     {
         ResponseToException(response, responseErr);
 
+        albumCreated = true;
+
         return updateImage(response);
     }
 
@@ -213,6 +256,12 @@ protected:
             ErrorToException(err);
         }
 
+        ImageAlbumCounter &counter = database->imageAlbumCounter(albumId);
+        // A freshly created album is empty so there is no need to count
+        if (albumCreated)
+            counter.known = true;
+        counter.pendingAssignments++;
+
         database->enqueue(new AssignImageToAlbumCommand(database, idToUpdate, albumId), false);
         database->enqueue(new GenerateAlbumThumbnailsCommand(database, albumId), false);
 
@@ -224,6 +273,7 @@ protected:
 private:
     MediaFile file;
     MojObject idToUpdate;
+    bool albumCreated;
 };
 
 class GenerateImageThumbnailCommand : public BaseCommand
@@ -238,6 +288,11 @@ public:
     {
     }
 
+    bool postponable() const
+    {
+        return true;
+    }
+
     void execute()
     {
         // path for thumbnails /media/internal/.thumbnails/<some path>
@@ -258,9 +313,8 @@ public:
             g_mkdir_with_parents(THUMBNAIL_DIR, 0755);
 
         int gridUnit = Settings::LunaSettings()->gridUnit;
-        QImage origImage(QString::fromStdString(imagePath));
-        QImage thumbnailImage = origImage.scaledToWidth((gridUnit * 8), Qt::SmoothTransformation);
-        thumbnailImage.save(QString(thumbnailPath));
+        Thumbnailer thumbnailer(gridUnit * 8);
+        ThumbnailSize size = thumbnailer.generate(imagePath, thumbnailPath);
 
         MojObject toMerge;
         toMerge.put("_id", imageId);
@@ -271,10 +325,10 @@ public:
         appGridThumbnail.putBool("cached", true);
 
         MojObject dimensions;
-        dimensions.putInt("original-height", origImage.height());
-        dimensions.putInt("original-width", origImage.width());
-        dimensions.putInt("output-height", thumbnailImage.height());
-        dimensions.putInt("output-width", thumbnailImage.width());
+        dimensions.putInt("original-height", size.originalHeight);
+        dimensions.putInt("original-width", size.originalWidth);
+        dimensions.putInt("output-height", size.height);
+        dimensions.putInt("output-width", size.width);
         appGridThumbnail.put("dimensions", dimensions);
 
         toMerge.put("appGridThumbnail", appGridThumbnail);
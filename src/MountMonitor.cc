@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include <dirent.h>
+
+#include "MountMonitor.hh"
+
+// udev links every filesystem with a UUID here
+#define DISK_BY_UUID_DIR "/dev/disk/by-uuid"
+
+using namespace std;
+
+namespace mediascanner {
+
+MountMonitor::MountMonitor(const string &basePath, MountMonitorObserver &observer) :
+    basePath(basePath),
+    observer(observer),
+    monitor(0),
+    changed_handler(0)
+{
+}
+
+MountMonitor::~MountMonitor()
+{
+    if (monitor) {
+        g_signal_handler_disconnect(monitor, changed_handler);
+        g_object_unref(monitor);
+    }
+}
+
+void MountMonitor::start()
+{
+    if (monitor)
+        return;
+
+    monitor = g_unix_mount_monitor_get();
+    changed_handler = g_signal_connect(monitor, "mounts-changed",
+                                       G_CALLBACK(mountsChanged), this);
+    update();
+}
+
+void MountMonitor::mountsChanged(GUnixMountMonitor *monitor, gpointer user_data)
+{
+    MountMonitor *mountMonitor = static_cast<MountMonitor*>(user_data);
+    mountMonitor->update();
+}
+
+static string resolvePath(const string &path)
+{
+    char resolved[PATH_MAX];
+    if (!realpath(path.c_str(), resolved))
+        return path;
+    return resolved;
+}
+
+string MountMonitor::lookupUuid(const string &device)
+{
+    unique_ptr<DIR, int(*)(DIR*)> dir(opendir(DISK_BY_UUID_DIR), closedir);
+    if (!dir)
+        return "";
+
+    string devicePath = resolvePath(device);
+    struct dirent *de;
+    while ((de = readdir(dir.get())) != nullptr) {
+        if (de->d_name[0] == '.')
+            continue;
+        if (resolvePath(string(DISK_BY_UUID_DIR "/") + de->d_name) == devicePath)
+            return de->d_name;
+    }
+    return "";
+}
+
+void MountMonitor::update()
+{
+    string prefix = basePath + "/";
+
+    map<string, Volume> mounted;
+    GList *mounts = g_unix_mounts_get(NULL);
+    for (GList *item = mounts; item; item = item->next) {
+        GUnixMountEntry *mount = static_cast<GUnixMountEntry*>(item->data);
+        // Only what a user would see as a volume, not private mounts like
+        // the encrypted store
+        if (g_unix_mount_is_system_internal(mount) ||
+            !g_unix_mount_guess_should_display(mount))
+            continue;
+
+        string mountPoint = g_unix_mount_get_mount_path(mount);
+        if (mountPoint.compare(0, prefix.size(), prefix) != 0)
+            continue;
+
+        Volume volume;
+        volume.mountPoint = mountPoint;
+        volume.device = g_unix_mount_get_device_path(mount);
+        mounted[mountPoint] = volume;
+    }
+    g_list_free_full(mounts, (GDestroyNotify) g_unix_mount_free);
+
+    // Report what went away first, another volume might have taken its place
+    vector<Volume> removed;
+    for (auto &volume : volumes) {
+        auto current = mounted.find(volume.first);
+        if (current == mounted.end() || current->second.device != volume.second.device)
+            removed.push_back(volume.second);
+    }
+    for (auto &volume : removed) {
+        printf("Volume %s was unmounted from %s.\n", volume.device.c_str(),
+               volume.mountPoint.c_str());
+        volumes.erase(volume.mountPoint);
+        observer.volumeUnmounted(volume);
+    }
+
+    for (auto &volume : mounted) {
+        if (volumes.find(volume.first) != volumes.end())
+            continue;
+
+        volume.second.uuid = lookupUuid(volume.second.device);
+        printf("Volume %s (%s) was mounted at %s.\n", volume.second.device.c_str(),
+               volume.second.uuid.empty() ? "no uuid" : volume.second.uuid.c_str(),
+               volume.first.c_str());
+        volumes[volume.first] = volume.second;
+        observer.volumeMounted(volume.second);
+    }
+}
+
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOUNTMONITOR_HH
+#define MOUNTMONITOR_HH
+
+#include <map>
+#include <string>
+
+#include <gio/gunixmounts.h>
+
+namespace mediascanner {
+
+struct Volume {
+    std::string mountPoint;
+    std::string device;
+    // Filesystem UUID, empty if the filesystem doesn't have one
+    std::string uuid;
+};
+
+class MountMonitorObserver
+{
+public:
+    virtual ~MountMonitorObserver() {}
+
+    virtual void volumeMounted(const Volume &volume) = 0;
+    virtual void volumeUnmounted(const Volume &volume) = 0;
+};
+
+/*
+ * Reports filesystems mounted below the base path, e.g. SD cards and USB
+ * sticks showing up below /media.
+ */
+class MountMonitor final {
+public:
+    MountMonitor(const std::string &basePath, MountMonitorObserver &observer);
+    ~MountMonitor();
+    MountMonitor(const MountMonitor&) = delete;
+    MountMonitor& operator=(const MountMonitor&) = delete;
+
+    // Reports everything which is mounted already and starts listening
+    // for changes
+    void start();
+
+private:
+    static void mountsChanged(GUnixMountMonitor *monitor, gpointer user_data);
+    static std::string lookupUuid(const std::string &device);
+    void update();
+
+    std::string basePath;
+    MountMonitorObserver &observer;
+    GUnixMountMonitor *monitor;
+    gulong changed_handler;
+    // Mounted volumes by mount point
+    std::map<std::string, Volume> volumes;
+};
+
+}
+
+#endif
@@ -17,13 +17,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "DirectoryWalker.hh"
 #include "MetadataExtractor.hh"
 #include "Scanner.hh"
+#include "Statistics.hh"
 #include "util.h"
-#include <dirent.h>
-#include <sys/stat.h>
 #include <cstdio>
-#include <memory>
 #include <glib.h>
 
 using namespace std;
@@ -41,42 +40,39 @@ Scanner::~Scanner() {
 vector<DetectedFile> Scanner::scanFiles(MetadataExtractor *extractor, const std::string &root, const MediaType type,
                                         const std::set<std::string>& ignoredDirectories)
 {
+    ScopedTimer timer(ScanStage);
     vector<DetectedFile> result;
-    unique_ptr<DIR, int(*)(DIR*)> dir(opendir(root.c_str()), closedir);
-    printf("In subdir %s\n", root.c_str());
-    if(!dir) {
-        return result;
-    }
+    // Files are always found in the directory entered last
+    vector<bool> detecting;
 
-    if (ignoredDirectories.find(root) != ignoredDirectories.end()) {
-        g_warning("Ignoring directory %s", root.c_str());
-        return result;
-    }
-
-    unique_ptr<struct dirent, void(*)(void*)> entry((dirent*)malloc(sizeof(dirent) + NAME_MAX),
-                free);
-    struct dirent *de;
-    while(readdir_r(dir.get(), entry.get(), &de) == 0 && de ) {
-        struct stat statbuf;
-        string fname = entry.get()->d_name;
-        if(fname[0] == '.') // Ignore hidden files and dirs.
-            continue;
-        string fullpath = root + "/" + fname;
-        lstat(fullpath.c_str(), &statbuf);
-        if(S_ISREG(statbuf.st_mode)) {
-            try {
-                DetectedFile d = extractor->detect(fullpath);
-                if (type == AllMedia || d.type == type) {
-                    result.push_back(d);
-                }
-            } catch (const exception &e) {
-                /* Ignore non-media files */
+    DirectoryWalker walker;
+    walker.enterDirectory = [&](const string &path) {
+        printf("In subdir %s\n", path.c_str());
+        if (ignoredDirectories.find(path) != ignoredDirectories.end()) {
+            g_warning("Ignoring directory %s", path.c_str());
+            return false;
+        }
+        detecting.push_back(!detectFilesIn || detectFilesIn(path));
+        return true;
+    };
+    walker.leaveDirectory = [&](const string &path) {
+        detecting.pop_back();
+    };
+    walker.foundFile = [&](const string &path) {
+        if (!detecting.back())
+            return;
+        statistics().filesDiscovered.add();
+        try {
+            DetectedFile d = extractor->detect(path);
+            if (type == AllMedia || d.type == type) {
+                result.push_back(d);
             }
-        } else if(S_ISDIR(statbuf.st_mode)) {
-            vector<DetectedFile> subdir = scanFiles(extractor, fullpath, type, ignoredDirectories);
-            result.insert(result.end(), subdir.begin(), subdir.end());
+        } catch (const exception &e) {
+            /* Ignore non-media files */
         }
-    }
+    };
+    walker.walk(root);
+
     return result;
 }
 
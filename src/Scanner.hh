@@ -20,6 +20,7 @@
 #ifndef SCANNER_HH_
 #define SCANNER_HH_
 
+#include <functional>
 #include <string>
 #include <vector>
 #include <set>
@@ -36,6 +37,10 @@ public:
     Scanner();
     ~Scanner();
 
+    // Called for every directory which is entered, returning false skips
+    // detecting its files but not its subdirectories
+    std::function<bool(const std::string &directory)> detectFilesIn;
+
     std::vector<DetectedFile> scanFiles(MetadataExtractor *extractor, const std::string &root, const MediaType type,
                                         const std::set<std::string>& ignoredDirectories);
 
@@ -31,6 +31,14 @@ enum MediaType {
     AllMedia,
 };
 
+enum IndexingPriority {
+    // Rate limited and with idle I/O priority, foreground apps come first
+    BackgroundIndexing,
+    NormalIndexing,
+    // Larger batches, for when the user waits for the index
+    HighIndexing,
+};
+
 }
 
 #endif
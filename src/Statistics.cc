@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+
+#include "Statistics.hh"
+
+using namespace std;
+
+namespace mediascanner {
+
+void Counter::raise(uint64_t n)
+{
+    uint64_t current = value();
+    while (current < n && !count.compare_exchange_weak(current, n, memory_order_relaxed))
+        ;
+}
+
+void LatencyHistogram::record(gint64 us)
+{
+    if (us < 0)
+        us = 0;
+
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (us >> bucket) > 0)
+        bucket++;
+
+    count.add();
+    totalUs.add(us);
+    maxUs.raise(us);
+    buckets[bucket].add();
+}
+
+uint64_t LatencyHistogram::percentileUs(unsigned percent) const
+{
+    uint64_t total = 0;
+    for (int n = 0; n < LATENCY_BUCKETS; n++)
+        total += buckets[n].value();
+    if (total == 0)
+        return 0;
+
+    uint64_t wanted = (total * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int n = 0; n < LATENCY_BUCKETS - 1; n++) {
+        seen += buckets[n].value();
+        if (seen >= wanted)
+            return (uint64_t) 1 << n;
+    }
+    return maxUs.value();
+}
+
+const char* Statistics::stageName(StatisticsStage stage)
+{
+    switch (stage) {
+    case ScanStage:
+        return "scan";
+    case DetectStage:
+        return "detect";
+    case ExtractStage:
+        return "extract";
+    case TagStage:
+        return "tags";
+    case StoreStage:
+        return "store";
+    case ThumbnailStage:
+        return "thumbnail";
+    case CommandStage:
+        return "command";
+    default:
+        return "unknown";
+    }
+}
+
+static void logHistogram(const char *name, const LatencyHistogram &histogram)
+{
+    uint64_t count = histogram.count.value();
+    if (count == 0)
+        return;
+
+    printf("  %-28s %8llu calls, avg %8llu us, p50 < %8llu us, p95 < %8llu us, max %8llu us\n",
+           name, (unsigned long long) count,
+           (unsigned long long) (histogram.totalUs.value() / count),
+           (unsigned long long) histogram.percentileUs(50),
+           (unsigned long long) histogram.percentileUs(95),
+           (unsigned long long) histogram.maxUs.value());
+}
+
+void Statistics::logSummary() const
+{
+    printf("Indexed files: %llu discovered, %llu queued, %llu extracted, %llu unchanged, "
+           "%llu failed, %llu committed\n",
+           (unsigned long long) filesDiscovered.value(),
+           (unsigned long long) filesQueued.value(),
+           (unsigned long long) filesExtracted.value(),
+           (unsigned long long) filesUnchanged.value(),
+           (unsigned long long) filesFailed.value(),
+           (unsigned long long) filesCommitted.value());
+    printf("Watched changes: %llu events, %llu files removed, %llu files renamed, "
+           "%llu directories renamed, %llu directories removed\n",
+           (unsigned long long) watchEvents.value(),
+           (unsigned long long) filesRemoved.value(),
+           (unsigned long long) filesRenamed.value(),
+           (unsigned long long) directoriesRenamed.value(),
+           (unsigned long long) directoriesRemoved.value());
+
+    for (int stage = 0; stage < StatisticsStageCount; stage++)
+        logHistogram(stageName((StatisticsStage) stage), latency[stage]);
+    for (auto &command : commandLatency)
+        logHistogram(command.first.c_str(), command.second);
+}
+
+Statistics& statistics()
+{
+    static Statistics instance;
+    return instance;
+}
+
+}
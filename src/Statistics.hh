@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATISTICS_HH
+#define STATISTICS_HH
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include <glib.h>
+
+// Bucket n counts latencies below 2^n microseconds, the last one everything
+// from about 17 seconds on
+#define LATENCY_BUCKETS 26
+
+namespace mediascanner {
+
+enum StatisticsStage {
+    // Walking a whole tree during a scan
+    ScanStage,
+    // Guessing the type of a single file
+    DetectStage,
+    ExtractStage,
+    // Reading the tags of an audio file, part of extracting it
+    TagStage,
+    // Changing the file database
+    StoreStage,
+    // Decoding and scaling an image for its thumbnail
+    ThumbnailStage,
+    // A single command against the media database
+    CommandStage,
+    StatisticsStageCount,
+};
+
+/*
+ * Updated without any ordering, a reader only ever gets a rough snapshot
+ * which is all we need.
+ */
+class Counter {
+public:
+    Counter() : count(0) {}
+
+    void add(uint64_t n = 1) { count.fetch_add(n, std::memory_order_relaxed); }
+    void raise(uint64_t n);
+    uint64_t value() const { return count.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> count;
+};
+
+struct LatencyHistogram {
+    Counter count;
+    Counter totalUs;
+    Counter maxUs;
+    Counter buckets[LATENCY_BUCKETS];
+
+    void record(gint64 us);
+    // Upper bound of the bucket the given share of all samples falls into
+    uint64_t percentileUs(unsigned percent) const;
+};
+
+/*
+ * Counters for everything passing through the indexer since it started.
+ */
+struct Statistics {
+    // Found by a scan or a change event
+    Counter filesDiscovered;
+    // Handed to the extraction queue
+    Counter filesQueued;
+    Counter filesExtracted;
+    // Dropped from the queue as their ETag didn't change
+    Counter filesUnchanged;
+    Counter filesFailed;
+    // Confirmed by the media database
+    Counter filesCommitted;
+    // Read by the watcher and what they came down to besides new files
+    Counter watchEvents;
+    Counter filesRemoved;
+    Counter filesRenamed;
+    Counter directoriesRenamed;
+    Counter directoriesRemoved;
+    LatencyHistogram latency[StatisticsStageCount];
+    // Execute to finish of every kind of media database command, only
+    // touched from the main loop
+    std::map<std::string, LatencyHistogram> commandLatency;
+
+    static const char* stageName(StatisticsStage stage);
+    void logSummary() const;
+};
+
+Statistics& statistics();
+
+/*
+ * Records the time until it goes out of scope.
+ */
+class ScopedTimer final {
+public:
+    explicit ScopedTimer(StatisticsStage stage) :
+        histogram(statistics().latency[stage]),
+        start(g_get_monotonic_time())
+    {
+    }
+
+    ~ScopedTimer()
+    {
+        histogram.record(g_get_monotonic_time() - start);
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    LatencyHistogram &histogram;
+    gint64 start;
+};
+
+}
+
+#endif
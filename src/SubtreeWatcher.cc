@@ -19,54 +19,132 @@
 
 #include "MediaStore.hh"
 #include "MediaFile.hh"
-#include "MetadataExtractor.hh"
+#include "Statistics.hh"
+#include "DirectoryWalker.hh"
+#include "ExtractionQueue.hh"
 #include "SubtreeWatcher.hh"
+#include "WatchTable.hh"
+#include "WatcherBackend.hh"
 #include "util.h"
 
 #include<sys/select.h>
 #include<stdexcept>
 #include<sys/inotify.h>
 #include<dirent.h>
+#include<fcntl.h>
 #include<sys/stat.h>
 #include<unistd.h>
 #include<cstring>
 #include<cerrno>
+#include<ctime>
 #include<string>
+#include<algorithm>
 #include<map>
 #include<memory>
+#include<vector>
 
 #include <glib.h>
 #include <glib-unix.h>
 
 using namespace std;
 
+// File events are collected until PENDING_FILES_QUIET_PERIOD_MS passed
+// without a new one or until this many files are waiting to be processed
+#define PENDING_FILES_BATCH_SIZE 256
+// Directories rechecked per main loop iteration after the event queue overflowed
+#define RECONCILE_DIRECTORIES_PER_ITERATION 16
+// Timestamps on some filesystems are only accurate to a few seconds
+#define RECONCILE_TIMESTAMP_SLACK_S 2
+// Directories we couldn't get a watch for are checked for changes this often
+#define POLL_INTERVAL_S 60
+
 namespace mediascanner {
 
+enum PendingFileOperation {
+    PendingAdd,
+    PendingRemove,
+    // The file was removed and created again
+    PendingReplace,
+};
+
 struct SubtreeWatcherPrivate {
     MediaStore &store; // Hackhackhack, should be replaced with callback object or something.
-    MetadataExtractor &extractor;
-    int inotifyid;
-    // Ideally use boost::bimap or something instead of these two separate objects.
-    std::map<int, std::string> wd2str;
-    std::map<std::string, int> str2wd;
+    ExtractionQueue &queue;
+    std::unique_ptr<WatcherBackend> backend;
+    WatchTable watches;
     bool keep_going;
     std::set<std::string> ignoredDirectories;
 
-    std::unique_ptr<GSource,void(*)(GSource*)> source;
+    std::vector<GSource*> sources;
+
+    // Files with events we haven't processed yet, in the order they came in
+    std::map<std::string, PendingFileOperation> pendingFiles;
+    std::vector<std::string> pendingOrder;
+    guint flush_timeout;
+    gint64 firstPendingTime;
+
+    // Entries moved away which we haven't seen arriving again yet, by cookie
+    struct PendingMove {
+        std::string path;
+        bool is_dir;
+    };
+    std::map<uint32_t, PendingMove> pendingMoves;
+
+    // Reused between wakeups so a burst of events doesn't allocate
+    std::vector<WatchEvent> events;
+    int eventWd;
+    std::string eventDirectory;
+    std::string eventPath;
 
-    SubtreeWatcherPrivate(MediaStore &store, MetadataExtractor &extractor, const std::set<std::string>& ignoredDirectories) :
-        store(store), extractor(extractor),
-        inotifyid(inotify_init()), keep_going(true),
-        source(g_unix_fd_source_new(inotifyid, G_IO_IN), g_source_unref),
-        ignoredDirectories(ignoredDirectories)
+    // We know about every change made before this point in time
+    time_t consistentSince;
+    // Set when the kernel dropped events because its queue overflowed
+    bool overflowed;
+    // Directories which still have to be compared with the store after an
+    // overflow and changes since when we have to look for
+    std::vector<std::string> reconcileQueue;
+    time_t reconcileSince;
+    time_t reconcileStarted;
+    guint reconcile_idle;
+
+    // Once we run out of watches directories which contain files are
+    // preferred, the ones without any get polled instead.
+    std::set<std::string> polledDirectories;
+    std::set<int> fileLessWatches;
+    time_t lastPoll;
+    guint poll_timeout;
+    bool budgetExhausted;
+
+    SubtreeWatcherPrivate(MediaStore &store, ExtractionQueue &queue, const std::set<std::string>& ignoredDirectories,
+                          WatcherBackend *backend) :
+        store(store), queue(queue),
+        backend(backend ? backend : WatcherBackend::create()), keep_going(true),
+        ignoredDirectories(ignoredDirectories),
+        flush_timeout(0),
+        firstPendingTime(0),
+        eventWd(-1),
+        consistentSince(time(nullptr)),
+        overflowed(false),
+        reconcileSince(0),
+        reconcileStarted(0),
+        reconcile_idle(0),
+        lastPoll(0),
+        poll_timeout(0),
+        budgetExhausted(false)
     {
     }
 
     ~SubtreeWatcherPrivate() {
-        for(auto &i : wd2str) {
-            inotify_rm_watch(inotifyid, i.first);
+        if (flush_timeout)
+            g_source_remove(flush_timeout);
+        if (reconcile_idle)
+            g_source_remove(reconcile_idle);
+        if (poll_timeout)
+            g_source_remove(poll_timeout);
+        for(GSource *source : sources) {
+            g_source_destroy(source);
+            g_source_unref(source);
         }
-        close(inotifyid);
     }
 
 };
@@ -77,101 +155,427 @@ static gboolean source_callback(GIOChannel *, GIOCondition, gpointer data) {
     return TRUE;
 }
 
-SubtreeWatcher::SubtreeWatcher(MediaStore &store, MetadataExtractor &extractor,
-                               const std::set<std::string>& ignoredDirectories) {
-    p = new SubtreeWatcherPrivate(store, extractor, ignoredDirectories);
-    if(p->inotifyid == -1) {
-        string msg("Could not init inotify: ");
-        msg += strerror(errno);
-        delete p;
-        throw runtime_error(msg);
+static gboolean flush_callback(gpointer data) {
+    SubtreeWatcher *watcher = static_cast<SubtreeWatcher*>(data);
+    watcher->flushPendingFiles();
+    return FALSE;
+}
+
+static gboolean reconcile_callback(gpointer data) {
+    SubtreeWatcher *watcher = static_cast<SubtreeWatcher*>(data);
+    return watcher->reconcileNextDirectories() ? TRUE : FALSE;
+}
+
+static gboolean poll_callback(gpointer data) {
+    SubtreeWatcher *watcher = static_cast<SubtreeWatcher*>(data);
+    return watcher->pollDirectories() ? TRUE : FALSE;
+}
+
+SubtreeWatcher::SubtreeWatcher(MediaStore &store, ExtractionQueue &queue,
+                               const std::set<std::string>& ignoredDirectories,
+                               WatcherBackend *backend) {
+    p = new SubtreeWatcherPrivate(store, queue, ignoredDirectories, backend);
+    for(int fd : p->backend->fds()) {
+        GSource *source = g_unix_fd_source_new(fd, G_IO_IN);
+        g_source_set_callback(source, reinterpret_cast<GSourceFunc>(source_callback), static_cast<gpointer>(this), nullptr);
+        g_source_attach(source, nullptr);
+        p->sources.push_back(source);
     }
-    g_source_set_callback(p->source.get(), reinterpret_cast<GSourceFunc>(source_callback), static_cast<gpointer>(this), nullptr);
-    g_source_attach(p->source.get(), nullptr);
 }
 
 SubtreeWatcher::~SubtreeWatcher() {
-    g_source_destroy(p->source.get());
     delete p;
 }
 
-void SubtreeWatcher::addDir(const string &root) {
+void SubtreeWatcher::addRoot(const string &root) {
+    addSubtree(root, false);
+}
+
+void SubtreeWatcher::reconcileRoot(const string &root, time_t since) {
+    vector<string> directories;
+    string path;
+    for(int wd : p->watches.watchesBelow(root)) {
+        p->watches.path(wd, path);
+        directories.push_back(path);
+    }
+    forEachPolledBelow(root, [&](const string &path) {
+        directories.push_back(path);
+        return false;
+    });
+    // Parents first, so vanished subdirectories are gone before we get there
+    sort(directories.begin(), directories.end());
+
+    printf("Rechecking %ld directories below %s.\n", (long)directories.size(), root.c_str());
+    for(auto &directory : directories) {
+        if(isTracked(directory))
+            reconcileDirectory(directory, since - RECONCILE_TIMESTAMP_SLACK_S);
+    }
+
+    schedulePendingFiles();
+}
+
+bool SubtreeWatcher::removeRoot(const string &root) {
+    printf("Stopped watching root %s\n", root.c_str());
+
+    stopWatchingBelow(root);
+    bool complete = p->queue.cancelBelowPath(root) == 0;
+
+    // Events we didn't get to yet don't matter anymore
+    string prefix = root + "/";
+    std::map<std::string, PendingFileOperation> pendingFiles;
+    std::vector<std::string> pendingOrder;
+    for(auto &path : p->pendingOrder) {
+        if(path.compare(0, prefix.size(), prefix) == 0) {
+            complete = false;
+            continue;
+        }
+        pendingFiles[path] = p->pendingFiles[path];
+        pendingOrder.push_back(path);
+    }
+    p->pendingFiles.swap(pendingFiles);
+    p->pendingOrder.swap(pendingOrder);
+
+    return complete;
+}
+
+void SubtreeWatcher::stopWatchingBelow(const string &abspath) {
+    forEachPolledBelow(abspath, [](const string &path) {
+        return true;
+    });
+
+    for(int wd : p->watches.watchesBelow(abspath))
+        removeWatch(wd);
+}
+
+void SubtreeWatcher::forEachPolledBelow(const string &abspath,
+                                        const function<bool(const string &path)> &callback) {
+    auto self = p->polledDirectories.find(abspath);
+    if(self != p->polledDirectories.end() && callback(*self))
+        p->polledDirectories.erase(self);
+
+    // Siblings like "<abspath> 2" sort between the directory and the ones
+    // below it
+    string prefix = abspath + "/";
+    for(auto i = p->polledDirectories.lower_bound(prefix); i != p->polledDirectories.end(); ) {
+        if(i->compare(0, prefix.size(), prefix) != 0)
+            break;
+        if(callback(*i))
+            i = p->polledDirectories.erase(i);
+        else
+            ++i;
+    }
+}
+
+void SubtreeWatcher::addSubtree(const string &root, bool queueFiles) {
     if(root[0] != '/')
         throw runtime_error("Path must be absolute.");
 
-    if (p->ignoredDirectories.find(root) != p->ignoredDirectories.end()) {
-        g_warning("Ignoring directory %s", root.c_str());
-        return;
-    }
+    // The watch and whether it has files for every directory we are in
+    struct Level {
+        int wd;
+        bool hasFiles;
+    };
+    vector<Level> levels;
 
-    if(p->str2wd.find(root) != p->str2wd.end())
-        return;
-    unique_ptr<DIR, int(*)(DIR*)> dir(opendir(root.c_str()), closedir);
-    if(!dir) {
-        return;
+    DirectoryWalker walker;
+    walker.enterDirectory = [&](const string &path) {
+        if (p->ignoredDirectories.find(path) != p->ignoredDirectories.end()) {
+            g_warning("Ignoring directory %s", path.c_str());
+            return false;
+        }
+
+        if(isTracked(path))
+            return false;
+
+        int wd = p->backend->addWatch(path);
+        if(wd == -1) {
+            if(errno != ENOSPC) {
+                fprintf(stderr, "Could not create watch object for %s: %s\n", path.c_str(), strerror(errno));
+                return false;
+            }
+            if(!p->budgetExhausted) {
+                fprintf(stderr, "Ran out of watches at %s, %ld watches in total. "
+                        "Directories without files will be polled.\n",
+                        path.c_str(), (long)p->watches.size());
+                p->budgetExhausted = true;
+            }
+        } else {
+            p->watches.add(path, wd);
+            printf("Watching subdirectory %s, %ld watches in total.\n", path.c_str(),
+                    (long)p->watches.size());
+        }
+
+        Level level = { wd, false };
+        levels.push_back(level);
+        return true;
+    };
+    walker.foundFile = [&](const string &path) {
+        levels.back().hasFiles = true;
+        if(queueFiles)
+            queueFile(path, true);
+    };
+    walker.leaveDirectory = [&](const string &path) {
+        Level level = levels.back();
+        levels.pop_back();
+        if(level.wd != -1) {
+            if(!level.hasFiles)
+                p->fileLessWatches.insert(level.wd);
+        } else if(!level.hasFiles || !takeWatchFromFileLessDirectory(path)) {
+            startPolling(path);
+        }
+    };
+    walker.walk(root);
+}
+
+bool SubtreeWatcher::isTracked(const string &abspath) const {
+    return p->watches.contains(abspath) ||
+           p->polledDirectories.find(abspath) != p->polledDirectories.end();
+}
+
+bool SubtreeWatcher::takeWatchFromFileLessDirectory(const string &abspath) {
+    if(p->fileLessWatches.empty())
+        return false;
+
+    int victim = *p->fileLessWatches.begin();
+    p->fileLessWatches.erase(p->fileLessWatches.begin());
+    string victimPath;
+    p->watches.path(victim, victimPath);
+    p->backend->removeWatch(victim);
+    p->watches.remove(victim);
+    startPolling(victimPath);
+
+    int wd = p->backend->addWatch(abspath);
+    if(wd == -1)
+        return false;
+    p->watches.add(abspath, wd);
+    printf("Watching %s instead of %s.\n", abspath.c_str(), victimPath.c_str());
+    return true;
+}
+
+void SubtreeWatcher::startPolling(const string &abspath) {
+    p->polledDirectories.insert(abspath);
+    if(!p->poll_timeout) {
+        p->lastPoll = time(nullptr);
+        p->poll_timeout = g_timeout_add_seconds(POLL_INTERVAL_S, poll_callback, this);
     }
-    int wd = inotify_add_watch(p->inotifyid, root.c_str(),
-            IN_CREATE | IN_DELETE_SELF | IN_DELETE | IN_CLOSE_WRITE |
-            IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
-    if(wd == -1) {
-        fprintf(stderr, "Could not create inotify watch object: %s\n", strerror(errno));
-        return; // Probably ran out of watches, keep monitoring what we can.
+}
+
+bool SubtreeWatcher::pollDirectories() {
+    time_t now = time(nullptr);
+    time_t since = p->lastPoll - RECONCILE_TIMESTAMP_SLACK_S;
+
+    vector<string> polled(p->polledDirectories.begin(), p->polledDirectories.end());
+    for(auto &path : polled) {
+        // Might have disappeared together with its parent already
+        if(p->polledDirectories.find(path) != p->polledDirectories.end())
+            reconcileDirectory(path, since);
     }
-    p->wd2str[wd] = root;
-    p->str2wd[root] = wd;
-    printf("Watching subdirectory %s, %ld watches in total.\n", root.c_str(),
-            (long)p->wd2str.size());
-    unique_ptr<struct dirent, void(*)(void*)> entry((dirent*)malloc(sizeof(dirent) + NAME_MAX),
-                    free);
-    struct dirent *de;
-        while(readdir_r(dir.get(), entry.get(), &de) == 0 && de ) {
-        struct stat statbuf;
-        string fname = entry.get()->d_name;
-        if(fname[0] == '.') // Ignore hidden entries and also "." and "..".
+    p->lastPoll = now;
+
+    schedulePendingFiles();
+
+    if(!p->polledDirectories.empty())
+        return true;
+
+    p->poll_timeout = 0;
+    return false;
+}
+
+// A released watch goes to a directory we had to poll so far
+void SubtreeWatcher::watchPolledDirectory() {
+    while(!p->polledDirectories.empty()) {
+        string path = *p->polledDirectories.begin();
+        int wd = p->backend->addWatch(path);
+        if(wd == -1 && errno == ENOSPC)
+            return;
+        p->polledDirectories.erase(p->polledDirectories.begin());
+        if(wd == -1)
             continue;
-        string fullpath = root + "/" + fname;
-        lstat(fullpath.c_str(), &statbuf);
-        if(S_ISDIR(statbuf.st_mode)) {
-            addDir(fullpath);
-        }
+
+        p->watches.add(path, wd);
+        printf("Watching previously polled directory %s.\n", path.c_str());
+        // Catch up with what happened since we looked at it the last time
+        reconcileDirectory(path, p->lastPoll - RECONCILE_TIMESTAMP_SLACK_S);
+        return;
     }
 }
 
 bool SubtreeWatcher::removeDir(const string &abspath) {
-    if(p->str2wd.find(abspath) == p->str2wd.end())
+    int wd = p->watches.find(abspath);
+    if(wd == -1)
         return false;
-    int wd = p->str2wd[abspath];
-    inotify_rm_watch(p->inotifyid, wd);
-    p->wd2str.erase(wd);
-    p->str2wd.erase(abspath);
+    removeWatch(wd);
+    return true;
+}
+
+void SubtreeWatcher::removeWatch(int wd) {
+    string abspath;
+    p->watches.path(wd, abspath);
+    p->backend->removeWatch(wd);
+    p->watches.remove(wd);
+    p->fileLessWatches.erase(wd);
     printf("Stopped watching %s, %ld directories remain.\n", abspath.c_str(),
-            (long)p->wd2str.size());
-    if(p->wd2str.empty())
+            (long)p->watches.size());
+    if(p->watches.size() == 0 && p->polledDirectories.empty())
         p->keep_going = false;
-    return true;
+
+    if(p->budgetExhausted)
+        watchPolledDirectory();
 }
 
 void SubtreeWatcher::fileAdded(const string &abspath) {
     printf("New file was created: %s.\n", abspath.c_str());
-    try {
-        DetectedFile d = p->extractor.detect(abspath);
-        // Only extract and insert the file if the ETag has changed.
-        if (d.etag != p->store.getETag(d.path)) {
-            p->store.insert(p->extractor.extract(d));
-        }
-    } catch(const exception &e) {
-        fprintf(stderr, "Error when adding new file: %s\n", e.what());
-    }
+    statistics().filesDiscovered.add();
+    // Changes the user just made go ahead of the initial scan
+    p->queue.enqueue(abspath, LivePriority);
 }
 
 void SubtreeWatcher::fileDeleted(const string &abspath) {
     printf("File was deleted: %s\n", abspath.c_str());
+    statistics().filesRemoved.add();
+    p->queue.cancel(abspath);
     p->store.remove(abspath);
 }
 
+void SubtreeWatcher::queueFile(const string &abspath, bool added) {
+    auto pending = p->pendingFiles.find(abspath);
+    if(pending == p->pendingFiles.end()) {
+        p->pendingFiles[abspath] = added ? PendingAdd : PendingRemove;
+        p->pendingOrder.push_back(abspath);
+    } else if(added) {
+        // Repeated writes to the same file only need to be processed once
+        // but a file which was deleted before has to be replaced
+        if(pending->second == PendingRemove)
+            pending->second = PendingReplace;
+    } else {
+        // Whatever happened before doesn't matter once the file is gone
+        pending->second = PendingRemove;
+    }
+}
+
+void SubtreeWatcher::flushPendingFiles() {
+    if(p->flush_timeout) {
+        g_source_remove(p->flush_timeout);
+        p->flush_timeout = 0;
+    }
+
+    // Whatever was moved away and didn't show up again has left our subtree
+    std::map<uint32_t, SubtreeWatcherPrivate::PendingMove> moves;
+    moves.swap(p->pendingMoves);
+    for(auto &move : moves) {
+        if(move.second.is_dir)
+            dirMovedAway(move.second.path);
+        else
+            queueFile(move.second.path, false);
+    }
+
+    // Take over the pending set as processing it might queue new files
+    std::map<std::string, PendingFileOperation> files;
+    std::vector<std::string> order;
+    files.swap(p->pendingFiles);
+    order.swap(p->pendingOrder);
+
+    for(auto &path : order) {
+        switch(files[path]) {
+        case PendingAdd:
+            fileAdded(path);
+            break;
+        case PendingRemove:
+            fileDeleted(path);
+            break;
+        case PendingReplace:
+            fileDeleted(path);
+            fileAdded(path);
+            break;
+        }
+    }
+}
+
+static string extensionOf(const string &path) {
+    string::size_type dot = path.find_last_of("./");
+    if(dot == string::npos || path[dot] != '.')
+        return string();
+    string extension = path.substr(dot + 1);
+    for(auto &c : extension)
+        c = tolower(c);
+    return extension;
+}
+
+void SubtreeWatcher::fileMoved(const string &from, const string &to) {
+    printf("File was moved from %s to %s\n", from.c_str(), to.c_str());
+
+    // Changing the extension might change the type of the file and if we
+    // still have events queued for any of both we can't be sure what's
+    // known about them. Let the regular path sort it out in those cases.
+    if(extensionOf(from) != extensionOf(to) ||
+       p->pendingFiles.find(from) != p->pendingFiles.end() ||
+       p->pendingFiles.find(to) != p->pendingFiles.end()) {
+        queueFile(from, false);
+        queueFile(to, true);
+        return;
+    }
+
+    statistics().filesRenamed.add();
+    p->queue.rename(from, to);
+    p->store.rename(from, to);
+}
+
+void SubtreeWatcher::dirMoved(const string &from, const string &to) {
+    if(!isTracked(from)) {
+        // We didn't watch the old location, so treat it as new directory
+        dirAdded(to);
+        return;
+    }
+
+    if(p->ignoredDirectories.find(to) != p->ignoredDirectories.end()) {
+        dirMovedAway(from);
+        return;
+    }
+
+    printf("Directory was moved from %s to %s\n", from.c_str(), to.c_str());
+    statistics().directoriesRenamed.add();
+
+    // The watches stay intact on a move, only our book keeping needs to know
+    // about the new location. Everything below follows along.
+    p->watches.move(from, to);
+
+    string fromPrefix = from + "/";
+    vector<string> polled;
+    forEachPolledBelow(from, [&](const string &path) {
+        polled.push_back(to + path.substr(from.size()));
+        return true;
+    });
+    p->polledDirectories.insert(polled.begin(), polled.end());
+
+    // Queued events for files below the old location move along
+    std::map<std::string, PendingFileOperation> pendingFiles;
+    for(auto &path : p->pendingOrder) {
+        PendingFileOperation operation = p->pendingFiles[path];
+        if(path.compare(0, fromPrefix.size(), fromPrefix) == 0)
+            path = to + path.substr(from.size());
+        pendingFiles[path] = operation;
+    }
+    p->pendingFiles.swap(pendingFiles);
+
+    p->queue.renameBelowPath(from, to);
+    p->store.renameFilesBelowPath(from, to);
+}
+
+void SubtreeWatcher::dirMovedAway(const string &abspath) {
+    printf("Directory was moved away: %s\n", abspath.c_str());
+    statistics().directoriesRemoved.add();
+
+    stopWatchingBelow(abspath);
+
+    p->queue.cancelBelowPath(abspath);
+    p->store.removeFilesBelowPath(abspath);
+}
+
 void SubtreeWatcher::dirAdded(const string &abspath) {
     printf("New directory was created: %s.\n", abspath.c_str());
-    addDir(abspath);
+    // Files might already be there when the directory was moved in or
+    // created before we got to watch it
+    addSubtree(abspath, true);
 }
 
 void SubtreeWatcher::dirRemoved(const string &abspath) {
@@ -180,79 +584,237 @@ void SubtreeWatcher::dirRemoved(const string &abspath) {
 }
 
 
-void SubtreeWatcher::processEvents() {
-    const int BUFSIZE=4096;
-    char buf[BUFSIZE];
-    bool changed = false;
-    ssize_t num_read;
-    num_read = read(p->inotifyid, buf, BUFSIZE);
-    if(num_read == 0) {
-        printf("Inotify returned 0.\n");
-        return;
-    }
-    if(num_read == -1) {
-        printf("Read error.\n");
+void SubtreeWatcher::handleEvent(const WatchEvent &event) {
+    // Consecutive events mostly belong to the same directory
+    string &directory = p->eventDirectory;
+    string &abspath = p->eventPath;
+
+    statistics().watchEvents.add();
+
+    if(event.mask & IN_Q_OVERFLOW) {
+        p->overflowed = true;
         return;
     }
-    for(char *d = buf; d < buf + num_read;) {
-        struct inotify_event *event = (struct inotify_event *) d;
-        if (p->wd2str.find(event->wd) == p->wd2str.end()) {
+
+    if(event.wd != p->eventWd) {
+        if(!p->watches.path(event.wd, directory)) {
             // Ignore events for unknown watches.  We may receive
             // such events when a directory is removed.
-            d += sizeof(struct inotify_event) + event->len;
+            p->eventWd = -1;
+            return;
+        }
+        p->eventWd = event.wd;
+    }
+
+    if((event.mask & IN_IGNORED) || (event.mask & IN_UNMOUNT) || (event.mask & IN_DELETE_SELF)) {
+        removeWatch(event.wd);
+        p->eventWd = -1;
+        return;
+    }
+
+    abspath.assign(directory);
+    abspath += '/';
+    abspath.append(event.name);
+    // The kernel tells us about directories, deleted entries can't be
+    // looked at anymore anyway.
+    bool is_dir = event.mask & IN_ISDIR;
+
+    if(event.mask & IN_CREATE) {
+        if(is_dir) {
+            dirAdded(abspath);
+            p->eventWd = -1;
+        }
+        // Do not add files upon creation because we can't parse
+        // their metadata until it is fully written.
+    } else if(event.mask & IN_MOVED_FROM) {
+        // Keep it until we know whether it was only moved within our
+        // subtree or moved away
+        SubtreeWatcherPrivate::PendingMove move;
+        move.path = abspath;
+        move.is_dir = is_dir;
+        p->pendingMoves[event.cookie] = move;
+    } else if(event.mask & IN_MOVED_TO) {
+        auto move = p->pendingMoves.find(event.cookie);
+        if(move != p->pendingMoves.end()) {
+            SubtreeWatcherPrivate::PendingMove from = move->second;
+            p->pendingMoves.erase(move);
+            if(from.is_dir)
+                dirMoved(from.path, abspath);
+            else
+                fileMoved(from.path, abspath);
+        } else if(is_dir) {
+            dirAdded(abspath);
+        } else {
+            // Only a file moved in from outside needs a closer look,
+            // it might be a symlink or something else we don't index.
+            struct stat statbuf;
+            if(lstat(abspath.c_str(), &statbuf) == 0 && S_ISREG(statbuf.st_mode))
+                queueFile(abspath, true);
+        }
+        if(!is_dir)
+            p->fileLessWatches.erase(event.wd);
+        p->eventWd = -1;
+    } else if(event.mask & IN_CLOSE_WRITE) {
+        // Only ever reported for files which were opened for writing
+        if(!is_dir) {
+            queueFile(abspath, true);
+            p->fileLessWatches.erase(event.wd);
+        }
+    } else if(event.mask & IN_DELETE) {
+        if(is_dir) {
+            dirRemoved(abspath);
+            p->eventWd = -1;
+        } else {
+            queueFile(abspath, false);
+        }
+    }
+}
+
+void SubtreeWatcher::processEvents() {
+    // Drain everything the kernel has for us so a burst of events is handled
+    // in a single main loop iteration.
+    p->eventWd = -1;
+    while(true) {
+        p->events.clear();
+        p->backend->readEvents(p->events);
+        if(p->events.empty())
+            break;
+        for(auto &event : p->events)
+            handleEvent(event);
+    }
+
+    if(p->overflowed)
+        startReconcile();
+    else if(!p->reconcile_idle)
+        p->consistentSince = time(nullptr);
+
+    schedulePendingFiles();
+}
+
+void SubtreeWatcher::schedulePendingFiles() {
+    if(p->pendingFiles.size() >= PENDING_FILES_BATCH_SIZE) {
+        flushPendingFiles();
+    } else if(p->pendingFiles.size() > 0 || p->pendingMoves.size() > 0) {
+        // Wait until things calm down before we process the files. A copy
+        // that keeps writing for a long time still gets its first files
+        // processed after the maximum delay.
+        gint64 now = g_get_monotonic_time();
+        if(p->flush_timeout == 0) {
+            p->firstPendingTime = now;
+        } else if(now - p->firstPendingTime < PENDING_FILES_MAX_DELAY_US) {
+            g_source_remove(p->flush_timeout);
+            p->flush_timeout = 0;
+        }
+
+        if(p->flush_timeout == 0)
+            p->flush_timeout = g_timeout_add(PENDING_FILES_QUIET_PERIOD_MS, flush_callback, this);
+    }
+}
+
+void SubtreeWatcher::startReconcile() {
+    p->overflowed = false;
+
+    // Another overflow while we are still at it means starting over but we
+    // still have to look for everything since the first one.
+    if(!p->reconcile_idle) {
+        p->reconcileSince = p->consistentSince;
+        p->reconcile_idle = g_idle_add(reconcile_callback, this);
+    }
+    p->reconcileStarted = time(nullptr);
+
+    p->reconcileQueue.clear();
+    string path;
+    for(int wd : p->watches.watches()) {
+        p->watches.path(wd, path);
+        p->reconcileQueue.push_back(path);
+    }
+    // Parents first, so new and vanished subdirectories are found early
+    sort(p->reconcileQueue.rbegin(), p->reconcileQueue.rend());
+
+    printf("Event queue overflowed, rechecking %ld directories.\n",
+           (long)p->reconcileQueue.size());
+}
+
+bool SubtreeWatcher::reconcileNextDirectories() {
+    for(int n = 0; n < RECONCILE_DIRECTORIES_PER_ITERATION && !p->reconcileQueue.empty(); n++) {
+        string path = p->reconcileQueue.back();
+        p->reconcileQueue.pop_back();
+        // Might have disappeared together with its parent already
+        if(p->watches.contains(path))
+            reconcileDirectory(path, p->reconcileSince - RECONCILE_TIMESTAMP_SLACK_S);
+    }
+
+    schedulePendingFiles();
+
+    if(!p->reconcileQueue.empty())
+        return true;
+
+    printf("Finished rechecking directories after event queue overflow.\n");
+    p->consistentSince = p->reconcileStarted;
+    p->reconcile_idle = 0;
+    return false;
+}
+
+void SubtreeWatcher::reconcileDirectory(const string &path, time_t since) {
+    struct stat statbuf;
+    if(lstat(path.c_str(), &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
+        dirMovedAway(path);
+        return;
+    }
+
+    // Entries can only have been added or removed if the directory itself
+    // was modified. Otherwise only the content of files might have changed.
+    bool entriesChanged = statbuf.st_mtime >= since;
+    set<string> known;
+    if(entriesChanged) {
+        for(auto &file : p->store.getFilesInDirectory(path))
+            known.insert(file);
+    }
+
+    unique_ptr<DIR, int(*)(DIR*)> dir(opendir(path.c_str()), closedir);
+    if(!dir)
+        return;
+    string fullpath;
+    struct dirent *de;
+    while((de = readdir(dir.get())) != nullptr) {
+        if(de->d_name[0] == '.') // Ignore hidden entries and also "." and "..".
+            continue;
+        if(fstatat(dirfd(dir.get()), de->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0)
             continue;
+        fullpath.assign(path);
+        fullpath += '/';
+        fullpath += de->d_name;
+        if(S_ISDIR(statbuf.st_mode)) {
+            if(entriesChanged && !isTracked(fullpath))
+                dirAdded(fullpath);
+        } else if(S_ISREG(statbuf.st_mode)) {
+            // The etag check when processing the file sorts out whether it
+            // really has to be extracted again
+            bool isKnown = known.erase(fullpath) > 0;
+            if(statbuf.st_ctime >= since || (entriesChanged && !isKnown))
+                queueFile(fullpath, true);
         }
-        string directory = p->wd2str[event->wd];
-        string filename(event->name);
-        string abspath = directory + '/' + filename;
-        bool is_dir = false;
-        bool is_file = false;
-        struct stat statbuf;
-        lstat(abspath.c_str(), &statbuf);
-        // Remember: these are not valid in case of delete event.
-        if(S_ISDIR(statbuf.st_mode))
-            is_dir = true;
-        if(S_ISREG(statbuf.st_mode))
-            is_file = true;
-
-        if(event->mask & IN_CREATE) {
-            if(is_dir) {
-                dirAdded(abspath);
-                changed = true;
-            }
-            // Do not add files upon creation because we can't parse
-            // their metadata until it is fully written.
-        } else if((event->mask & IN_CLOSE_WRITE) || (event->mask & IN_MOVED_TO)) {
-            if(is_dir) {
-                dirAdded(abspath);
-                changed = true;
-            }
-            if(is_file) {
-                fileAdded(abspath);
-                changed = true;
-            }
-        } else if((event->mask & IN_DELETE) || (event->mask & IN_MOVED_FROM)) {
-            if(p->str2wd.find(abspath) != p->str2wd.end()) {
-                dirRemoved(abspath);
-                changed = true;
-            } else {
-                fileDeleted(abspath);
-                changed = true;
-            }
-        } else if((event->mask & IN_IGNORED) || (event->mask & IN_UNMOUNT) || (event->mask & IN_DELETE_SELF)) {
-            removeDir(abspath);
-            changed = true;
+    }
+
+    // Whatever is left wasn't found anymore
+    for(auto &file : known)
+        queueFile(file, false);
+
+    // Subdirectories we never saw go away while we weren't watching
+    if(entriesChanged) {
+        for(auto &subdirectory : p->store.getSubdirectories(path)) {
+            if(!isTracked(subdirectory) && lstat(subdirectory.c_str(), &statbuf) != 0)
+                dirMovedAway(subdirectory);
         }
-        d += sizeof(struct inotify_event) + event->len;
     }
 }
 
 int SubtreeWatcher::getFd() const {
-    return p->inotifyid;
+    return p->backend->fds().front();
 }
 
 int SubtreeWatcher::directoryCount() const {
-    return (int) p->wd2str.size();
+    return (int) p->watches.size();
 }
 
 }
@@ -20,15 +20,24 @@
 #ifndef SUBTREEWATCHER_HH_
 #define SUBTREEWATCHER_HH_
 
+#include <functional>
 #include <string>
 #include <set>
+#include <ctime>
+
+// File events are collected until no new event arrived for this period
+#define PENDING_FILES_QUIET_PERIOD_MS 500
+// but never longer than this after the first one came in
+#define PENDING_FILES_MAX_DELAY_US (2 * G_USEC_PER_SEC)
 
 namespace mediascanner {
 
 class MediaStore;
-class MetadataExtractor;
+class ExtractionQueue;
+class WatcherBackend;
 
 struct SubtreeWatcherPrivate;
+struct WatchEvent;
 
 class SubtreeWatcher final {
 private:
@@ -36,19 +45,50 @@ private:
     SubtreeWatcherPrivate *p;
     void fileAdded(const std::string &abspath);
     void fileDeleted(const std::string &abspath);
+    void queueFile(const std::string &abspath, bool added);
+    void fileMoved(const std::string &from, const std::string &to);
     void dirAdded(const std::string &abspath);
     void dirRemoved(const std::string &abspath);
+    void dirMoved(const std::string &from, const std::string &to);
+    void dirMovedAway(const std::string &abspath);
+
+    void addSubtree(const std::string &path, bool queueFiles);
 
     bool removeDir(const std::string &abspath);
+    void removeWatch(int wd);
+    void handleEvent(const WatchEvent &event);
+    void schedulePendingFiles();
+    void startReconcile();
+    void reconcileDirectory(const std::string &path, time_t since);
+
+    bool isTracked(const std::string &abspath) const;
+    void stopWatchingBelow(const std::string &abspath);
+    bool takeWatchFromFileLessDirectory(const std::string &abspath);
+    void startPolling(const std::string &abspath);
+    void watchPolledDirectory();
+    // Calls back for the directory and every polled one below it, those the
+    // callback returns true for are not polled anymore
+    void forEachPolledBelow(const std::string &abspath,
+                            const std::function<bool(const std::string &path)> &callback);
 
 public:
-    SubtreeWatcher(MediaStore &store, MetadataExtractor &extractor, const std::set<std::string>& ignoredDirectories);
+    // Takes over the backend, the best one available is used without
+    SubtreeWatcher(MediaStore &store, ExtractionQueue &queue, const std::set<std::string>& ignoredDirectories,
+                   WatcherBackend *backend = nullptr);
     ~SubtreeWatcher();
     SubtreeWatcher(SubtreeWatcher &o) = delete;
     SubtreeWatcher& operator=(SubtreeWatcher &o) = delete;
 
-    void addDir(const std::string &path);
+    void addRoot(const std::string &path);
+    // For a root which was indexed before and is watched again, catches up
+    // with everything which changed since then
+    void reconcileRoot(const std::string &path, time_t since);
+    // Returns false if files below the root were still waiting to be indexed
+    bool removeRoot(const std::string &path);
     void processEvents();
+    void flushPendingFiles();
+    bool reconcileNextDirectories();
+    bool pollDirectories();
     int getFd() const;
     int directoryCount() const;
 };
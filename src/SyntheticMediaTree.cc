@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <stdexcept>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <glib.h>
+#include <QImage>
+
+#include "SyntheticMediaTree.hh"
+
+// Picked from small pools so albums, artists and genres repeat like in a
+// real collection
+#define ARTIST_COUNT 20
+#define ALBUMS_PER_ARTIST 5
+#define GENRE_COUNT 8
+
+// MPEG 1 layer III, 128 kbit/s, 44.1 kHz, no padding
+#define MP3_FRAME_HEADER "\xff\xfb\x90\x64"
+#define MP3_FRAME_SIZE 417
+#define MP3_FRAME_COUNT 16
+
+using namespace std;
+
+namespace mediascanner {
+
+enum SyntheticFileKind {
+    Mp3File,
+    FlacFile,
+    JpegFile,
+    PngFile,
+    Mp4File,
+    SyntheticFileKindCount,
+};
+
+static const char *extensions[SyntheticFileKindCount] = { "mp3", "flac", "jpg", "png", "mp4" };
+
+static void putBigEndian(string &data, uint32_t value, int bytes)
+{
+    for (int n = bytes - 1; n >= 0; n--)
+        data += (char) ((value >> (n * 8)) & 0xff);
+}
+
+static void putLittleEndian(string &data, uint32_t value)
+{
+    for (int n = 0; n < 4; n++)
+        data += (char) ((value >> (n * 8)) & 0xff);
+}
+
+static void writeContent(const string &path, const string &content)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file)
+        throw runtime_error("Could not create " + path);
+    size_t written = fwrite(content.data(), 1, content.size(), file);
+    fclose(file);
+    if (written != content.size())
+        throw runtime_error("Could not write " + path);
+}
+
+SyntheticMediaTree::SyntheticMediaTree(const SyntheticTreeOptions &options) :
+    options(options),
+    random(options.seed)
+{
+}
+
+size_t SyntheticMediaTree::generate(const string &root)
+{
+    random.seed(options.seed);
+    return generateDirectory(root, 0);
+}
+
+size_t SyntheticMediaTree::generateDirectory(const string &path, int level)
+{
+    if (g_mkdir_with_parents(path.c_str(), 0755) != 0)
+        throw runtime_error("Could not create " + path);
+
+    size_t count = 0;
+    for (int n = 0; n < options.filesPerDirectory; n++) {
+        int kind = random() % SyntheticFileKindCount;
+        char name[32];
+        snprintf(name, sizeof(name), "/file%04d.%s", n, extensions[kind]);
+        writeFile(path + name, kind);
+        count++;
+    }
+
+    if (level < options.depth) {
+        for (int n = 0; n < options.fanout; n++) {
+            char name[32];
+            snprintf(name, sizeof(name), "/dir%02d", n);
+            count += generateDirectory(path + name, level + 1);
+        }
+    }
+
+    return count;
+}
+
+void SyntheticMediaTree::writeFile(const string &path, int kind)
+{
+    switch (kind) {
+    case Mp3File:
+        writeContent(path, mp3(randomTags(random() % 20 + 1)));
+        break;
+    case FlacFile:
+        writeContent(path, flac(randomTags(random() % 20 + 1)));
+        break;
+    case JpegFile:
+        writeImage(path, "JPEG");
+        break;
+    case PngFile:
+        writeImage(path, "PNG");
+        break;
+    case Mp4File:
+        writeContent(path, mp4(randomTags(1)));
+        break;
+    }
+}
+
+SyntheticMediaTree::Tags SyntheticMediaTree::randomTags(int track)
+{
+    unsigned artist = random() % ARTIST_COUNT;
+    unsigned album = random() % ALBUMS_PER_ARTIST;
+    Tags tags;
+    tags.title = "Title " + to_string(random() % 100000);
+    tags.artist = "Artist " + to_string(artist);
+    tags.album = "Album " + to_string(artist) + "-" + to_string(album);
+    tags.genre = "Genre " + to_string(random() % GENRE_COUNT);
+    tags.track = track;
+    return tags;
+}
+
+// ID3v2.3 text frame, the size is not synchsafe in this version
+static string id3Frame(const char *id, const string &text)
+{
+    string frame(id);
+    putBigEndian(frame, text.size() + 1, 4);
+    frame.append(2, '\0');
+    // ISO-8859-1
+    frame += '\0';
+    frame += text;
+    return frame;
+}
+
+string SyntheticMediaTree::mp3(const Tags &tags)
+{
+    string frames = id3Frame("TIT2", tags.title) +
+                    id3Frame("TPE1", tags.artist) +
+                    id3Frame("TALB", tags.album) +
+                    id3Frame("TCON", tags.genre) +
+                    id3Frame("TRCK", to_string(tags.track) + "/20");
+
+    string data("ID3\x03\x00\x00", 6);
+    // The tag size is synchsafe, 7 bits per byte
+    uint32_t size = frames.size();
+    for (int n = 3; n >= 0; n--)
+        data += (char) ((size >> (n * 7)) & 0x7f);
+    data += frames;
+
+    for (int n = 0; n < MP3_FRAME_COUNT; n++) {
+        data.append(MP3_FRAME_HEADER, 4);
+        data.append(MP3_FRAME_SIZE - 4, '\0');
+    }
+    return data;
+}
+
+string SyntheticMediaTree::flac(const Tags &tags)
+{
+    string data("fLaC");
+
+    // STREAMINFO: 4096 samples per block, 44.1 kHz, stereo, 16 bit and
+    // an unknown number of samples
+    data += '\0';
+    putBigEndian(data, 34, 3);
+    putBigEndian(data, 4096, 2);
+    putBigEndian(data, 4096, 2);
+    putBigEndian(data, 0, 3);
+    putBigEndian(data, 0, 3);
+    putBigEndian(data, (44100 << 12) | (1 << 9) | (15 << 4), 4);
+    putBigEndian(data, 0, 4);
+    data.append(16, '\0');
+
+    string comments;
+    string vendor("mediaindexer");
+    putLittleEndian(comments, vendor.size());
+    comments += vendor;
+    const string fields[] = {
+        "TITLE=" + tags.title,
+        "ARTIST=" + tags.artist,
+        "ALBUM=" + tags.album,
+        "GENRE=" + tags.genre,
+        "TRACKNUMBER=" + to_string(tags.track) + "/20",
+    };
+    putLittleEndian(comments, sizeof(fields) / sizeof(fields[0]));
+    for (auto &field : fields) {
+        putLittleEndian(comments, field.size());
+        comments += field;
+    }
+
+    // VORBIS_COMMENT as the last metadata block
+    data += (char) (0x80 | 4);
+    putBigEndian(data, comments.size(), 3);
+    data += comments;
+    return data;
+}
+
+static string mp4Box(const char *type, const string &payload)
+{
+    string box;
+    putBigEndian(box, payload.size() + 8, 4);
+    box += type;
+    box += payload;
+    return box;
+}
+
+string SyntheticMediaTree::mp4(const Tags &tags)
+{
+    string ftypPayload("isom");
+    putBigEndian(ftypPayload, 0x200, 4);
+    ftypPayload += "isommp42";
+
+    // Version 0, a timescale of 1000 and a duration of one second
+    string mvhd;
+    putBigEndian(mvhd, 0, 4);
+    putBigEndian(mvhd, 0, 4);
+    putBigEndian(mvhd, 0, 4);
+    putBigEndian(mvhd, 1000, 4);
+    putBigEndian(mvhd, 1000, 4);
+    putBigEndian(mvhd, 0x10000, 4);
+    putBigEndian(mvhd, 0x100, 2);
+    mvhd.append(10, '\0');
+    const uint32_t matrix[9] = { 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000 };
+    for (auto value : matrix)
+        putBigEndian(mvhd, value, 4);
+    mvhd.append(24, '\0');
+    putBigEndian(mvhd, 2, 4);
+
+    string hdlr;
+    putBigEndian(hdlr, 0, 4);
+    putBigEndian(hdlr, 0, 4);
+    hdlr += "mdirappl";
+    hdlr.append(9, '\0');
+
+    // UTF-8 text without a locale
+    string title;
+    putBigEndian(title, 1, 4);
+    putBigEndian(title, 0, 4);
+    title += tags.title;
+    string artist;
+    putBigEndian(artist, 1, 4);
+    putBigEndian(artist, 0, 4);
+    artist += tags.artist;
+    string ilst = mp4Box("\xa9nam", mp4Box("data", title)) +
+                  mp4Box("\xa9" "ART", mp4Box("data", artist));
+
+    string meta;
+    putBigEndian(meta, 0, 4);
+    meta += mp4Box("hdlr", hdlr) + mp4Box("ilst", ilst);
+
+    return mp4Box("ftyp", ftypPayload) +
+           mp4Box("moov", mp4Box("mvhd", mvhd) + mp4Box("udta", mp4Box("meta", meta)));
+}
+
+void SyntheticMediaTree::writeImage(const string &path, const char *format)
+{
+    QImage image(options.imageWidth, options.imageHeight, QImage::Format_RGB32);
+
+    // A gradient with a random tint, so the images neither compress to
+    // nothing nor all look alike
+    unsigned tint = random() & 0xffffff;
+    for (int y = 0; y < options.imageHeight; y++) {
+        uint32_t *line = reinterpret_cast<uint32_t*>(image.scanLine(y));
+        for (int x = 0; x < options.imageWidth; x++)
+            line[x] = 0xff000000 | (tint ^ ((x * 255 / options.imageWidth) << 16) ^
+                                    ((y * 255 / options.imageHeight) << 8) ^ ((x + y) & 0xff));
+    }
+
+    if (!image.save(QString::fromStdString(path), format))
+        throw runtime_error("Could not write " + path);
+}
+
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYNTHETICMEDIATREE_HH
+#define SYNTHETICMEDIATREE_HH
+
+#include <random>
+#include <string>
+
+namespace mediascanner {
+
+struct SyntheticTreeOptions {
+    SyntheticTreeOptions() :
+        depth(3), fanout(4), filesPerDirectory(10), imageWidth(640), imageHeight(480), seed(1) {}
+
+    // Levels of directories below the root
+    int depth;
+    // Subdirectories of every directory above the last level
+    int fanout;
+    int filesPerDirectory;
+    int imageWidth;
+    int imageHeight;
+    unsigned seed;
+};
+
+/*
+ * Writes a directory tree full of small but valid media files: MP3 and
+ * FLAC with tags, JPEG and PNG images and MP4 videos. The same options
+ * always give the same tree.
+ */
+class SyntheticMediaTree final {
+public:
+    explicit SyntheticMediaTree(const SyntheticTreeOptions &options);
+
+    // Returns the number of files written
+    size_t generate(const std::string &root);
+
+private:
+    struct Tags {
+        std::string title;
+        std::string artist;
+        std::string album;
+        std::string genre;
+        int track;
+    };
+
+    size_t generateDirectory(const std::string &path, int level);
+    void writeFile(const std::string &path, int kind);
+    Tags randomTags(int track);
+    std::string mp3(const Tags &tags);
+    std::string flac(const Tags &tags);
+    std::string mp4(const Tags &tags);
+    void writeImage(const std::string &path, const char *format);
+
+    SyntheticTreeOptions options;
+    std::mt19937 random;
+};
+
+}
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QImage>
+
+#include "Statistics.hh"
+#include "Thumbnailer.hh"
+
+namespace mediascanner {
+
+ThumbnailSize Thumbnailer::generate(const std::string &imagePath, const std::string &thumbnailPath)
+{
+    ScopedTimer timer(ThumbnailStage);
+
+    QImage origImage;
+    origImage.load(QString::fromStdString(imagePath));
+    QImage thumbnailImage = origImage.scaledToWidth(width, Qt::SmoothTransformation);
+    thumbnailImage.save(QString::fromStdString(thumbnailPath));
+
+    ThumbnailSize size = { origImage.width(), origImage.height(),
+                           thumbnailImage.width(), thumbnailImage.height() };
+    return size;
+}
+
+}
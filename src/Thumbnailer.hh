@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THUMBNAILER_HH
+#define THUMBNAILER_HH
+
+#include <string>
+
+namespace mediascanner {
+
+struct ThumbnailSize {
+    int originalWidth;
+    int originalHeight;
+    int width;
+    int height;
+};
+
+/*
+ * Scales images down to a fixed width. The format of the thumbnail
+ * follows the extension of its path.
+ */
+class Thumbnailer final {
+public:
+    explicit Thumbnailer(int width) : width(width) {}
+
+    // All sizes are 0 if the image couldn't be read
+    ThumbnailSize generate(const std::string &imagePath, const std::string &thumbnailPath);
+
+private:
+    int width;
+};
+
+}
+
+#endif
@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "WatchTable.hh"
+
+using namespace std;
+
+namespace mediascanner {
+
+// Node 0 is the filesystem root, it is never freed
+#define ROOT_NODE 0
+
+WatchTable::WatchTable()
+{
+    Node root = { -1, intern(""), -1, -1, -1, -1 };
+    nodes.push_back(root);
+}
+
+const string* WatchTable::intern(const string &name)
+{
+    auto entry = names.emplace(name, 0).first;
+    entry->second++;
+    return &entry->first;
+}
+
+void WatchTable::release(const string *name)
+{
+    auto entry = names.find(*name);
+    if (--entry->second == 0)
+        names.erase(entry);
+}
+
+int WatchTable::child(int parent, const string &name) const
+{
+    auto interned = names.find(name);
+    if (interned == names.end())
+        return -1;
+
+    ChildKey key = { parent, &interned->first };
+    auto entry = children.find(key);
+    return entry == children.end() ? -1 : entry->second;
+}
+
+int WatchTable::lookup(const string &path) const
+{
+    int node = ROOT_NODE;
+    string component;
+    string::size_type start = 0;
+
+    while (node != -1 && start < path.size()) {
+        string::size_type end = path.find('/', start);
+        if (end == string::npos)
+            end = path.size();
+        if (end > start) {
+            component.assign(path, start, end - start);
+            node = child(node, component);
+        }
+        start = end + 1;
+    }
+
+    return node;
+}
+
+int WatchTable::lookupOrCreate(const string &path)
+{
+    int node = ROOT_NODE;
+    string component;
+    string::size_type start = 0;
+
+    while (start < path.size()) {
+        string::size_type end = path.find('/', start);
+        if (end == string::npos)
+            end = path.size();
+        if (end > start) {
+            component.assign(path, start, end - start);
+            int next = child(node, component);
+            node = next != -1 ? next : createNode(node, component);
+        }
+        start = end + 1;
+    }
+
+    return node;
+}
+
+int WatchTable::createNode(int parent, const string &name)
+{
+    Node node = { -1, intern(name), -1, -1, -1, -1 };
+
+    int index;
+    if (freeNodes.empty()) {
+        index = (int) nodes.size();
+        nodes.push_back(node);
+    }
+    else {
+        index = freeNodes.back();
+        freeNodes.pop_back();
+        nodes[index] = node;
+    }
+
+    link(index, parent);
+    return index;
+}
+
+void WatchTable::link(int node, int parent)
+{
+    nodes[node].parent = parent;
+    nodes[node].prevSibling = -1;
+    nodes[node].nextSibling = nodes[parent].firstChild;
+    if (nodes[parent].firstChild != -1)
+        nodes[nodes[parent].firstChild].prevSibling = node;
+    nodes[parent].firstChild = node;
+
+    ChildKey key = { parent, nodes[node].name };
+    children[key] = node;
+}
+
+void WatchTable::unlink(int node)
+{
+    Node &entry = nodes[node];
+
+    ChildKey key = { entry.parent, entry.name };
+    children.erase(key);
+
+    if (entry.prevSibling != -1)
+        nodes[entry.prevSibling].nextSibling = entry.nextSibling;
+    else
+        nodes[entry.parent].firstChild = entry.nextSibling;
+    if (entry.nextSibling != -1)
+        nodes[entry.nextSibling].prevSibling = entry.prevSibling;
+
+    entry.parent = entry.prevSibling = entry.nextSibling = -1;
+}
+
+void WatchTable::freeNode(int node)
+{
+    unlink(node);
+    release(nodes[node].name);
+    nodes[node].name = nullptr;
+    if (nodes[node].wd != -1)
+        wdNodes.erase(nodes[node].wd);
+    freeNodes.push_back(node);
+}
+
+void WatchTable::freeSubtree(int node)
+{
+    while (nodes[node].firstChild != -1)
+        freeSubtree(nodes[node].firstChild);
+    freeNode(node);
+}
+
+// Drops nodes which were only kept to reach watched directories below them
+void WatchTable::prune(int node)
+{
+    while (node != ROOT_NODE && nodes[node].wd == -1 && nodes[node].firstChild == -1) {
+        int parent = nodes[node].parent;
+        freeNode(node);
+        node = parent;
+    }
+}
+
+void WatchTable::add(const string &path, int wd)
+{
+    int node = lookupOrCreate(path);
+
+    // The kernel hands out the same descriptor for an inode which is
+    // already watched, keep only the latest path for it.
+    auto existing = wdNodes.find(wd);
+    if (existing != wdNodes.end() && existing->second != node) {
+        int previous = existing->second;
+        nodes[previous].wd = -1;
+        wdNodes.erase(existing);
+        prune(previous);
+    }
+
+    if (nodes[node].wd != -1 && nodes[node].wd != wd)
+        wdNodes.erase(nodes[node].wd);
+
+    nodes[node].wd = wd;
+    wdNodes[wd] = node;
+}
+
+void WatchTable::remove(int wd)
+{
+    auto entry = wdNodes.find(wd);
+    if (entry == wdNodes.end())
+        return;
+
+    int node = entry->second;
+    wdNodes.erase(entry);
+    nodes[node].wd = -1;
+    prune(node);
+}
+
+void WatchTable::move(const string &from, const string &to)
+{
+    int node = lookup(from);
+    if (node == -1 || node == ROOT_NODE)
+        return;
+
+    // Whatever we still knew about the target is gone now
+    int replaced = lookup(to);
+    if (replaced == node)
+        return;
+    if (replaced != -1 && replaced != ROOT_NODE)
+        freeSubtree(replaced);
+
+    string::size_type slash = to.find_last_of('/');
+    int parent = lookupOrCreate(to.substr(0, slash));
+    int oldParent = nodes[node].parent;
+
+    unlink(node);
+    const string *oldName = nodes[node].name;
+    nodes[node].name = intern(to.substr(slash + 1));
+    release(oldName);
+    link(node, parent);
+
+    prune(oldParent);
+}
+
+int WatchTable::find(const string &path) const
+{
+    int node = lookup(path);
+    return node == -1 ? -1 : nodes[node].wd;
+}
+
+bool WatchTable::path(int wd, string &path) const
+{
+    auto entry = wdNodes.find(wd);
+    if (entry == wdNodes.end())
+        return false;
+
+    int node = entry->second;
+    if (node == ROOT_NODE) {
+        path.assign("/");
+        return true;
+    }
+
+    // Size the result first so it is assembled in place back to front
+    size_t length = 0;
+    for (int n = node; n != ROOT_NODE; n = nodes[n].parent)
+        length += nodes[n].name->size() + 1;
+
+    path.resize(length);
+    for (int n = node; n != ROOT_NODE; n = nodes[n].parent) {
+        const string &name = *nodes[n].name;
+        length -= name.size();
+        path.replace(length, name.size(), name);
+        path[--length] = '/';
+    }
+
+    return true;
+}
+
+void WatchTable::collect(int node, vector<int> &wds) const
+{
+    if (nodes[node].wd != -1)
+        wds.push_back(nodes[node].wd);
+    for (int n = nodes[node].firstChild; n != -1; n = nodes[n].nextSibling)
+        collect(n, wds);
+}
+
+vector<int> WatchTable::watchesBelow(const string &path) const
+{
+    vector<int> wds;
+    int node = lookup(path);
+    if (node != -1)
+        collect(node, wds);
+    return wds;
+}
+
+vector<int> WatchTable::watches() const
+{
+    vector<int> wds;
+    wds.reserve(wdNodes.size());
+    for (auto &entry : wdNodes)
+        wds.push_back(entry.first);
+    return wds;
+}
+
+}
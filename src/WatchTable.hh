@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WATCHTABLE_HH
+#define WATCHTABLE_HH
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mediascanner {
+
+/*
+ * Maps inotify watch descriptors to directory paths and back.
+ *
+ * Directories are kept as a tree of nodes which only store their own name
+ * component, shared between all nodes with the same name. Moving a
+ * directory only re-links its node, everything below follows along.
+ */
+class WatchTable final {
+public:
+    WatchTable();
+    WatchTable(const WatchTable &other) = delete;
+    WatchTable& operator=(const WatchTable &other) = delete;
+
+    // Paths have to be absolute and must not end with a slash
+    void add(const std::string &path, int wd);
+    void remove(int wd);
+    void move(const std::string &from, const std::string &to);
+
+    // Returns -1 if the path isn't watched
+    int find(const std::string &path) const;
+    bool contains(const std::string &path) const { return find(path) != -1; }
+    // Replaces the content of path, returns false for unknown watches
+    bool path(int wd, std::string &path) const;
+
+    // All watches for the directory and everything below it
+    std::vector<int> watchesBelow(const std::string &path) const;
+    std::vector<int> watches() const;
+    size_t size() const { return wdNodes.size(); }
+
+private:
+    struct Node {
+        int parent;
+        const std::string *name;
+        int wd;
+        int firstChild;
+        int nextSibling;
+        int prevSibling;
+    };
+
+    struct ChildKey {
+        int parent;
+        const std::string *name;
+        bool operator==(const ChildKey &other) const {
+            return parent == other.parent && name == other.name;
+        }
+    };
+
+    struct ChildKeyHash {
+        size_t operator()(const ChildKey &key) const {
+            return std::hash<const void*>()(key.name) * 31 + key.parent;
+        }
+    };
+
+    const std::string* intern(const std::string &name);
+    void release(const std::string *name);
+
+    int lookup(const std::string &path) const;
+    int lookupOrCreate(const std::string &path);
+    int child(int parent, const std::string &name) const;
+    int createNode(int parent, const std::string &name);
+    void link(int node, int parent);
+    void unlink(int node);
+    void freeNode(int node);
+    void freeSubtree(int node);
+    void prune(int node);
+    void collect(int node, std::vector<int> &wds) const;
+
+    std::vector<Node> nodes;
+    std::vector<int> freeNodes;
+    // Every name component once together with the number of nodes using it
+    std::unordered_map<std::string, unsigned> names;
+    std::unordered_map<ChildKey, int, ChildKeyHash> children;
+    std::unordered_map<int, int> wdNodes;
+};
+
+}
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <cerrno>
+#include <cstring>
+
+#include "WatchTrace.hh"
+
+#define WATCH_TRACE_MAGIC "MIWT"
+#define WATCH_TRACE_VERSION 1
+
+using namespace std;
+
+namespace mediascanner {
+
+TraceRecorder::TraceRecorder(WatcherBackend *backend, const string &path) :
+    backend(backend),
+    file(fopen(path.c_str(), "wb")),
+    lastTime(g_get_monotonic_time())
+{
+    if (!file) {
+        g_warning("Could not create watch trace %s: %s", path.c_str(), strerror(errno));
+        return;
+    }
+
+    uint32_t version = WATCH_TRACE_VERSION;
+    write(WATCH_TRACE_MAGIC, 4);
+    write(&version, sizeof(version));
+    printf("Recording watch events to %s.\n", path.c_str());
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    if (file)
+        fclose(file);
+}
+
+vector<int> TraceRecorder::fds() const
+{
+    return backend->fds();
+}
+
+void TraceRecorder::beginRecord(WatchTraceRecordType type)
+{
+    gint64 now = g_get_monotonic_time();
+    uint32_t delta = (uint32_t) MIN(now - lastTime, (gint64) G_MAXUINT32);
+    lastTime = now;
+
+    uint8_t recordType = type;
+    write(&recordType, sizeof(recordType));
+    write(&delta, sizeof(delta));
+}
+
+void TraceRecorder::write(const void *data, size_t size)
+{
+    if (file && fwrite(data, 1, size, file) != size) {
+        g_warning("Could not write watch trace, stopping to record: %s", strerror(errno));
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+void TraceRecorder::writeString(const char *str)
+{
+    uint16_t length = (uint16_t) MIN(strlen(str), (size_t) G_MAXUINT16);
+    write(&length, sizeof(length));
+    write(str, length);
+}
+
+int TraceRecorder::addWatch(const string &path)
+{
+    int wd = backend->addWatch(path);
+    if (wd == -1 || !file)
+        return wd;
+
+    // The recording must not change errno for our caller
+    int savedErrno = errno;
+    beginRecord(TraceWatchAdded);
+    int32_t recordedWd = wd;
+    write(&recordedWd, sizeof(recordedWd));
+    writeString(path.c_str());
+    errno = savedErrno;
+    return wd;
+}
+
+void TraceRecorder::removeWatch(int wd)
+{
+    backend->removeWatch(wd);
+    if (!file)
+        return;
+
+    beginRecord(TraceWatchRemoved);
+    int32_t recordedWd = wd;
+    write(&recordedWd, sizeof(recordedWd));
+}
+
+void TraceRecorder::readEvents(vector<WatchEvent> &events)
+{
+    size_t first = events.size();
+    backend->readEvents(events);
+    if (!file || events.size() == first)
+        return;
+
+    beginRecord(TraceEvents);
+    uint32_t count = events.size() - first;
+    write(&count, sizeof(count));
+    for (size_t n = first; n < events.size(); n++) {
+        const WatchEvent &event = events[n];
+        int32_t wd = event.wd;
+        write(&wd, sizeof(wd));
+        write(&event.mask, sizeof(event.mask));
+        write(&event.cookie, sizeof(event.cookie));
+        writeString(event.name);
+    }
+
+    // Whatever we have should survive a crash, that's what we're here for
+    if (file)
+        fflush(file);
+}
+
+static bool readValue(FILE *file, void *value, size_t size)
+{
+    return fread(value, 1, size, file) == size;
+}
+
+static bool readString(FILE *file, string &str)
+{
+    uint16_t length;
+    if (!readValue(file, &length, sizeof(length)))
+        return false;
+    str.resize(length);
+    return length == 0 || readValue(file, &str[0], length);
+}
+
+bool readWatchTrace(const string &path, vector<WatchTraceRecord> &records, string &error)
+{
+    unique_ptr<FILE, int(*)(FILE*)> file(fopen(path.c_str(), "rb"), fclose);
+    if (!file) {
+        error = strerror(errno);
+        return false;
+    }
+
+    char magic[4];
+    uint32_t version;
+    if (!readValue(file.get(), magic, sizeof(magic)) || memcmp(magic, WATCH_TRACE_MAGIC, 4) != 0 ||
+        !readValue(file.get(), &version, sizeof(version))) {
+        error = "not a watch trace";
+        return false;
+    }
+    if (version != WATCH_TRACE_VERSION) {
+        error = "unsupported trace version " + to_string(version);
+        return false;
+    }
+
+    gint64 time = 0;
+    uint8_t type;
+    while (readValue(file.get(), &type, sizeof(type))) {
+        WatchTraceRecord record;
+        uint32_t delta;
+        int32_t wd = -1;
+        bool complete = readValue(file.get(), &delta, sizeof(delta));
+        time += delta;
+        record.type = (WatchTraceRecordType) type;
+        record.timeUs = time;
+
+        switch (type) {
+        case TraceWatchAdded:
+            complete = complete && readValue(file.get(), &wd, sizeof(wd)) &&
+                       readString(file.get(), record.path);
+            break;
+        case TraceWatchRemoved:
+            complete = complete && readValue(file.get(), &wd, sizeof(wd));
+            break;
+        case TraceEvents: {
+            uint32_t count = 0;
+            complete = complete && readValue(file.get(), &count, sizeof(count));
+            for (uint32_t n = 0; complete && n < count; n++) {
+                WatchTraceEvent event;
+                int32_t eventWd;
+                complete = readValue(file.get(), &eventWd, sizeof(eventWd)) &&
+                           readValue(file.get(), &event.mask, sizeof(event.mask)) &&
+                           readValue(file.get(), &event.cookie, sizeof(event.cookie)) &&
+                           readString(file.get(), event.name);
+                event.wd = eventWd;
+                record.events.push_back(event);
+            }
+            break;
+        }
+        default:
+            error = "unknown record type " + to_string(type);
+            return false;
+        }
+
+        // The recording might have been cut off in the middle of a record
+        if (!complete)
+            break;
+
+        record.wd = wd;
+        records.push_back(record);
+    }
+
+    return true;
+}
+
+}
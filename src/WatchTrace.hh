@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef WATCHTRACE_HH
+#define WATCHTRACE_HH
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glib.h>
+
+#include "WatcherBackend.hh"
+
+namespace mediascanner {
+
+enum WatchTraceRecordType {
+    TraceWatchAdded = 1,
+    TraceWatchRemoved = 2,
+    // Everything a single read returned
+    TraceEvents = 3,
+};
+
+// Same as a WatchEvent but owning its name
+struct WatchTraceEvent {
+    int wd;
+    uint32_t mask;
+    uint32_t cookie;
+    std::string name;
+};
+
+struct WatchTraceRecord {
+    WatchTraceRecordType type;
+    // Since the recording started
+    gint64 timeUs;
+    int wd;
+    // Only for added watches
+    std::string path;
+    std::vector<WatchTraceEvent> events;
+};
+
+/*
+ * Passes everything through to another backend and writes the watches and
+ * the events read from it to a trace, which can be replayed later. Numbers
+ * are written in host byte order, times as microseconds since the record
+ * before.
+ */
+class TraceRecorder final : public WatcherBackend {
+public:
+    // Takes over the backend, records nothing if the trace can't be created
+    TraceRecorder(WatcherBackend *backend, const std::string &path);
+    ~TraceRecorder();
+
+    std::vector<int> fds() const override;
+    int addWatch(const std::string &path) override;
+    void removeWatch(int wd) override;
+    void readEvents(std::vector<WatchEvent> &events) override;
+
+private:
+    void beginRecord(WatchTraceRecordType type);
+    void write(const void *data, size_t size);
+    void writeString(const char *str);
+
+    std::unique_ptr<WatcherBackend> backend;
+    FILE *file;
+    gint64 lastTime;
+};
+
+// Returns false with a reason in error if the trace can't be read
+bool readWatchTrace(const std::string &path, std::vector<WatchTraceRecord> &records,
+                    std::string &error);
+
+}
+
+#endif
@@ -0,0 +1,367 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <set>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+
+#include "WatcherBackend.hh"
+
+// Enough room for a few thousand events with short names per read
+#define INOTIFY_BUFFER_SIZE (64 * 1024)
+#define FANOTIFY_BUFFER_SIZE (64 * 1024)
+
+using namespace std;
+
+namespace mediascanner {
+
+InotifyBackend::InotifyBackend() :
+    fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+    buffer(INOTIFY_BUFFER_SIZE)
+{
+    if (fd == -1) {
+        string msg("Could not init inotify: ");
+        msg += strerror(errno);
+        throw runtime_error(msg);
+    }
+}
+
+InotifyBackend::~InotifyBackend()
+{
+    // Closing the descriptor drops all watches
+    close(fd);
+}
+
+vector<int> InotifyBackend::fds() const
+{
+    return vector<int>(1, fd);
+}
+
+int InotifyBackend::addWatch(const string &path)
+{
+    return inotify_add_watch(fd, path.c_str(),
+            IN_CREATE | IN_DELETE_SELF | IN_DELETE | IN_CLOSE_WRITE |
+            IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+}
+
+void InotifyBackend::removeWatch(int wd)
+{
+    inotify_rm_watch(fd, wd);
+}
+
+void InotifyBackend::readEvents(vector<WatchEvent> &events)
+{
+    ssize_t num_read;
+    do {
+        num_read = read(fd, buffer.data(), buffer.size());
+    } while (num_read == -1 && errno == EINTR);
+
+    if (num_read == -1) {
+        if (errno != EAGAIN)
+            printf("Read error: %s\n", strerror(errno));
+        return;
+    }
+
+    for (const char *d = buffer.data(); d < buffer.data() + num_read;) {
+        const struct inotify_event *event = (const struct inotify_event *) d;
+        d += sizeof(struct inotify_event) + event->len;
+
+        WatchEvent watchEvent = { event->wd, event->mask, event->cookie,
+                                  event->len > 0 ? event->name : "" };
+        events.push_back(watchEvent);
+    }
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+
+// Keeps our watch descriptors apart from the ones of the inotify fallback
+#define FANOTIFY_WATCH_BASE (1 << 30)
+
+#define FANOTIFY_EVENTS (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | \
+                         FAN_CLOSE_WRITE | FAN_ONDIR)
+
+/*
+ * Marks whole filesystems, which doesn't count against the inotify watch
+ * limit. Events name the directory by its file handle, which we map back to
+ * the watch descriptor we handed out for it. Events for directories we
+ * don't know about are dropped. Filesystems without file handle support
+ * are watched through inotify instead.
+ */
+class FanotifyBackend final : public WatcherBackend {
+public:
+    FanotifyBackend(int fd);
+    ~FanotifyBackend();
+
+    vector<int> fds() const override;
+    int addWatch(const string &path) override;
+    void removeWatch(int wd) override;
+    void readEvents(vector<WatchEvent> &events) override;
+
+private:
+    struct Filesystem {
+        string path;
+        unsigned watches;
+    };
+
+    struct Watch {
+        string handle;
+        string fsid;
+    };
+
+    static void handleKey(string &key, const void *fsid, const struct file_handle *handle);
+    void translate(int wd, uint64_t mask, const char *name, uint32_t cookie,
+                   vector<WatchEvent> &events);
+
+    int fd;
+    vector<char> buffer;
+    string eventKey;
+    int nextWd;
+    // The kernel doesn't pair moves for us, a move is reported as
+    // consecutive events of the renaming process which get the same
+    // cookie from us.
+    uint32_t nextCookie;
+    uint32_t pendingCookie;
+    int32_t pendingPid;
+    unordered_map<string, int> handles;
+    unordered_map<int, Watch> watches;
+    unordered_map<string, Filesystem> filesystems;
+    set<string> unsupported;
+    InotifyBackend fallback;
+};
+
+FanotifyBackend::FanotifyBackend(int fd) :
+    fd(fd),
+    buffer(FANOTIFY_BUFFER_SIZE),
+    nextWd(FANOTIFY_WATCH_BASE),
+    nextCookie(1),
+    pendingCookie(0),
+    pendingPid(0)
+{
+}
+
+FanotifyBackend::~FanotifyBackend()
+{
+    close(fd);
+}
+
+vector<int> FanotifyBackend::fds() const
+{
+    vector<int> result = fallback.fds();
+    result.insert(result.begin(), fd);
+    return result;
+}
+
+void FanotifyBackend::handleKey(string &key, const void *fsid, const struct file_handle *handle)
+{
+    key.assign(static_cast<const char*>(fsid), sizeof(fsid_t));
+    key.append(reinterpret_cast<const char*>(&handle->handle_type), sizeof(handle->handle_type));
+    key.append(reinterpret_cast<const char*>(handle->f_handle), handle->handle_bytes);
+}
+
+int FanotifyBackend::addWatch(const string &path)
+{
+    struct statfs fs;
+    if (statfs(path.c_str(), &fs) != 0)
+        return -1;
+
+    string fsid(reinterpret_cast<const char*>(&fs.f_fsid), sizeof(fs.f_fsid));
+    if (unsupported.find(fsid) != unsupported.end())
+        return fallback.addWatch(path);
+
+    alignas(struct file_handle) char storage[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    struct file_handle *handle = reinterpret_cast<struct file_handle*>(storage);
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    int mountId;
+    if (name_to_handle_at(AT_FDCWD, path.c_str(), handle, &mountId, 0) != 0) {
+        if (errno != EOPNOTSUPP)
+            return -1;
+        printf("No file handles for %s, watching it with inotify.\n", path.c_str());
+        unsupported.insert(fsid);
+        return fallback.addWatch(path);
+    }
+
+    auto filesystem = filesystems.find(fsid);
+    if (filesystem == filesystems.end()) {
+        if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_EVENTS,
+                          AT_FDCWD, path.c_str()) != 0) {
+            printf("Could not watch filesystem of %s with fanotify: %s, using inotify.\n",
+                   path.c_str(), strerror(errno));
+            unsupported.insert(fsid);
+            return fallback.addWatch(path);
+        }
+        printf("Watching filesystem of %s with fanotify.\n", path.c_str());
+        Filesystem entry = { path, 0 };
+        filesystem = filesystems.emplace(fsid, entry).first;
+    }
+
+    string key;
+    handleKey(key, &fs.f_fsid, handle);
+
+    // Same as inotify, a directory only ever has a single watch
+    auto existing = handles.find(key);
+    if (existing != handles.end())
+        return existing->second;
+
+    int wd = nextWd++;
+    handles[key] = wd;
+    Watch watch = { key, fsid };
+    watches[wd] = watch;
+    filesystem->second.watches++;
+    return wd;
+}
+
+void FanotifyBackend::removeWatch(int wd)
+{
+    if (wd < FANOTIFY_WATCH_BASE) {
+        fallback.removeWatch(wd);
+        return;
+    }
+
+    auto watch = watches.find(wd);
+    if (watch == watches.end())
+        return;
+
+    handles.erase(watch->second.handle);
+    auto filesystem = filesystems.find(watch->second.fsid);
+    watches.erase(watch);
+
+    if (filesystem != filesystems.end() && --filesystem->second.watches == 0) {
+        fanotify_mark(fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, FANOTIFY_EVENTS,
+                      AT_FDCWD, filesystem->second.path.c_str());
+        filesystems.erase(filesystem);
+    }
+}
+
+void FanotifyBackend::translate(int wd, uint64_t mask, const char *name, uint32_t cookie,
+                                vector<WatchEvent> &events)
+{
+    uint32_t isDir = (mask & FAN_ONDIR) ? IN_ISDIR : 0;
+
+    // Events for the same name can be merged by the kernel. Reporting the
+    // delete first is right for replaced files and harmless otherwise, as
+    // a file which isn't there anymore can't be added.
+    if (mask & FAN_DELETE) {
+        WatchEvent event = { wd, IN_DELETE | isDir, 0, name };
+        events.push_back(event);
+    }
+    if (mask & FAN_MOVED_FROM) {
+        WatchEvent event = { wd, IN_MOVED_FROM | isDir, cookie, name };
+        events.push_back(event);
+    }
+    if (mask & FAN_CREATE) {
+        WatchEvent event = { wd, IN_CREATE | isDir, 0, name };
+        events.push_back(event);
+    }
+    if (mask & FAN_MOVED_TO) {
+        // Merged with a moved-from it can only be a different entry
+        WatchEvent event = { wd, IN_MOVED_TO | isDir,
+                             (mask & FAN_MOVED_FROM) ? 0 : cookie, name };
+        events.push_back(event);
+    }
+    if (mask & FAN_CLOSE_WRITE) {
+        WatchEvent event = { wd, IN_CLOSE_WRITE, 0, name };
+        events.push_back(event);
+    }
+}
+
+void FanotifyBackend::readEvents(vector<WatchEvent> &events)
+{
+    ssize_t len;
+    do {
+        len = read(fd, buffer.data(), buffer.size());
+    } while (len == -1 && errno == EINTR);
+
+    if (len == -1 && errno != EAGAIN)
+        printf("Read error: %s\n", strerror(errno));
+
+    struct fanotify_event_metadata *metadata =
+        reinterpret_cast<struct fanotify_event_metadata*>(buffer.data());
+    for (; len > 0 && FAN_EVENT_OK(metadata, len); metadata = FAN_EVENT_NEXT(metadata, len)) {
+        if (metadata->vers != FANOTIFY_METADATA_VERSION)
+            continue;
+
+        if (metadata->mask & FAN_Q_OVERFLOW) {
+            WatchEvent event = { -1, IN_Q_OVERFLOW, 0, "" };
+            events.push_back(event);
+            pendingCookie = 0;
+            continue;
+        }
+
+        // A move shows up as moved-from followed by moved-to from the same
+        // process. Renames of other processes can come in between, halves
+        // which can't be paired reliably end up as a delete and an add.
+        bool samePid = pendingCookie && metadata->pid == pendingPid;
+        if (metadata->mask & FAN_MOVED_FROM) {
+            pendingCookie = nextCookie++;
+            pendingPid = metadata->pid;
+            samePid = true;
+            if (nextCookie == 0)
+                nextCookie = 1;
+        }
+        else if (samePid && !(metadata->mask & FAN_MOVED_TO)) {
+            pendingCookie = 0;
+        }
+        uint32_t cookie = samePid ? pendingCookie : 0;
+
+        const char *end = reinterpret_cast<const char*>(metadata) + metadata->event_len;
+        const struct fanotify_event_info_fid *info =
+            reinterpret_cast<const struct fanotify_event_info_fid*>(
+                reinterpret_cast<const char*>(metadata) + metadata->metadata_len);
+        if (reinterpret_cast<const char*>(info) + sizeof(*info) > end ||
+            info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+            continue;
+
+        const struct file_handle *handle =
+            reinterpret_cast<const struct file_handle*>(info->handle);
+        const char *name = reinterpret_cast<const char*>(handle->f_handle) + handle->handle_bytes;
+
+        handleKey(eventKey, &info->fsid, handle);
+        auto watch = handles.find(eventKey);
+        if (watch != handles.end())
+            translate(watch->second, metadata->mask, name, cookie, events);
+
+        // A moved-to without a preceding moved-from came from outside
+        if ((metadata->mask & FAN_MOVED_TO) && samePid)
+            pendingCookie = 0;
+    }
+
+    fallback.readEvents(events);
+}
+
+#endif
+
+WatcherBackend* WatcherBackend::create()
+{
+#ifdef FAN_REPORT_DFID_NAME
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC,
+                           O_RDONLY | O_LARGEFILE);
+    if (fd != -1)
+        return new FanotifyBackend(fd);
+    printf("fanotify is not available: %s, using inotify.\n", strerror(errno));
+#endif
+    return new InotifyBackend();
+}
+
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2014 Simon Busch <morphis@gravedo.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WATCHERBACKEND_HH
+#define WATCHERBACKEND_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mediascanner {
+
+// A change inside a watched directory. Mask and cookie have the same meaning
+// as for inotify, whatever the backend gets from the kernel is translated.
+struct WatchEvent {
+    int wd;
+    uint32_t mask;
+    uint32_t cookie;
+    // Only valid until the next call to readEvents
+    const char *name;
+};
+
+class WatcherBackend {
+public:
+    virtual ~WatcherBackend() {}
+
+    // Descriptors to poll for new events
+    virtual std::vector<int> fds() const = 0;
+    // Returns the watch descriptor or -1 with errno set
+    virtual int addWatch(const std::string &path) = 0;
+    virtual void removeWatch(int wd) = 0;
+    // Appends what is available without blocking, nothing once drained
+    virtual void readEvents(std::vector<WatchEvent> &events) = 0;
+
+    // Uses fanotify where the kernel and our privileges allow it and falls
+    // back to inotify otherwise.
+    static WatcherBackend* create();
+};
+
+class InotifyBackend final : public WatcherBackend {
+public:
+    InotifyBackend();
+    ~InotifyBackend();
+
+    std::vector<int> fds() const override;
+    int addWatch(const std::string &path) override;
+    void removeWatch(int wd) override;
+    void readEvents(std::vector<WatchEvent> &events) override;
+
+private:
+    int fd;
+    std::vector<char> buffer;
+};
+
+}
+
+#endif
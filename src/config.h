@@ -2,5 +2,6 @@
 #define CONFIG_H
 
 #define THUMBNAIL_DIR     "/media/internal/.thumbnails"
+#define LUNA_DATA_DIR     "/var/luna/data"
 
 #endif // CONFIG_H
@@ -76,6 +76,13 @@ public:
         }
     }
 
+    // Allows to step through the statement again with new bindings
+    void reset() {
+        rc = sqlite3_reset(statement);
+        if (rc != SQLITE_OK)
+            throw std::runtime_error(sqlite3_errstr(rc));
+    }
+
     std::string getText(int column) {
         if (rc != SQLITE_ROW)
             throw std::runtime_error("Statement hasn't been executed, or no more results");
@@ -105,6 +112,41 @@ private:
     int rc;
 };
 
+class Transaction {
+public:
+    Transaction(sqlite3 *db) : db(db), committed(false) {
+        execute("BEGIN TRANSACTION");
+    }
+
+    ~Transaction() {
+        if (committed)
+            return;
+        try {
+            execute("ROLLBACK TRANSACTION");
+        } catch(const std::exception &e) {
+            fprintf(stderr, "Error rolling back transaction: %s\n", e.what());
+        }
+    }
+
+    void commit() {
+        execute("COMMIT TRANSACTION");
+        committed = true;
+    }
+
+private:
+    void execute(const char *sql) {
+        char *errmsg = nullptr;
+        if (sqlite3_exec(db, sql, nullptr, nullptr, &errmsg) != SQLITE_OK) {
+            std::string msg(errmsg ? errmsg : sqlite3_errmsg(db));
+            sqlite3_free(errmsg);
+            throw std::runtime_error(msg);
+        }
+    }
+
+    sqlite3 *db;
+    bool committed;
+};
+
 }
 
 #endif